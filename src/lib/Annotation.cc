@@ -21,12 +21,17 @@
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Transforms/Utils/Local.h>
 
 #include "Annotation.h"
 #include "Flags.h"
 #include "Common.h"
 
+#include <map>
+#include <vector>
+
 using namespace llvm;
 
 // static inline bool needAnnotation(Value *V) {
@@ -46,178 +51,256 @@ using namespace llvm;
 //
 // flag stores the arg number of the flag operand
 // size stores the arg number of the size operand
+// names ending with '*' are prefixes, exact names take precedence,
+// then the longest prefix
 //
-bool isAllocFn(StringRef name, int *size, int *flag) {
-  
+namespace {
+struct AllocFnSpec {
+  const char *name;
+  bool isAlloc;
+  int size;
+  int flag;
+};
+}
+
+static const AllocFnSpec DefaultAllocFns[] = {
   // user space
   // malloc/new
-  if (!name.compare("malloc") ||
-      !name.compare("_Znwj") ||
-    !name.compare("_ZnwjRKSt9nothrow_t") ||
-    !name.compare("_Znwm") ||
-    !name.compare("_ZnwmRKSt9nothrow_t") ||
-    !name.compare("_Znaj") ||
-    !name.compare("_ZnajRKSt9nothrow_t") ||
-    !name.compare("_Znam") ||
-    !name.compare("_ZnamRKSt9nothrow_t")) {
-    *size = 0;
-    *flag = -1;
-    return true;
-  }
+  {"malloc",              true,  0, -1},
+  {"_Znwj",               true,  0, -1},
+  {"_ZnwjRKSt9nothrow_t", true,  0, -1},
+  {"_Znwm",               true,  0, -1},
+  {"_ZnwmRKSt9nothrow_t", true,  0, -1},
+  {"_Znaj",               true,  0, -1},
+  {"_ZnajRKSt9nothrow_t", true,  0, -1},
+  {"_Znam",               true,  0, -1},
+  {"_ZnamRKSt9nothrow_t", true,  0, -1},
 
   // kmalloc
   // don't handle variable length yet
-  if (!name.compare("kmalloc_array") ||
-    !name.compare("kcalloc"))
-    return false;
-
-  if (name.startswith("kmalloc") ||
-    name.startswith("__kmalloc") ||
-    name.startswith("kzalloc")) {
-    *size = 0;
-    *flag = 1;
-    return true;
-  }
+  {"kmalloc_array",       false, -1, -1},
+  {"kcalloc",             false, -1, -1},
+  {"kmalloc*",            true,  0, 1},
+  {"__kmalloc*",          true,  0, 1},
+  {"kzalloc*",            true,  0, 1},
 
   // kmem_cache_alloc
-  if (name.startswith("kmem_cache_alloc") ||
-    !name.compare("kmem_cache_zalloc")) {
-    *size = -1;
-    *flag = 1;
-    return true;
-  }
+  {"kmem_cache_alloc*",   true,  -1, 1},
+  {"kmem_cache_zalloc",   true,  -1, 1},
 
   // kmemdup
-  if (!name.compare("kmemdup")) {
-    *size = 1;
-    *flag = 2;
-    return true;
-  }
+  {"kmemdup",             true,  1, 2},
+  {"kstrndup",            false, -1, -1},
+  {"kstrdup",             false, -1, -1},
+  {"krealloc",            true,  1, 2},
+  {"__krealloc",          true,  1, 2},
 
-  if (!name.compare("kstrndup") ||
-      !name.compare("kstrdup"))
-    return false;
-
-  if (!name.compare("krealloc") ||
-    !name.compare("__krealloc")) {
-    *size = 1;
-    *flag = 2;
-    return true;
-  }
-  
   // driver/base
-  if (!name.compare("devm_kzalloc") ||
-    !name.compare("alloc_dr") ||
-    !name.compare("__devres_alloc") ||
-    !name.compare("devres_alloc")) {
-    *size = 1;
-    *flag = 2;
-    return true;
-  }
+  {"devm_kzalloc",        true,  1, 2},
+  {"alloc_dr",            true,  1, 2},
+  {"__devres_alloc",      true,  1, 2},
+  {"devres_alloc",        true,  1, 2},
 
 #if 0
   // page alloc
-  if (!name.compare("__get_free_pages") ||
-    !name.compare("get_zeroed_page"))
-    return 1;
-
-  if (!name.compare("__alloc_pages_nodemask") ||
-    !name.compare("__alloc_pages") ||
-    !name.compare("alloc_pages_current") ||
-    !name.compare("alloc_pages") ||
-    !name.compare("alloc_pages_vma"))
-    return 1;
-
-  if (!name.compare("alloc_pages_node") ||
-    !name.compare("alloc_pages_exact_node") ||
-    !name.compare("alloc_pages_exact") ||
-    !name.compare("alloc_pages_exact_nid"))
-    return 2;
+  {"__get_free_pages",        true, -1, 0},
+  {"get_zeroed_page",         true, -1, 0},
+  {"__alloc_pages_nodemask",  true, -1, 0},
+  {"__alloc_pages",           true, -1, 0},
+  {"alloc_pages_current",     true, -1, 0},
+  {"alloc_pages",             true, -1, 0},
+  {"alloc_pages_vma",         true, -1, 0},
+  {"alloc_pages_node",        true, -1, 1},
+  {"alloc_pages_exact_node",  true, -1, 1},
+  {"alloc_pages_exact",       true, -1, 1},
+  {"alloc_pages_exact_nid",   true, -1, 1},
 
   // pagemap
-  if (!name.compare("__page_cache_alloc"))
-    return 1;
+  {"__page_cache_alloc",      true, -1, 0},
+  {"find_or_create_page",     true, -1, 2},
 
-  if (!name.compare("find_or_create_page"))
-    return 3;
+  // vmalloc, don't really have flags
+  {"vmalloc*",                true, 0, -1},
+  {"vzalloc*",                true, 0, -1},
+  {"__vmalloc",               true, 0, 1},
+  {"__vmalloc_node_range",    true, 0, 4},
 
-  // vmalloc
-  if (name.startswith("vmalloc") ||
-    name.startswith("vzalloc"))
-    return -1; // don't really have flags
+  // DMA related
+  {"dmam_alloc_coherent",     true, 1, 3},
+  {"dmam_alloc_noncoherent",  true, 1, 3},
+  {"dma_alloc_coherent",      true, 1, 3},
+  {"dma_alloc_at_attrs",      true, 1, 3},
+  {"dma_alloc_attrs",         true, 1, 3},
+  {"arm_dma_alloc",           true, 1, 3},
+  {"dma_alloc_writecombine",  true, 1, 3},
+  {"arm_coherent_dma_alloc",  true, 1, 3},
+  {"dma_pool_alloc",          true, -1, 1},
+#endif
 
-  if (!name.compare("__vmalloc"))
-    return 2;
+  // bio
+  {"bio_alloc_bioset",    true,  -1, 0},
+  {"hcd_buffer_alloc",    false, 1, 2},
+  {"sk_prot_alloc",       true,  -1, 1},
+  {"sk_alloc",            true,  -1, 2},
 
-  if (!name.compare("__vmalloc_node_range"))
-    return 5;
+  // mempool
+  // XXX needs special care
+  {"mempool_alloc",       false, -1, 1},
+  {"mempool_alloc_slab",  true,  -1, 0},
+  {"mempool_kmalloc",     true,  -1, 0},
+  {"mempool_alloc_pages", false, -1, -1},
+};
+
+namespace {
+// Exact names are kept in a hash table, prefixes in a trie
+class AllocFnTable {
+  struct TrieNode {
+    std::map<char, unsigned> children;
+    int spec = -1;
+  };
+
+  // names are not needed after the table is built
+  std::vector<AllocFnSpec> specs;
+  StringMap<unsigned> exact;
+  std::vector<TrieNode> trie;
+
+  void add(StringRef name, bool isAlloc, int size, int flag);
+  bool loadSpecFile(StringRef path);
+
+public:
+  AllocFnTable();
+  const AllocFnSpec *lookup(StringRef name) const;
+};
+}
 
-#if 0
-  // DMA related
-  if (!name.compare("dmam_alloc_coherent") ||
-    !name.compare("dmam_alloc_noncoherent") ||
-    !name.compare("dma_alloc_coherent") ||
-    !name.compare("dma_alloc_at_attrs") ||
-    !name.compare("dma_alloc_attrs") ||
-    !name.compare("arm_dma_alloc") ||
-    !name.compare("dma_alloc_writecombine") ||
-    (name.find("swiotlb_alloc_coherent") != llvm::StringRef::npos) ||
-    !name.compare("arm_coherent_dma_alloc"))
-    return 4;
-
-  if (!name.compare("dma_pool_alloc"))
-    return 2;
-#endif
+void AllocFnTable::add(StringRef name, bool isAlloc, int size, int flag) {
+  unsigned idx = specs.size();
+  specs.push_back({nullptr, isAlloc, size, flag});
 
-  // bootmem
-  if (name.find("alloc_bootmem") != llvm::StringRef::npos)
-    return -1;
-#endif
+  if (!name.endswith("*")) {
+    // later entries (e.g., from the spec file) override earlier ones
+    exact[name] = idx;
+    return;
+  }
 
-  // bio
-  if (!name.compare("bio_alloc_bioset")) {
-    *size = -1;
-    *flag = 0;
-    return true;
+  unsigned node = 0;
+  for (char c : name.drop_back()) {
+    auto itr = trie[node].children.find(c);
+    if (itr != trie[node].children.end()) {
+      node = itr->second;
+    } else {
+      trie.emplace_back();
+      trie[node].children[c] = trie.size() - 1;
+      node = trie.size() - 1;
+    }
   }
+  trie[node].spec = idx;
+}
 
-  if (!name.compare("hcd_buffer_alloc")) {
-    *size = 1;
-    *flag = 2;
+//
+// Each line of the spec file is
+//   <name>[*] <size arg> <flag arg> [noalloc]
+// where -1 means no such argument, and noalloc marks functions
+// that should not be treated as allocators
+//
+bool AllocFnTable::loadSpecFile(StringRef path) {
+  auto bufOrErr = MemoryBuffer::getFile(path, /*IsText=*/true);
+  if (!bufOrErr)
     return false;
-  }
 
-  if (!name.compare("sk_prot_alloc")) {
-    *size = -1;
-    *flag = 1;
-    return true;
+  SmallVector<StringRef, 16> lines;
+  (*bufOrErr)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    line = line.split('#').first.trim();
+    if (line.empty())
+      continue;
+
+    SmallVector<StringRef, 4> fields;
+    line.split(fields, ' ', -1, false);
+    int size, flag;
+    if (fields.size() < 3 || fields.size() > 4 ||
+        fields[1].getAsInteger(10, size) || fields[2].getAsInteger(10, flag) ||
+        (fields.size() == 4 && fields[3] != "noalloc")) {
+      WARNING("Invalid allocator spec: " << line << "\n");
+      continue;
+    }
+    add(fields[0], fields.size() == 3, size, flag);
   }
+  return true;
+}
+
+AllocFnTable::AllocFnTable() {
+  trie.emplace_back();
+  for (auto &spec : DefaultAllocFns)
+    add(spec.name, spec.isAlloc, spec.size, spec.flag);
 
-  if (!name.compare("sk_alloc")) {
-    *size = -1;
-    *flag = 2;
-    return true;
+  if (!AllocSpecFile.empty() && !loadSpecFile(AllocSpecFile))
+    WARNING("Cannot load allocator spec file " << AllocSpecFile << "\n");
+}
+
+const AllocFnSpec *AllocFnTable::lookup(StringRef name) const {
+  auto itr = exact.find(name);
+  if (itr != exact.end())
+    return &specs[itr->second];
+
+  // longest matching prefix
+  int spec = trie[0].spec;
+  unsigned node = 0;
+  for (char c : name) {
+    auto child = trie[node].children.find(c);
+    if (child == trie[node].children.end())
+      break;
+    node = child->second;
+    if (trie[node].spec >= 0)
+      spec = trie[node].spec;
   }
+  return spec >= 0 ? &specs[spec] : nullptr;
+}
 
-  // mempool
-  // XXX needs special care
-  if (!name.compare("mempool_alloc")) {
-    *size = -1;
-    *flag = 1;
+static const AllocFnTable &getAllocFnTable() {
+  static AllocFnTable table;
+  return table;
+}
+
+bool isAllocFn(StringRef name, int *size, int *flag) {
+  const AllocFnSpec *spec = getAllocFnTable().lookup(name);
+  if (spec == nullptr)
     return false;
-  }
 
-  if (!name.compare("mempool_alloc_slab") ||
-    !name.compare("mempool_kmalloc")) {
-    *size = -1;
-    *flag = 0;
-    return true;
+  *size = spec->size;
+  *flag = spec->flag;
+  return spec->isAlloc;
+}
+
+namespace {
+struct AllocFnInfo {
+  bool isAlloc;
+  int size;
+  int flag;
+};
+}
+
+// the verdict never changes for a function, so it is computed once for all
+// functions when their module is loaded; afterwards the cache is read-only
+// and can be shared by the parallel analyses
+static DenseMap<const Function*, AllocFnInfo> AllocFnCache;
+
+void cacheAllocFns(const Module *M) {
+  for (const Function &F : *M) {
+    AllocFnInfo info = {false, -1, -1};
+    info.isAlloc = isAllocFn(F.getName(), &info.size, &info.flag);
+    AllocFnCache[&F] = info;
   }
+}
 
-  if (!name.compare("mempool_alloc_pages"))
-    return false;
+bool isAllocFn(const Function *F, int *size, int *flag) {
+  auto itr = AllocFnCache.find(F);
+  if (itr == AllocFnCache.end())
+    return isAllocFn(F->getName(), size, flag);
 
-  return false;
+  *size = itr->second.size;
+  *flag = itr->second.flag;
+  return itr->second.isAlloc;
 }
 
 
@@ -257,6 +340,88 @@ std::string getLoadId(LoadInst *LI) {
   return Anno;
 }
 
+ValueId ValueIdPool::intern(StringRef name) {
+  if (name.empty())
+    return InvalidValueId;
+
+  auto ret = ids.insert(std::make_pair(name, (ValueId)names.size()));
+  if (ret.second)
+    names.push_back(ret.first->getKey());
+  return ret.first->second;
+}
+
+ValueId ValueIdPool::lookup(StringRef name) const {
+  auto itr = ids.find(name);
+  return itr == ids.end() ? InvalidValueId : itr->second;
+}
+
+// compute the identifier string only on the first query of key
+template <typename KeyT, typename FnT>
+static ValueId getCachedId(DenseMap<KeyT, ValueId> &cache, const KeyT &key,
+                           ValueIdPool &pool, FnT makeId) {
+  auto itr = cache.find(key);
+  if (itr != cache.end())
+    return itr->second;
+  ValueId id = pool.intern(makeId());
+  cache[key] = id;
+  return id;
+}
+
+ValueId ValueIdPool::getVarId(const GlobalValue *GV) {
+  return getCachedId(valueIds, (const Value*)GV, *this,
+                     [GV]() { return ::getVarId(GV); });
+}
+
+ValueId ValueIdPool::getArgId(const Function *F, unsigned no) {
+  return getCachedId(argIds, std::make_pair(F, no), *this,
+                     [F, no]() { return ::getArgId(F, no); });
+}
+
+ValueId ValueIdPool::getRetId(const Function *F) {
+  return getCachedId(retIds, F, *this,
+                     [F]() { return ::getRetId(F); });
+}
+
+ValueId ValueIdPool::getRetId(CallInst *CI) {
+  return getCachedId(valueIds, (const Value*)CI, *this,
+                     [CI]() { return ::getRetId(CI); });
+}
+
+ValueId ValueIdPool::getLoadId(LoadInst *LI) {
+  return getCachedId(valueIds, (const Value*)LI, *this,
+                     [LI]() { return ::getLoadId(LI); });
+}
+
+ValueId ValueIdPool::getStoreId(StoreInst *SI) {
+  return getCachedId(valueIds, (const Value*)SI, *this,
+                     [SI]() { return ::getStoreId(SI); });
+}
+
+ValueId ValueIdPool::getStructId(StructType *STy, Module *M, unsigned offset) {
+  // struct types are not shared across modules
+  return getCachedId(fieldIds, std::make_pair((const StructType*)STy, offset), *this,
+                     [STy, M, offset]() { return ::getStructId(STy, M, offset); });
+}
+
+template <typename KeyT>
+static ValueId lookupCachedId(const DenseMap<KeyT, ValueId> &cache, const KeyT &key) {
+  auto itr = cache.find(key);
+  assert(itr != cache.end() && "value id was not computed up front");
+  return itr == cache.end() ? InvalidValueId : itr->second;
+}
+
+ValueId ValueIdPool::lookupArgId(const Function *F, unsigned no) const {
+  return lookupCachedId(argIds, std::make_pair(F, no));
+}
+
+ValueId ValueIdPool::lookupRetId(const Function *F) const {
+  return lookupCachedId(retIds, F);
+}
+
+ValueId ValueIdPool::lookupValueId(const Value *V) const {
+  return lookupCachedId(valueIds, V);
+}
+
 std::string getStructId(Value *PVal, User::op_iterator &IS, User::op_iterator &IE, Module *M) {
 
   Type *PTy = PVal->getType();
@@ -448,8 +613,7 @@ std::string getAnnotation(Value *V, Module *M) {
       Function *F = dyn_cast<Function>(CV);
       if (F != NULL) {
         // check for alloc function
-        StringRef name = F->getName();
-        if (isAllocFn(name)) {
+        if (isAllocFn(F)) {
           // return the loc
           std::string loc;
           raw_string_ostream rso(loc);
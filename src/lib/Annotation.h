@@ -10,7 +10,10 @@
 #include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/Support/Path.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringMap.h>
 #include <string>
+#include <vector>
 #include <llvm/Support/Debug.h>
 
 #include "Common.h"
@@ -124,15 +127,15 @@ static inline std::string getVarId(llvm::AllocaInst *AI) {
   return "lvar." + getScopeName(AI);
 }
 
-static inline std::string getArgId(llvm::Function *F, unsigned no) {
+static inline std::string getArgId(const llvm::Function *F, unsigned no) {
   return "arg." + getScopeName(F) + "." + std::to_string(no);
 }
 
-static inline std::string getArgId(llvm::Argument *A) {
+static inline std::string getArgId(const llvm::Argument *A) {
   return getArgId(A->getParent(), A->getArgNo());
 }
 
-static inline std::string getRetId(llvm::Function *F) {
+static inline std::string getRetId(const llvm::Function *F) {
   return "ret." + getScopeName(F);
 }
 
@@ -174,6 +177,14 @@ static inline bool isAllocFn(llvm::StringRef name) {
   int size, flag;
   return isAllocFn(name, &size, &flag);
 }
+// Cache the verdicts for the functions of M, must be done before the
+// functions are looked up in parallel
+extern void cacheAllocFns(const llvm::Module *M);
+extern bool isAllocFn(const llvm::Function *F, int *size, int *flag);
+static inline bool isAllocFn(const llvm::Function *F) {
+  int size, flag;
+  return isAllocFn(F, &size, &flag);
+}
 
 extern std::string getAnnotation(llvm::Value *V, llvm::Module *M);
 extern std::string getLoadId(llvm::LoadInst *LI);
@@ -182,4 +193,55 @@ extern std::string getAnonStructId(llvm::Value *V, llvm::Module *M, llvm::String
 extern std::string getStructId(llvm::Value *PV, llvm::User::op_iterator &IS, llvm::User::op_iterator &IE,
                                llvm::Module *M);
 
+// Value identifiers interned into compact integers.
+// Each identifier string is built once and kept in the pool,
+// passes should key their maps by ValueId instead of the string.
+typedef unsigned ValueId;
+static const ValueId InvalidValueId = ~0U;
+
+class ValueIdPool {
+private:
+  llvm::StringMap<ValueId> ids;
+  // keys of ids, indexed by ValueId
+  std::vector<llvm::StringRef> names;
+
+  // per value caches, a value only has one kind of identifier
+  llvm::DenseMap<const llvm::Value*, ValueId> valueIds;
+  llvm::DenseMap<std::pair<const llvm::Function*, unsigned>, ValueId> argIds;
+  llvm::DenseMap<const llvm::Function*, ValueId> retIds;
+  llvm::DenseMap<std::pair<const llvm::StructType*, unsigned>, ValueId> fieldIds;
+
+public:
+  // Return InvalidValueId for the empty string
+  ValueId intern(llvm::StringRef name);
+  // Return InvalidValueId if name has not been interned
+  ValueId lookup(llvm::StringRef name) const;
+  llvm::StringRef getName(ValueId id) const {
+    return id == InvalidValueId ? llvm::StringRef() : names[id];
+  }
+  size_t size() const { return names.size(); }
+
+  ValueId getVarId(const llvm::GlobalValue *GV);
+  ValueId getArgId(const llvm::Function *F, unsigned no);
+  ValueId getArgId(const llvm::Argument *A) {
+    return getArgId(A->getParent(), A->getArgNo());
+  }
+  ValueId getRetId(const llvm::Function *F);
+  ValueId getRetId(llvm::CallInst *CI);
+  ValueId getLoadId(llvm::LoadInst *LI);
+  ValueId getStoreId(llvm::StoreInst *SI);
+  ValueId getStructId(llvm::StructType *STy, llvm::Module *M, unsigned offset);
+
+  // Read-only variants for concurrent readers, the identifier must have
+  // been computed by the get* functions above; never interns, a missing one
+  // is InvalidValueId
+  ValueId lookupArgId(const llvm::Function *F, unsigned no) const;
+  ValueId lookupArgId(const llvm::Argument *A) const {
+    return lookupArgId(A->getParent(), A->getArgNo());
+  }
+  ValueId lookupRetId(const llvm::Function *F) const;
+  // loads, stores and call sites
+  ValueId lookupValueId(const llvm::Value *V) const;
+};
+
 #endif
@@ -4,19 +4,347 @@
 #pragma once
 
 #include <llvm/IR/ConstantRange.h>
+#include <llvm/ADT/FoldingSet.h>
+
+#include <memory>
+
+// Wrapped range [Lower, Upper) of an integer of at most 64 bits, bounds are
+// kept as plain integers (bits above Width are always clear).
+// Same semantics as llvm::ConstantRange: Lower == Upper is the full set if
+// both are the max value, the empty set if both are 0.
+struct SmallRange {
+	uint64_t Lower;
+	uint64_t Upper;
+	uint32_t Width;
+
+	static uint64_t mask(uint32_t W) {
+		return W == 64 ? ~0ULL : (1ULL << W) - 1;
+	}
+	static uint64_t signBit(uint32_t W) { return 1ULL << (W - 1); }
+	static int64_t toSigned(uint64_t V, uint32_t W) {
+		return (int64_t)(V << (64 - W)) >> (64 - W);
+	}
+	static unsigned activeBits(uint64_t V) {
+		return V ? 64 - __builtin_clzll(V) : 0;
+	}
+
+	static SmallRange full(uint32_t W) { return { mask(W), mask(W), W }; }
+	static SmallRange empty(uint32_t W) { return { 0, 0, W }; }
+	// non-empty [L, U), L == U is the full set
+	static SmallRange make(uint64_t L, uint64_t U, uint32_t W) {
+		return L == U ? full(W) : SmallRange{ L, U, W };
+	}
+
+	uint64_t mask() const { return mask(Width); }
+	uint64_t signBit() const { return signBit(Width); }
+	bool slt(uint64_t A, uint64_t B) const {
+		return toSigned(A, Width) < toSigned(B, Width);
+	}
+
+	bool isFullSet() const { return Lower == Upper && Lower == mask(); }
+	bool isEmptySet() const { return Lower == Upper && Lower == 0; }
+	bool isUpperWrapped() const { return Lower > Upper; }
+	bool isWrappedSet() const { return Lower > Upper && Upper != 0; }
+	bool isUpperSignWrapped() const { return slt(Upper, Lower); }
+	bool isSignWrappedSet() const {
+		return isUpperSignWrapped() && Upper != signBit();
+	}
+
+	bool operator==(const SmallRange &R) const {
+		return Width == R.Width && Lower == R.Lower && Upper == R.Upper;
+	}
+
+	bool isSizeStrictlySmallerThan(const SmallRange &R) const {
+		if (isFullSet())
+			return false;
+		if (R.isFullSet())
+			return true;
+		return ((Upper - Lower) & mask()) < ((R.Upper - R.Lower) & mask());
+	}
+
+	static SmallRange preferred(const SmallRange &A, const SmallRange &B) {
+		return A.isSizeStrictlySmallerThan(B) ? A : B;
+	}
+
+	uint64_t getUnsignedMin() const {
+		return isFullSet() || isWrappedSet() ? 0 : Lower;
+	}
+	uint64_t getUnsignedMax() const {
+		return isFullSet() || isUpperWrapped() ? mask() : Upper - 1;
+	}
+	uint64_t getSignedMin() const {
+		return isFullSet() || isSignWrappedSet() ? signBit() : Lower;
+	}
+	uint64_t getSignedMax() const {
+		return isFullSet() || isUpperSignWrapped() ?
+			signBit() - 1 : (Upper - 1) & mask();
+	}
+
+	bool contains(const SmallRange &R) const {
+		if (isFullSet() || R.isEmptySet())
+			return true;
+		if (isEmptySet() || R.isFullSet())
+			return false;
+		if (!isUpperWrapped())
+			return !R.isUpperWrapped() && Lower <= R.Lower && R.Upper <= Upper;
+		if (!R.isUpperWrapped())
+			return R.Upper <= Upper || Lower <= R.Lower;
+		return R.Upper <= Upper && Lower <= R.Lower;
+	}
+
+	SmallRange inverse() const {
+		if (isFullSet())
+			return empty(Width);
+		if (isEmptySet())
+			return full(Width);
+		return { Upper, Lower, Width };
+	}
+
+	SmallRange unionWith(const SmallRange &R) const {
+		if (isFullSet() || R.isEmptySet())
+			return *this;
+		if (R.isFullSet() || isEmptySet())
+			return R;
+
+		if (!isUpperWrapped() && R.isUpperWrapped())
+			return R.unionWith(*this);
+
+		if (!isUpperWrapped() && !R.isUpperWrapped()) {
+			if (R.Upper < Lower || Upper < R.Lower)
+				return preferred({ Lower, R.Upper, Width }, { R.Lower, Upper, Width });
+
+			uint64_t L = R.Lower < Lower ? R.Lower : Lower;
+			uint64_t U = ((R.Upper - 1) & mask()) > ((Upper - 1) & mask()) ?
+				R.Upper : Upper;
+			if (L == 0 && U == 0)
+				return full(Width);
+			return { L, U, Width };
+		}
+
+		if (!R.isUpperWrapped()) {
+			if (R.Upper <= Upper || R.Lower >= Lower)
+				return *this;
+			if (R.Lower <= Upper && Lower <= R.Upper)
+				return full(Width);
+			if (Upper < R.Lower && R.Upper < Lower)
+				return preferred({ Lower, R.Upper, Width }, { R.Lower, Upper, Width });
+			if (Upper < R.Lower && Lower <= R.Upper)
+				return { R.Lower, Upper, Width };
+			return { Lower, R.Upper, Width };
+		}
+
+		if (R.Lower <= Upper || Lower <= R.Upper)
+			return full(Width);
+		return { R.Lower < Lower ? R.Lower : Lower,
+				 R.Upper > Upper ? R.Upper : Upper, Width };
+	}
+
+	SmallRange intersectWith(const SmallRange &R) const {
+		if (isEmptySet() || R.isFullSet())
+			return *this;
+		if (R.isEmptySet() || isFullSet())
+			return R;
+
+		if (!isUpperWrapped() && R.isUpperWrapped())
+			return R.intersectWith(*this);
+
+		if (!isUpperWrapped() && !R.isUpperWrapped()) {
+			if (Lower < R.Lower) {
+				if (Upper <= R.Lower)
+					return empty(Width);
+				if (Upper < R.Upper)
+					return { R.Lower, Upper, Width };
+				return R;
+			}
+			if (Upper < R.Upper)
+				return *this;
+			if (Lower < R.Upper)
+				return { Lower, R.Upper, Width };
+			return empty(Width);
+		}
+
+		if (isUpperWrapped() && !R.isUpperWrapped()) {
+			if (R.Lower < Upper) {
+				if (R.Upper < Upper)
+					return R;
+				if (R.Upper <= Lower)
+					return { R.Lower, Upper, Width };
+				return preferred(*this, R);
+			}
+			if (R.Lower < Lower) {
+				if (R.Upper <= Lower)
+					return empty(Width);
+				return { Lower, R.Upper, Width };
+			}
+			return R;
+		}
+
+		if (R.Upper < Upper) {
+			if (R.Lower < Upper)
+				return preferred(*this, R);
+			if (R.Lower < Lower)
+				return { Lower, R.Upper, Width };
+			return R;
+		}
+		if (R.Upper <= Lower) {
+			if (R.Lower < Lower)
+				return *this;
+			return { R.Lower, Upper, Width };
+		}
+		return preferred(*this, R);
+	}
+
+	SmallRange add(const SmallRange &R) const {
+		if (isEmptySet() || R.isEmptySet())
+			return empty(Width);
+		if (isFullSet() || R.isFullSet())
+			return full(Width);
+		SmallRange X = make((Lower + R.Lower) & mask(),
+							(Upper + R.Upper - 1) & mask(), Width);
+		// wrapped around
+		if (X.isSizeStrictlySmallerThan(*this) || X.isSizeStrictlySmallerThan(R))
+			return full(Width);
+		return X;
+	}
+
+	SmallRange sub(const SmallRange &R) const {
+		if (isEmptySet() || R.isEmptySet())
+			return empty(Width);
+		if (isFullSet() || R.isFullSet())
+			return full(Width);
+		SmallRange X = make((Lower - R.Upper + 1) & mask(),
+							(Upper - R.Lower) & mask(), Width);
+		if (X.isSizeStrictlySmallerThan(*this) || X.isSizeStrictlySmallerThan(R))
+			return full(Width);
+		return X;
+	}
+
+	// W > Width
+	SmallRange zeroExtend(uint32_t W) const {
+		if (isEmptySet())
+			return empty(W);
+		if (isFullSet() || isUpperWrapped())
+			return { Upper == 0 ? Lower : 0, 1ULL << Width, W };
+		return { Lower, Upper, W };
+	}
+
+	// W > Width
+	SmallRange signExtend(uint32_t W) const {
+		if (isEmptySet())
+			return empty(W);
+		uint64_t M = mask(W);
+		if (Upper == signBit())
+			return { (uint64_t)toSigned(Lower, Width) & M, Upper, W };
+		if (isFullSet() || isSignWrappedSet())
+			return { M & ~(signBit() - 1), signBit(), W };
+		return { (uint64_t)toSigned(Lower, Width) & M,
+				 (uint64_t)toSigned(Upper, Width) & M, W };
+	}
+
+	// W < Width
+	SmallRange truncate(uint32_t W) const {
+		if (isEmptySet())
+			return empty(W);
+		if (isFullSet())
+			return full(W);
+
+		uint64_t M = mask(W);
+		uint64_t LowerDiv = Lower, UpperDiv = Upper;
+		SmallRange Union = empty(W);
+
+		// [0, Upper) is truncated separately, [Lower, max] as a non-wrapped set
+		if (isUpperWrapped()) {
+			if (activeBits(Upper) > W || (~Upper & M) == 0)
+				return full(W);
+			Union = { M, Upper & M, W };
+			UpperDiv = mask();
+			if (LowerDiv == UpperDiv)
+				return Union;
+		}
+
+		// drop the bits above W
+		if (activeBits(LowerDiv) > W) {
+			uint64_t Adjust = LowerDiv & ~M;
+			LowerDiv -= Adjust;
+			UpperDiv = (UpperDiv - Adjust) & mask();
+		}
+
+		unsigned UpperDivWidth = activeBits(UpperDiv);
+		if (UpperDivWidth <= W)
+			return SmallRange{ LowerDiv & M, UpperDiv & M, W }.unionWith(Union);
+
+		if (UpperDivWidth == W + 1) {
+			UpperDiv &= ~(1ULL << W);
+			if (UpperDiv < LowerDiv)
+				return SmallRange{ LowerDiv & M, UpperDiv & M, W }.unionWith(Union);
+		}
+		return full(W);
+	}
+
+	llvm::ConstantRange toConstantRange() const {
+		if (isFullSet() || isEmptySet())
+			return llvm::ConstantRange(Width, isFullSet());
+		return llvm::ConstantRange(llvm::APInt(Width, Lower), llvm::APInt(Width, Upper));
+	}
+
+	static SmallRange fromConstantRange(const llvm::ConstantRange &CR) {
+		return { CR.getLower().getZExtValue(), CR.getUpper().getZExtValue(),
+				 CR.getBitWidth() };
+	}
+};
+
+class CRange;
+inline llvm::raw_ostream &operator<<(llvm::raw_ostream &OS, const CRange &R);
 
 // llvm::ConstantRange fixup.
-class CRange : public llvm::ConstantRange {
+// Ranges of up to 64 bits use SmallRange, only wider ones (and the
+// operators without a fast path) go through ConstantRange.
+class CRange {
 	typedef llvm::APInt APInt;
-	typedef llvm::ConstantRange super;
+	typedef llvm::ConstantRange ConstantRange;
+
+	SmallRange Small;
+	// only set if the width is above 64
+	std::unique_ptr<ConstantRange> Wide;
+
+	static const uint32_t MaxSmallWidth = 64;
+
+	CRange(const SmallRange &R) : Small(R) {}
+
+	bool isSmall() const { return !Wide; }
+	ConstantRange toConstantRange() const {
+		return isSmall() ? Small.toConstantRange() : *Wide;
+	}
+
 public:
-	CRange(uint32_t BitWidth, bool isFullSet) : super(BitWidth, isFullSet) {}
+	CRange(uint32_t BitWidth, bool isFullSet) {
+		if (BitWidth <= MaxSmallWidth)
+			Small = isFullSet ? SmallRange::full(BitWidth) : SmallRange::empty(BitWidth);
+		else
+			Wide.reset(new ConstantRange(BitWidth, isFullSet));
+	}
 	// Constructors.
-	CRange(const super &CR) : super(CR) {}
+	CRange(const ConstantRange &CR) {
+		if (CR.getBitWidth() <= MaxSmallWidth)
+			Small = SmallRange::fromConstantRange(CR);
+		else
+			Wide.reset(new ConstantRange(CR));
+	}
 	CRange(const APInt &Value)
-		: super(Value) {}
+		: CRange(ConstantRange(Value)) {}
 	CRange(const APInt &Lower, const APInt &Upper)
-		: super(Lower, Upper) {}
+		: CRange(ConstantRange(Lower, Upper)) {}
+
+	CRange(const CRange &R)
+		: Small(R.Small), Wide(R.Wide ? new ConstantRange(*R.Wide) : nullptr) {}
+	CRange(CRange &&R) = default;
+	CRange &operator=(const CRange &R) {
+		Small = R.Small;
+		Wide.reset(R.Wide ? new ConstantRange(*R.Wide) : nullptr);
+		return *this;
+	}
+	CRange &operator=(CRange &&R) = default;
+
 	static CRange makeFullSet(uint32_t BitWidth) {
 		return CRange(BitWidth, true);
 	}
@@ -24,12 +352,145 @@ public:
 		return CRange(BitWidth, false);
 	}
 	static CRange makeICmpRegion(llvm::CmpInst::Predicate Pred, const CRange &other) {
-		return super::makeAllowedICmpRegion(Pred, other);
+		return ConstantRange::makeAllowedICmpRegion(Pred, other.toConstantRange());
+	}
+
+	// Return NULL if the range is wider than 64 bits
+	const SmallRange *getSmall() const { return isSmall() ? &Small : nullptr; }
+
+	uint32_t getBitWidth() const {
+		return isSmall() ? Small.Width : Wide->getBitWidth();
+	}
+	APInt getLower() const {
+		return isSmall() ? APInt(Small.Width, Small.Lower) : Wide->getLower();
+	}
+	APInt getUpper() const {
+		return isSmall() ? APInt(Small.Width, Small.Upper) : Wide->getUpper();
+	}
+
+	bool isFullSet() const {
+		return isSmall() ? Small.isFullSet() : Wide->isFullSet();
+	}
+	bool isEmptySet() const {
+		return isSmall() ? Small.isEmptySet() : Wide->isEmptySet();
+	}
+	bool isWrappedSet() const {
+		return isSmall() ? Small.isWrappedSet() : Wide->isWrappedSet();
+	}
+	bool isSignWrappedSet() const {
+		return isSmall() ? Small.isSignWrappedSet() : Wide->isSignWrappedSet();
+	}
+
+	APInt getUnsignedMin() const {
+		return isSmall() ? APInt(Small.Width, Small.getUnsignedMin()) : Wide->getUnsignedMin();
+	}
+	APInt getUnsignedMax() const {
+		return isSmall() ? APInt(Small.Width, Small.getUnsignedMax()) : Wide->getUnsignedMax();
+	}
+	APInt getSignedMin() const {
+		return isSmall() ? APInt(Small.Width, Small.getSignedMin()) : Wide->getSignedMin();
+	}
+	APInt getSignedMax() const {
+		return isSmall() ? APInt(Small.Width, Small.getSignedMax()) : Wide->getSignedMax();
+	}
+
+	bool operator==(const CRange &R) const {
+		if (isSmall() && R.isSmall())
+			return Small == R.Small;
+		if (getBitWidth() != R.getBitWidth())
+			return false;
+		return toConstantRange() == R.toConstantRange();
+	}
+	bool operator!=(const CRange &R) const { return !(*this == R); }
+
+	bool contains(const CRange &R) const {
+		if (isSmall() && R.isSmall())
+			return Small.contains(R.Small);
+		return toConstantRange().contains(R.toConstantRange());
+	}
+
+	CRange inverse() const {
+		if (isSmall())
+			return Small.inverse();
+		return Wide->inverse();
+	}
+
+	CRange unionWith(const CRange &R) const {
+		if (isSmall() && R.isSmall())
+			return Small.unionWith(R.Small);
+		return toConstantRange().unionWith(R.toConstantRange());
+	}
+	CRange intersectWith(const CRange &R) const {
+		if (isSmall() && R.isSmall())
+			return Small.intersectWith(R.Small);
+		return toConstantRange().intersectWith(R.toConstantRange());
+	}
+
+	CRange add(const CRange &R) const {
+		if (isSmall() && R.isSmall())
+			return Small.add(R.Small);
+		return toConstantRange().add(R.toConstantRange());
+	}
+	CRange sub(const CRange &R) const {
+		if (isSmall() && R.isSmall())
+			return Small.sub(R.Small);
+		return toConstantRange().sub(R.toConstantRange());
+	}
+
+	// no fast path, rare in the kernel or costly to get exactly right
+	CRange multiply(const CRange &R) const {
+		return toConstantRange().multiply(R.toConstantRange());
+	}
+	CRange udiv(const CRange &R) const {
+		return toConstantRange().udiv(R.toConstantRange());
+	}
+	CRange shl(const CRange &R) const {
+		return toConstantRange().shl(R.toConstantRange());
+	}
+	CRange lshr(const CRange &R) const {
+		return toConstantRange().lshr(R.toConstantRange());
+	}
+	CRange binaryAnd(const CRange &R) const {
+		return toConstantRange().binaryAnd(R.toConstantRange());
+	}
+	CRange binaryOr(const CRange &R) const {
+		return toConstantRange().binaryOr(R.toConstantRange());
+	}
+
+	CRange sdiv(const CRange &RHS) const {
+		if (isEmptySet() || RHS.isEmptySet())
+			return makeEmptySet(getBitWidth());
+		// FIXME: too conservative.
+		return makeFullSet(getBitWidth());
+	}
+
+	CRange zeroExtend(uint32_t BitWidth) const {
+		if (isSmall() && BitWidth <= MaxSmallWidth)
+			return Small.zeroExtend(BitWidth);
+		return toConstantRange().zeroExtend(BitWidth);
+	}
+	CRange signExtend(uint32_t BitWidth) const {
+		if (isSmall() && BitWidth <= MaxSmallWidth)
+			return Small.signExtend(BitWidth);
+		return toConstantRange().signExtend(BitWidth);
+	}
+	CRange truncate(uint32_t BitWidth) const {
+		if (isSmall())
+			return Small.truncate(BitWidth);
+		return toConstantRange().truncate(BitWidth);
+	}
+	CRange zextOrTrunc(uint32_t BitWidth) const {
+		uint32_t W = getBitWidth();
+		if (W < BitWidth)
+			return zeroExtend(BitWidth);
+		if (W > BitWidth)
+			return truncate(BitWidth);
+		return *this;
 	}
 
 	void match(const CRange &R) {
 		if (this->getBitWidth() != R.getBitWidth()) {
-			llvm::errs() << "warning: range " << *this << " " 
+			llvm::errs() << "warning: range " << *this << " "
 				<< this->getBitWidth() << " and " << R << " "
 				<< R.getBitWidth() << " unmatch\n";
 			*this = this->zextOrTrunc(R.getBitWidth());
@@ -37,19 +498,33 @@ public:
 	}
 
 	bool safeUnion(const CRange &R) {
+		if (isSmall() && R.isSmall() && Small.Width == R.Small.Width) {
+			SmallRange Old = Small;
+			Small = Small.unionWith(R.Small);
+			return !(Old == Small);
+		}
 		CRange V = R, Old = *this;
 		V.match(*this);
 		*this = this->unionWith(V);
 		return Old != *this;
 	}
 
-
-	CRange sdiv(const CRange &RHS) const {
-		if (isEmptySet() || RHS.isEmptySet())
-			return makeEmptySet(getBitWidth());
-		// FIXME: too conservative.
-		return makeFullSet(getBitWidth());
+	void Profile(llvm::FoldingSetNodeID &ID) const {
+		if (isSmall()) {
+			ID.AddInteger(Small.Width);
+			ID.AddInteger(Small.Lower);
+			ID.AddInteger(Small.Upper);
+		} else {
+			Wide->getLower().Profile(ID);
+			Wide->getUpper().Profile(ID);
+		}
 	}
 
+	void print(llvm::raw_ostream &OS) const { toConstantRange().print(OS); }
 };
+
+inline llvm::raw_ostream &operator<<(llvm::raw_ostream &OS, const CRange &R) {
+	R.print(OS);
+	return OS;
+}
 #endif
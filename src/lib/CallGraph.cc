@@ -26,6 +26,7 @@
 #include "CallGraph.h"
 #include "Annotation.h"
 #include "PointTo.h"
+#include "PtsDB.h"
 
 #define CG_LOG(stmt) KA_LOG(2, "CallGraph: " << stmt)
 #define CG_DEBUG(stmt) KA_LOG(3, "CallGraph: " << stmt)
@@ -292,6 +293,64 @@ static inline Type *getElementTy(Type *T) {
   return T;
 }
 
+// container_of: given the member obj that the base ptr of the GEP points to,
+// and the (negated) byte offset, find the objs of the enclosing structs
+bool CallGraphPass::getContainerNodes(GetElementPtrInst *GEP, NodeIndex obj, uint64_t offset,
+                                      SmallVectorImpl<NodeIndex> &Nodes) {
+  // the member type is the type of the base ptr before being cast to char*
+  Value *base = GEP->getPointerOperand()->stripPointerCasts();
+  Type *baseTy = nullptr;
+  if (GEPOperator *baseGEP = dyn_cast<GEPOperator>(base))
+    baseTy = baseGEP->getResultElementType();
+  else if (AllocaInst *AI = dyn_cast<AllocaInst>(base))
+    baseTy = AI->getAllocatedType();
+  else if (GlobalVariable *GV = dyn_cast<GlobalVariable>(base))
+    baseTy = GV->getValueType();
+  else if (!base->getType()->isOpaquePointerTy())
+    baseTy = base->getType()->getPointerElementType();
+  StructType *memberTy = dyn_cast_or_null<StructType>(baseTy);
+  if (!memberTy || memberTy->isOpaque())
+    return false;
+
+  Module *M = GEP->getModule();
+  const StructAnalyzer::ContainerList *containers = SA.getContainersAt(memberTy, offset, M);
+  if (!containers)
+    return false;
+
+  // the same member may be embedded in many structs at the same offset,
+  // only keep the containers that can be part of the obj
+  unsigned objOffset = NF.getObjectOffset(obj);
+  NodeIndex objBase = obj - objOffset;
+  unsigned objSize = NF.getObjectSize(obj);
+  bool resizable = NF.isOpaqueObject(obj);
+  const StructInfo *objInfo = nullptr;
+  if (const StructType *objTy = dyn_cast_or_null<StructType>(NF.getObjectType(objBase)))
+    objInfo = SA.getStructInfo(objTy, M);
+
+  for (auto const &[container, field] : *containers) {
+    // the member must be embedded deep enough in the obj to fit the container
+    if (field > objOffset)
+      continue;
+    const StructInfo *stInfo = SA.getStructInfo(container, M);
+    if (!stInfo)
+      continue;
+    if (!resizable) {
+      if (objOffset - field + stInfo->getExpandedSize() > objSize)
+        continue;
+      // a container starting at the obj must be the type of the obj
+      if (field == objOffset && objInfo && objInfo != stInfo)
+        continue;
+    }
+    NodeIndex node = obj - field;
+    if (std::find(Nodes.begin(), Nodes.end(), node) == Nodes.end()) {
+      CG_LOG("GEP container: " << getScopeName(container, M) << " field " << field << "\n");
+      Nodes.push_back(node);
+    }
+  }
+
+  return !Nodes.empty();
+}
+
 bool CallGraphPass::runOnFunction(Function *F) {
   bool Changed = false;
 
@@ -537,12 +596,17 @@ bool CallGraphPass::runOnFunction(Function *F) {
             assert(stInfo != NULL && "Struct info not found!");
             unsigned ptrSize = stInfo->getExpandedSize();
             if (ptrSize > allocSize) {
-              if (NF.isOpaqueObject(idx)) {
+              if (NF.isOpaqueObject(idx) && NF.getObjectOffset(idx) == 0) {
                 // we don't know the allocation size for opaque objects
                 CG_LOG("GEP resize obj: " << idx << " to type " << STy->getName() << "\n");
                 assert(NF.isHeapObject(idx) && "GEP: non-heap obj needs to be resized!");
                 // resize the obj
                 idx = extendObjectSize(idx, STy, NF, SA, funcPtsGraph);
+                allocSize = NF.getObjectSize(idx);
+              } else if (NF.isOpaqueObject(idx)) {
+                // field of a heap obj with an inferred type, the inferred type
+                // may be wrong, so keep the field (clamped to the obj below)
+                CG_LOG("GEP inferred obj field: " << idx << " vs type " << STy->getName() << "\n");
               } else {
                 // XXX: this is likely due to passing data as void*
                 // lacking context sensitivity, we cannot distinguish them
@@ -558,9 +622,17 @@ bool CallGraphPass::runOnFunction(Function *F) {
           unsigned fieldNum = 0;
           int64_t offset = getGEPOffset(GEP, DL);
           if (offset < 0) {
-            // FIXME: handle negative offset, like container_of
-            WARNING("GEP: " << *I << " negative offset: " << offset << "\n");
-            break;
+            // negative offset, like container_of
+            SmallVector<NodeIndex, 4> cidxs;
+            if (!getContainerNodes(GEP, idx, -offset, cidxs)) {
+              WARNING("GEP: " << *I << " unresolved negative offset: " << offset << "\n");
+              continue;
+            }
+            for (NodeIndex cidx : cidxs) {
+              CG_LOG("GEP container obj: " << cidx << "\n");
+              Changed |= funcPtsGraph[valNode].insert(cidx);
+            }
+            continue;
           } else {
             fieldNum = offsetToFieldNum(GEP->getSourceElementType(), offset, DL, SA, F->getParent());
           }
@@ -568,9 +640,9 @@ bool CallGraphPass::runOnFunction(Function *F) {
 
           NodeIndex nidx = idx + fieldNum;
           // XXX: corner cases, e.g., struct with varaiable size array
-          if ((NF.getObjectOffset(idx) + fieldNum) > allocSize) {
+          if ((NF.getObjectOffset(idx) + fieldNum) >= allocSize) {
             WARNING("GEP: field number " << nidx << " out of bound (" << allocSize << ")!");
-            nidx = allocSize - 1;
+            nidx = idx - NF.getObjectOffset(idx) + allocSize - 1;
           }
 
           // propagate the ptr info
@@ -884,6 +956,104 @@ bool CallGraphPass::doModulePass(Module *M) {
   return ret;
 }
 
+bool CallGraphPass::exportPointsTo(StringRef Path) {
+  PointsToDB DB;
+  typedef PointsToDB::ValueKey ValueKey;
+
+  // number every global, function, argument and instruction first,
+  // allocation sites may come after their uses
+  DenseMap<const Value*, ValueKey> Keys;
+  DenseMap<const Module*, uint32_t> ModuleIds;
+  for (auto &[M, Name] : Ctx->Modules)
+    ModuleIds[M] = DB.addModule(Name);
+
+  for (auto &[M, Name] : Ctx->Modules) {
+    uint32_t MID = ModuleIds[M];
+    uint32_t Index = 0;
+    for (GlobalVariable &GV : M->globals())
+      Keys[&GV] = ValueKey{MID, PointsToDB::None, Index++};
+    for (Function &F : *M) {
+      uint32_t FID = DB.addFunction(MID, F.getName());
+      Keys[&F] = ValueKey{MID, FID, PointsToDB::None};
+      Index = 0;
+      for (Argument &A : F.args())
+        Keys[&A] = ValueKey{MID, FID, Index++};
+      for (Instruction &I : instructions(F))
+        Keys[&I] = ValueKey{MID, FID, Index++};
+    }
+  }
+
+  DenseMap<NodeIndex, uint32_t> Objects;
+  auto getObject = [&](NodeIndex Obj) {
+    auto itr = Objects.find(Obj);
+    if (itr != Objects.end())
+      return itr->second;
+
+    PointsToDB::ObjectInfo Info;
+    if (const Value *Site = NF.getValueForNode(Obj)) {
+      auto kitr = Keys.find(Site);
+      if (kitr != Keys.end())
+        Info.site = kitr->second;
+    }
+    Info.offset = NF.getObjectOffset(Obj);
+    Info.size = NF.getObjectSize(Obj);
+    Info.flags = 0;
+    if (Obj == NF.getUniversalObjNode())
+      Info.flags |= PointsToDB::UniversalObject;
+    if (Obj == NF.getNullObjectNode())
+      Info.flags |= PointsToDB::NullObject;
+    if (NF.isHeapObject(Obj))
+      Info.flags |= PointsToDB::HeapObject;
+    if (NF.isUnionObject(Obj))
+      Info.flags |= PointsToDB::UnionObject;
+    if (NF.isOpaqueObject(Obj))
+      Info.flags |= PointsToDB::OpaqueObject;
+    uint32_t ID = DB.addObject(Info, Obj);
+    Objects[Obj] = ID;
+    return ID;
+  };
+
+  size_t NumValues = 0;
+  auto addValue = [&](const Value *V) {
+    NodeIndex Node = NF.getValueNodeFor(V);
+    if (Node == AndersNodeFactory::InvalidIndex)
+      return;
+    auto itr = funcPtsGraph.find(Node);
+    if (itr == funcPtsGraph.end())
+      return;
+
+    std::vector<uint32_t> Pointees;
+    for (auto idx = itr->second.find_first(), end = itr->second.getSize();
+         idx < end; idx = itr->second.find_next(idx)) {
+      if (NF.isObjectNode(idx))
+        Pointees.push_back(getObject(idx));
+    }
+    if (Pointees.empty())
+      return;
+    DB.addValue(Keys[V], std::move(Pointees));
+    ++NumValues;
+  };
+
+  for (auto &[M, Name] : Ctx->Modules) {
+    for (GlobalVariable &GV : M->globals())
+      addValue(&GV);
+    for (Function &F : *M) {
+      for (Argument &A : F.args())
+        addValue(&A);
+      for (Instruction &I : instructions(F))
+        addValue(&I);
+    }
+  }
+
+  if (!DB.save(Path)) {
+    WARNING("Failed to write points-to sets to " << Path << "\n");
+    return false;
+  }
+  CG_LOG("Wrote points-to sets of " << NumValues << " values, "
+         << Objects.size() << " objects to " << Path << "\n");
+  return true;
+}
+
 // debug
 void CallGraphPass::dumpFuncPtrs(raw_ostream &OS) {
   for (FuncPtrMap::iterator i = Ctx->FuncPtrs.begin(),
@@ -984,3 +1154,98 @@ void CallGraphPass::dumpCallers(raw_ostream &OS) {
   }
   CG_LOG("\n[End of dumpCallers]\n");
 }
+
+void getCallGraphSCCs(GlobalContext *Ctx, std::vector<FuncSCC> &SCCs,
+                      std::vector<unsigned> &Levels) {
+  std::vector<Function*> Nodes;
+  DenseMap<const Function*, unsigned> NodeIdx;
+  for (auto &M : Ctx->Modules) {
+    for (Function &F : *M.first) {
+      if (F.empty())
+        continue;
+      NodeIdx[&F] = Nodes.size();
+      Nodes.push_back(&F);
+    }
+  }
+
+  std::vector<SmallVector<unsigned, 8> > Succs(Nodes.size());
+  for (unsigned i = 0; i < Nodes.size(); ++i) {
+    for (inst_iterator itr = inst_begin(Nodes[i]), ite = inst_end(Nodes[i]); itr != ite; ++itr) {
+      CallBase *CB = dyn_cast<CallBase>(&*itr);
+      if (!CB)
+        continue;
+      auto callees = Ctx->Callees.find(CB);
+      if (callees == Ctx->Callees.end())
+        continue;
+      for (const Function *CF : callees->second) {
+        auto callee = NodeIdx.find(CF);
+        if (callee != NodeIdx.end())
+          Succs[i].push_back(callee->second);
+      }
+    }
+  }
+
+  // Tarjan's algorithm with an explicit stack, call chains can be deep
+  const unsigned Unvisited = ~0U;
+  std::vector<unsigned> Index(Nodes.size(), Unvisited), Low(Nodes.size());
+  std::vector<unsigned> SCCOf(Nodes.size(), Unvisited);
+  std::vector<unsigned> Stack;
+  std::vector<bool> OnStack(Nodes.size(), false);
+  std::vector<std::pair<unsigned, unsigned> > Visit; // node, next successor
+  unsigned NextIndex = 0;
+
+  auto push = [&](unsigned v) {
+    Index[v] = Low[v] = NextIndex++;
+    Stack.push_back(v);
+    OnStack[v] = true;
+    Visit.push_back(std::make_pair(v, 0));
+  };
+
+  for (unsigned root = 0; root < Nodes.size(); ++root) {
+    if (Index[root] != Unvisited)
+      continue;
+
+    push(root);
+    while (!Visit.empty()) {
+      unsigned v = Visit.back().first;
+      unsigned &next = Visit.back().second;
+      if (next < Succs[v].size()) {
+        unsigned w = Succs[v][next++];
+        if (Index[w] == Unvisited)
+          push(w);
+        else if (OnStack[w])
+          Low[v] = std::min(Low[v], Index[w]);
+        continue;
+      }
+
+      Visit.pop_back();
+      if (!Visit.empty()) {
+        unsigned u = Visit.back().first;
+        Low[u] = std::min(Low[u], Low[v]);
+      }
+      if (Low[v] != Index[v])
+        continue;
+
+      unsigned id = SCCs.size();
+      FuncSCC SCC;
+      unsigned w;
+      do {
+        w = Stack.back();
+        Stack.pop_back();
+        OnStack[w] = false;
+        SCCOf[w] = id;
+        SCC.push_back(Nodes[w]);
+      } while (w != v);
+
+      // callees outside the SCC have been emitted already
+      unsigned level = 0;
+      for (Function *F : SCC)
+        for (unsigned s : Succs[NodeIdx[F]])
+          if (SCCOf[s] != id)
+            level = std::max(level, Levels[SCCOf[s]] + 1);
+
+      SCCs.push_back(std::move(SCC));
+      Levels.push_back(level);
+    }
+  }
+}
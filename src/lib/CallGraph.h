@@ -15,6 +15,8 @@ private:
   bool handleCall(llvm::CallBase*, const llvm::Function*);
   bool isCompatibleType(llvm::Type *T1, llvm::Type *T2);
   bool findCalleesByType(llvm::CallBase*, FuncSet&);
+  bool getContainerNodes(llvm::GetElementPtrInst*, NodeIndex, uint64_t,
+                         llvm::SmallVectorImpl<NodeIndex>&);
 
   AndersNodeFactory &NF;
   StructAnalyzer &SA;
@@ -46,10 +48,22 @@ public:
   virtual bool doFinalization(llvm::Module *);
   virtual bool doModulePass(llvm::Module *);
 
+  // points-to sidecar, see PointsToDB
+  bool exportPointsTo(llvm::StringRef Path);
+
   // debug
   void dumpFuncPtrs(llvm::raw_ostream &OS);
   void dumpCallees(llvm::raw_ostream &OS);
   void dumpCallers(llvm::raw_ostream &OS);
 };
 
+// Strongly connected components of the call graph (built from
+// GlobalContext::Callees over defined functions) in bottom-up order,
+// i.e., callees come before their callers. Levels[i] is one more than the
+// highest level of the SCCs called by SCCs[i], so SCCs on the same level
+// never call each other and can be processed in parallel.
+typedef std::vector<llvm::Function*> FuncSCC;
+void getCallGraphSCCs(GlobalContext *Ctx, std::vector<FuncSCC> &SCCs,
+                      std::vector<unsigned> &Levels);
+
 #endif
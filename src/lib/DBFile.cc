@@ -0,0 +1,49 @@
+/*
+ * File helpers of the persisted databases
+ *
+ * Copyright (C) 2024 Chengyu Song
+ *
+ * For licensing details see LICENSE
+ */
+
+#include <llvm/Support/FileSystem.h>
+
+#include <cstring>
+
+#include "DBFile.h"
+
+using namespace llvm;
+
+std::unique_ptr<MemoryBuffer> loadWithMagic(StringRef path, const char (&magic)[8], size_t headerSize)
+{
+  auto bufOrErr = MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!bufOrErr)
+    return nullptr;
+
+  std::unique_ptr<MemoryBuffer> buf = std::move(*bufOrErr);
+  if (buf->getBufferSize() < headerSize || headerSize < sizeof(magic) ||
+      memcmp(buf->getBufferStart(), magic, sizeof(magic)) != 0)
+    return nullptr;
+
+  return buf;
+}
+
+bool writeFileAtomically(StringRef path, function_ref<void(raw_ostream&)> write)
+{
+  std::string tmpPath = (path + ".tmp").str();
+  std::error_code EC;
+  raw_fd_ostream OS(tmpPath, EC, sys::fs::OF_None);
+  if (EC)
+    return false;
+
+  write(OS);
+
+  OS.close();
+  if (OS.has_error()) {
+    OS.clear_error();
+    sys::fs::remove(tmpPath);
+    return false;
+  }
+
+  return !sys::fs::rename(tmpPath, path);
+}
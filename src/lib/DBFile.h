@@ -0,0 +1,25 @@
+#ifndef DB_FILE_H
+#define DB_FILE_H
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <memory>
+
+// File helpers shared by the persisted databases (StructDB, RangeDB, PtsDB).
+// Each file starts with a header whose first 8 bytes are the magic.
+
+// Map the file into memory, return null if it cannot be read, is shorter
+// than the header or does not start with magic
+std::unique_ptr<llvm::MemoryBuffer> loadWithMagic(llvm::StringRef path,
+		const char (&magic)[8], size_t headerSize);
+
+// Replace the file with what write produces. The old file may still be
+// mapped by a loaded database, so the data goes to a temporary file first,
+// which is only renamed over path if everything was written.
+bool writeFileAtomically(llvm::StringRef path,
+		llvm::function_ref<void(llvm::raw_ostream&)> write);
+
+#endif
@@ -8,5 +8,7 @@ using namespace llvm;
 
 extern cl::list<std::string> InputFilenames;
 extern cl::opt<unsigned> VerboseLevel;
+extern cl::opt<unsigned> NumThreads;
+extern cl::opt<std::string> AllocSpecFile;
 
 #endif
@@ -11,7 +11,9 @@
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/CommandLine.h>
 
+#include <atomic>
 #include <map>
+#include <memory>
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
@@ -19,10 +21,12 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <boost/unordered/unordered_flat_map.hpp>
 
 #include "Common.h"
+#include "Annotation.h"
 #include "StructAnalyzer.h"
 #include "NodeFactory.h"
 
@@ -40,30 +44,65 @@ typedef llvm::DenseMap<const llvm::Function*, const llvm::ReturnInst*> RetSiteMa
 typedef boost::unordered_flat_map<std::size_t, AndersPtsSet> PtsGraph;
 typedef boost::unordered_flat_map<llvm::Instruction*, PtsGraph> NodeToPtsGraph;
 
-class GlobalContext {
+// Pass specific data, keyed by a tag type instead of a string, e.g.,
+//   struct IntRangesData { typedef RangeMap Type; };
+//   RangeMap &IntRanges = Ctx->PassData.add<IntRangesData>();
+// Each tag gets its own slot on first use, so lookups are a vector index.
+class PassDataRegistry {
 private:
-  // pass specific data
-  std::map<std::string, void*> PassData;
+  typedef std::unique_ptr<void, void (*)(void*)> Slot;
+  std::vector<Slot> slots;
 
-public:
-  bool add(std::string name, void* data) {
-    if (PassData.find(name) != PassData.end())
-      return false;
+  static unsigned allocSlot() {
+    static std::atomic<unsigned> next(0);
+    return next++;
+  }
 
-    PassData[name] = data;
-    return true;
+  template <typename Tag>
+  static unsigned getSlot() {
+    static const unsigned slot = allocSlot();
+    return slot;
   }
 
-  void* get(std::string name) {
-    std::map<std::string, void*>::iterator itr;
+  template <typename T>
+  static void destroy(void *data) { delete static_cast<T*>(data); }
 
-    itr = PassData.find(name);
-    if (itr != PassData.end())
-      return itr->second;
-    else
+public:
+  // Create the data of Tag if it does not exist yet
+  template <typename Tag, typename... Args>
+  typename Tag::Type &add(Args&&... args) {
+    typedef typename Tag::Type T;
+    unsigned slot = getSlot<Tag>();
+    while (slot >= slots.size())
+      slots.emplace_back(nullptr, nullptr);
+    if (!slots[slot])
+      slots[slot] = Slot(new T(std::forward<Args>(args)...), &destroy<T>);
+    return *static_cast<T*>(slots[slot].get());
+  }
+
+  // Return NULL if the data of Tag does not exist
+  template <typename Tag>
+  typename Tag::Type *get() const {
+    unsigned slot = getSlot<Tag>();
+    if (slot >= slots.size())
       return nullptr;
+    return static_cast<typename Tag::Type*>(slots[slot].get());
   }
 
+  // Free the data of Tag once no pass needs it anymore
+  template <typename Tag>
+  void release() {
+    unsigned slot = getSlot<Tag>();
+    if (slot < slots.size())
+      slots[slot].reset();
+  }
+};
+
+class GlobalContext {
+public:
+  // pass specific data
+  PassDataRegistry PassData;
+
   // StructAnalyzer
   StructAnalyzer structAnalyzer;
 
@@ -106,6 +145,9 @@ public:
   // Global init point-to graph
   PtsGraph GlobalInitPtsGraph;
 
+  // Interned value identifiers
+  ValueIdPool ValueIds;
+
   ModuleList Modules;
 
   ModuleMap ModuleMaps;
@@ -22,11 +22,11 @@
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/Signals.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/Parallel.h>
 
 #include <memory>
 #include <vector>
 #include <sstream>
-#include <sys/resource.h>
 
 #include "Global.h"
 #include "CallGraph.h"
@@ -41,21 +41,33 @@ cl::list<std::string> InputFilenames(
 cl::opt<unsigned> VerboseLevel(
   "verbose", cl::desc("Verbose level"), cl::init(0));
 
+cl::opt<unsigned> NumThreads(
+  "threads", cl::desc("Number of worker threads (0 = all cores)"), cl::init(0));
+
+cl::opt<std::string> StructDBPath(
+  "struct-db", cl::desc("Struct layout database to reuse across runs"), cl::init(""));
+
+cl::opt<std::string> PtsDBPath(
+  "pts-db", cl::desc("Write the points-to sets to a queryable database"), cl::init(""));
+
+cl::opt<std::string> AllocSpecFile(
+  "alloc-spec", cl::desc("Additional allocator specs (name[*] size-arg flag-arg [noalloc])"), cl::init(""));
+
 // cl::opt<bool> DumpCallees(
 //   "dump-call-graph", cl::desc("Dump call graph"), cl::NotHidden, cl::init(false));
 
 // cl::opt<bool> DumpCallers(
 //   "dump-caller-graph", cl::desc("Dump caller graph"), cl::NotHidden, cl::init(false));
 
-// cl::opt<bool> DoSafeStack(
-//   "safe-stack", cl::desc("Perfrom safe stack analysis"), cl::NotHidden, cl::init(false));
+cl::opt<bool> DoSafeStack(
+  "safe-stack", cl::desc("Perfrom safe stack analysis"), cl::NotHidden, cl::init(false));
 
-// cl::opt<bool> DumpStackStats(
-//   "dump-stack-stats", cl::desc("Dump stack stats"), cl::NotHidden, cl::init(false));
+cl::opt<bool> DumpStackStats(
+  "dump-stack-stats", cl::desc("Dump stack stats"), cl::NotHidden, cl::init(false));
 
-// cl::opt<bool> DoLSS(
-//   "linux-ss", cl::desc("Discover security sensitive data in Linux kernel"),
-//   cl::NotHidden, cl::init(false));
+cl::opt<bool> DoLSS(
+  "linux-ss", cl::desc("Discover security sensitive data in Linux kernel"),
+  cl::NotHidden, cl::init(false));
 
 GlobalContext GlobalCtx;
 
@@ -141,18 +153,13 @@ void doBasicInitialization(Module *M) {
       }
     }
   }
+
+  // allocator lookups are read-only from here on
+  cacheAllocFns(M);
 }
 
 int main(int argc, char **argv) {
 
-#ifdef SET_STACK_SIZE
-  struct rlimit rl;
-  if (getrlimit(RLIMIT_STACK, &rl) == 0) {
-    rl.rlim_cur = SET_STACK_SIZE;
-    setrlimit(RLIMIT_STACK, &rl);
-  }
-#endif
-
   // Print a stack trace if we signal out.
 #if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR < 9
   sys::PrintStackTraceOnErrorSignal();
@@ -164,11 +171,15 @@ int main(int argc, char **argv) {
   llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
 
   cl::ParseCommandLineOptions(argc, argv, "global analysis\n");
+  parallel::strategy = hardware_concurrency(NumThreads);
   SMDiagnostic Err;
 
   // Loading modules
   Diag << "Total " << InputFilenames.size() << " file(s)\n";
 
+  if (!StructDBPath.empty())
+    GlobalCtx.structAnalyzer.loadLayoutDB(StructDBPath);
+
   for (unsigned i = 0; i < InputFilenames.size(); ++i) {
     // use separate LLVMContext to avoid type renaming
     Diag << "Input Filename : "<< InputFilenames[i] << "\n";
@@ -190,6 +201,13 @@ int main(int argc, char **argv) {
     doBasicInitialization(Module);
   }
 
+  // container relations can only be computed after all structs are known
+  GlobalCtx.structAnalyzer.finalize();
+  if (!StructDBPath.empty()) {
+    Diag << "Reused " << GlobalCtx.structAnalyzer.getNumLoadedLayouts() << " struct layouts\n";
+    GlobalCtx.structAnalyzer.saveLayoutDB(StructDBPath);
+  }
+
   // one more preprocessing to clear defined global variables and functions
   for (auto &[id, gv] : GlobalCtx.Gobjs) { GlobalCtx.ExtGobjs.erase(id); }
   for (auto &[id, f] : GlobalCtx.Funcs) { GlobalCtx.ExtFuncs.erase(id); }
@@ -201,6 +219,8 @@ int main(int argc, char **argv) {
   CallGraphPass CGPass(&GlobalCtx);
   CGPass.run(GlobalCtx.Modules);
   CGPass.dumpCallees(errs());
+  if (!PtsDBPath.empty())
+    CGPass.exportPointsTo(PtsDBPath);
 
 //   if (DumpCallees)
 //     CGPass.dumpCallees();
@@ -208,22 +228,26 @@ int main(int argc, char **argv) {
 //   if (DumpCallers)
 //     CGPass.dumpCallers();
 
-//   if (DoSafeStack) {
-// #ifdef DO_RANGE_ANALYSIS
-//     RangePass RPass(&GlobalCtx);
-//     RPass.run(GlobalCtx.Modules);
-// #endif
-
-//     SafeStackPass SSPass(&GlobalCtx);
-//     SSPass.run(GlobalCtx.Modules);
-//     if (DumpStackStats)
-//       SSPass.dumpStats();
-//   }
-
-//   if (DoLSS) {
-//     LinuxSS LSS(&GlobalCtx);
-//     LSS.run(GlobalCtx.Modules);
-//   }
+  if (DoSafeStack) {
+#ifdef DO_RANGE_ANALYSIS
+    RangePass RPass(&GlobalCtx);
+    RPass.run(GlobalCtx.Modules);
+#endif
+
+    SafeStackPass SSPass(&GlobalCtx);
+    SSPass.run(GlobalCtx.Modules);
+    if (DumpStackStats)
+      SSPass.dumpStats();
+
+    // no later stage needs the ranges
+    GlobalCtx.PassData.release<IntRangesData>();
+    GlobalCtx.PassData.release<FuncVRMsData>();
+  }
+
+  if (DoLSS) {
+    LinuxSS LSS(&GlobalCtx);
+    LSS.run(GlobalCtx.Modules);
+  }
 
   return 0;
 }
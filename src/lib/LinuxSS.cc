@@ -16,6 +16,7 @@
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/Parallel.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/StringMap.h>
@@ -32,12 +33,36 @@
 
 using namespace llvm;
 
-#define LSS_DEBUG(stmt) KA_LOG(2, stmt)
+// Output of the function being analyzed by this thread, functions are
+// analyzed in parallel and their output is printed in order afterwards
+struct FuncLog {
+    std::string Out, Err;
+    raw_string_ostream OS{Out}, ES{Err};
+};
+static thread_local FuncLog *CurLog = nullptr;
+
+static raw_ostream &lssOuts() {
+    if (CurLog)
+        return CurLog->OS;
+    return outs();
+}
+
+static raw_ostream &lssErrs() {
+    if (CurLog)
+        return CurLog->ES;
+    return errs();
+}
+
+#define LSS_DEBUG(stmt)            \
+    do {                           \
+        if (VerboseLevel >= 2)     \
+            lssErrs() << stmt;     \
+    } while (0)
 
 #define LSS_LOG(stmt)        \
     do {                    \
         LSS_DEBUG(stmt);    \
-        outs() << stmt;        \
+        lssOuts() << stmt;        \
     } while (0)
 
 #define MEPERM    2311
@@ -60,44 +85,189 @@ static void insertControlBlock(BasicBlock *BB, LinuxSS::BBSet &BS) {
 }
 
 bool LinuxSS::collectCondition(Value *V) {
-    std::set<llvm::Value*> *C = reinterpret_cast<std::set<llvm::Value*>*>(Ctx->get("SecConds"));
-    return C->insert(V).second;
+    std::lock_guard<std::mutex> Guard(SecCondsLock);
+    return SecConds.insert(V).second;
+}
+
+std::unique_ptr<LinuxSS::ControlDeps> LinuxSS::buildControlDeps(Function *F) {
+    std::unique_ptr<ControlDeps> CD(new ControlDeps());
+#if LLVM_VERSION_MAJOR <= 4
+    DomTree DT(false);
+    PostDomTree PDT(true);
+#else
+    DomTree DT;
+    PostDomTree PDT;
+#endif
+    DT.recalculate(*F);
+    PDT.recalculate(*F);
+
+    for (BasicBlock &BB : *F) {
+        CD->Index[&BB] = CD->Blocks.size();
+        CD->Blocks.push_back(&BB);
+    }
+    unsigned N = CD->size();
+    CD->DependsOn.assign(N, BitVector(N));
+    CD->Controls.resize(N);
+    CD->Dominators.assign(N, BitVector(N));
+    CD->PostDominated.assign(N, BitVector(N));
+
+    for (unsigned i = 0; i < N; ++i) {
+        BasicBlock *BB = CD->Blocks[i];
+
+        // unreachable blocks are dominated by everything
+        if (DomTreeNode *Node = DT.getNode(BB)) {
+            for (; Node; Node = Node->getIDom())
+                CD->Dominators[i].set(CD->Index[Node->getBlock()]);
+        } else {
+            CD->Dominators[i].set();
+        }
+
+        if (DomTreeNode *Node = PDT.getNode(BB)) {
+            for (DomTreeNode *D : depth_first(Node))
+                CD->PostDominated[i].set(CD->Index[D->getBlock()]);
+        } else {
+            CD->PostDominated[i].set();
+        }
+
+        // blocks on the post-dominator tree path from a successor up to
+        // (excluding) the immediate post-dominator of BB depend on that edge
+        Instruction *TI = BB->getTerminator();
+        DomTreeNode *Node = PDT.getNode(BB);
+        DomTreeNode *IPDom = Node ? Node->getIDom() : nullptr;
+        CD->Controls[i].assign(TI->getNumSuccessors(), BitVector(N));
+        for (unsigned s = 0; s < TI->getNumSuccessors(); ++s) {
+            BasicBlock *Succ = TI->getSuccessor(s);
+            if (PDT.dominates(Succ, BB))
+                continue;
+            for (DomTreeNode *Y = PDT.getNode(Succ); Y && Y != IPDom; Y = Y->getIDom()) {
+                if (!Y->getBlock())
+                    break;
+                unsigned j = CD->Index[Y->getBlock()];
+                CD->Controls[i][s].set(j);
+                CD->DependsOn[j].set(i);
+            }
+        }
+    }
+
+    // Transitive closure in one pass over the strongly connected components
+    // of the dependences (loops make them cyclic), found by Tarjan's
+    // algorithm in reverse topological order: a component depends on its
+    // own blocks and on the closures of the components it depends on, which
+    // are complete by the time it is popped.
+    CD->Closure.assign(N, BitVector(N));
+    std::vector<unsigned> Num(N, 0), Low(N, 0), Stack;
+    std::vector<std::pair<unsigned, int> > Work;
+    BitVector OnStack(N);
+    unsigned Next = 0;
+    for (unsigned r = 0; r < N; ++r) {
+        if (Num[r])
+            continue;
+        Num[r] = Low[r] = ++Next;
+        Stack.push_back(r);
+        OnStack.set(r);
+        Work.emplace_back(r, -1);
+        while (!Work.empty()) {
+            unsigned i = Work.back().first;
+            int Prev = Work.back().second;
+            int j = Prev < 0 ? CD->DependsOn[i].find_first()
+                             : CD->DependsOn[i].find_next(Prev);
+            if (j >= 0) {
+                Work.back().second = j;
+                if (!Num[j]) {
+                    Num[j] = Low[j] = ++Next;
+                    Stack.push_back(j);
+                    OnStack.set(j);
+                    Work.emplace_back(j, -1);
+                } else if (OnStack.test(j)) {
+                    Low[i] = std::min(Low[i], Num[j]);
+                }
+                continue;
+            }
+
+            Work.pop_back();
+            if (!Work.empty())
+                Low[Work.back().first] = std::min(Low[Work.back().first], Low[i]);
+            if (Low[i] != Num[i])
+                continue;
+
+            // i is the root of a component, members are on top of the stack
+            BitVector &C = CD->Closure[i];
+            size_t Top = Stack.size();
+            do {
+                C.set(Stack[--Top]);
+            } while (Stack[Top] != i);
+            for (size_t k = Top; k < Stack.size(); ++k) {
+                for (unsigned d : CD->DependsOn[Stack[k]].set_bits())
+                    if (!OnStack.test(d))
+                        C |= CD->Closure[d];
+            }
+            for (size_t k = Top; k < Stack.size(); ++k) {
+                OnStack.reset(Stack[k]);
+                if (Stack[k] != i)
+                    CD->Closure[Stack[k]] = C;
+            }
+            Stack.resize(Top);
+        }
+    }
+
+    // like unreachable blocks, blocks without a post-dominator tree node
+    // are post-dominated by everything
+    for (unsigned j = 0; j < N; ++j) {
+        if (PDT.getNode(CD->Blocks[j]))
+            continue;
+        for (unsigned i = 0; i < N; ++i)
+            CD->PostDominated[i].set(j);
+    }
+    return CD;
 }
 
-bool LinuxSS::dumpControlDep(BasicBlock *CBB, BBSet &Checked) {
+// Collect the conditions CBB is control dependent on, blocks that are
+// already checked are skipped in favor of their own dependences
+bool LinuxSS::dumpControlDep(ControlDeps &CD, unsigned CBB, BitVector &Checked) {
 
     bool ret = false;
 
-    BBSet Visited;
-    SmallVector<BasicBlock*, 8> WorkList;
+    BitVector Visited(CD.size());
+    SmallVector<unsigned, 8> WorkList;
+    auto addDeps = [&](unsigned B) {
+        for (unsigned D : CD.DependsOn[B].set_bits()) {
+            if (!Visited.test(D)) {
+                Visited.set(D);
+                WorkList.push_back(D);
+            }
+        }
+    };
 
-    LSS_DEBUG("=== Checked = ");
-    for (BasicBlock *BB : Checked) {
-        BB->printAsOperand(errs());
-        LSS_DEBUG(", ");
+    if (VerboseLevel >= 2) {
+        lssErrs() << "=== Checked = ";
+        for (unsigned B : Checked.set_bits()) {
+            CD.Blocks[B]->printAsOperand(lssErrs());
+            lssErrs() << ", ";
+        }
+        lssErrs() << "\n";
     }
-    LSS_DEBUG("\n");
 
-    Visited.insert(CBB);
+    Visited.set(CBB);
     WorkList.push_back(CBB);
     while (!WorkList.empty()) {
-        BasicBlock *BB = WorkList.pop_back_val();
+        unsigned B = WorkList.pop_back_val();
+        BasicBlock *BB = CD.Blocks[B];
 
         if (VerboseLevel >= 2) {
-            errs() << "Check BB: ";
-            BB->printAsOperand(errs());
-            errs() << "\n";
+            lssErrs() << "Check BB: ";
+            BB->printAsOperand(lssErrs());
+            lssErrs() << "\n";
         }
 
         // ignore checked/blacklisted
         // unless the input block
-        if (BB != CBB && !Checked.insert(BB).second) {
-            // check its predecessor(s) insteand
-            for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI) {
-                if (Visited.insert(*PI).second)
-                    WorkList.push_back(*PI);
+        if (B != CBB) {
+            if (Checked.test(B)) {
+                // check its dependences insteand
+                addDeps(B);
+                continue;
             }
-            continue;
+            Checked.set(B);
         }
 
         Instruction *TI = BB->getTerminator();
@@ -106,10 +276,7 @@ bool LinuxSS::dumpControlDep(BasicBlock *CBB, BBSet &Checked) {
                 Value *Cond = BI->getCondition();
                 ret |= collectCondition(Cond);
             } else {
-                for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI) {
-                    if (Visited.insert(*PI).second)
-                        WorkList.push_back(*PI);
-                }
+                addDeps(B);
             }
         } else if (SwitchInst *SI = dyn_cast<SwitchInst>(TI)) {
             Value *Cond = SI->getCondition();
@@ -128,19 +295,8 @@ bool LinuxSS::isTrueFalseFunc(Function *F) {
     if (ITy && ITy->getBitWidth() == 1)
         return true;
 
-    // collect return values
-    ValueSet Visited;
-    RetSet RS;
-    for (BasicBlock &BB : *F) {
-        Instruction *T = BB.getTerminator();
-        if (ReturnInst *R = dyn_cast<ReturnInst>(T)) {
-            Value *RV = R->getReturnValue();
-            if (RV != nullptr)
-                collectRetVal(RV, &BB, RS, Visited);
-        }
-    }
-
-    for (RetPair const& RP : RS) {
+    // return values
+    for (RetPair const& RP : getRetVals(F)) {
         Value *V = RP.first;
         Type *Ty = V->getType();
 
@@ -159,157 +315,147 @@ bool LinuxSS::isTrueFalseFunc(Function *F) {
     return false;
 }
 
-bool LinuxSS::isErrorBranch(BasicBlock *Ancestor, BasicBlock *Descendent) {
+bool LinuxSS::isErrorBranch(ControlDeps &CD, BasicBlock *Ancestor, BasicBlock *Descendent) {
 
-    BBSet Visited;
-    SmallVector<BasicBlock*, 8> WorkList;
+    unsigned A = CD.Index[Ancestor], D = CD.Index[Descendent];
+    // let's be conservative about this
+    // only return false when it's a conditional branch
+    // that compares return value with 0
+    BranchInst *BI = dyn_cast<BranchInst>(Ancestor->getTerminator());
+    if (!BI)
+        return true;
 
-    Visited.insert(Descendent);
-    WorkList.push_back(Descendent);
-    while (!WorkList.empty()) {
-        BasicBlock *BB = WorkList.pop_back_val();
+    if (!BI->isConditional())
+        return false;
 
-        for (pred_iterator PI = pred_begin(BB), E = pred_end(BB); PI != E; ++PI) {
-            BasicBlock *P = *PI;
-            if (P == Ancestor) {
-                // let's be conservative about this
-                // only return false when it's a conditional branch
-                // that compares return value with 0
-                BranchInst *BI = dyn_cast<BranchInst>(Ancestor->getTerminator());
-                if (!BI)
-                    return true;
+    BasicBlock *TB = BI->getSuccessor(0);
+    BasicBlock *FB = BI->getSuccessor(1);
 
-                if (!BI->isConditional())
-                    return false;
+    // the branch taken to reach the descendent, if it matters
+    BasicBlock *BB = nullptr;
+    if (CD.Controls[A][0].anyCommon(CD.Closure[D]))
+        BB = TB;
+    else if (CD.Controls[A][1].anyCommon(CD.Closure[D]))
+        BB = FB;
+    else
+        return false;
 
-                BasicBlock *TB = BI->getSuccessor(0);
-                BasicBlock *FB = BI->getSuccessor(1);
+    // check condition
+    Value *Cond = BI->getCondition();
+    if (CallInst *CI = dyn_cast<CallInst>(Cond)) {
+        Function *F = CI->getCalledFunction();
+        if (F && isTrueFalseFunc(F)) {
+            if (FB == BB) // ret == 0
+                return true;
+            else
+                return false;
+        } else {
+            if (TB == BB) // ret != 0
+                return true;
+            else
+                return false;
+        }
+    }
 
-                // check condition
-                Value *Cond = BI->getCondition();
-                if (CallInst *CI = dyn_cast<CallInst>(Cond)) {
-                    Function *F = CI->getCalledFunction();
-                    if (F && isTrueFalseFunc(F)) {
-                        if (FB == BB) // ret == 0
-                            return true;
-                        else
-                            return false;
-                    } else {
-                        if (TB == BB) // ret != 0
-                            return true;
-                        else
-                            return false;
-                    }
-                }
+    ICmpInst *Cmp = dyn_cast<ICmpInst>(Cond);
+    if (!Cmp)
+        return true;
 
-                ICmpInst *Cmp = dyn_cast<ICmpInst>(Cond);
-                if (!Cmp)
-                    return true;
-
-                Value *op0 = Cmp->getOperand(0);
-                Value *op1 = Cmp->getOperand(1);
-                Value *NonZero = nullptr;
-                Value *Zero = nullptr;
-                bool isTrueFalse = false;
-                if (ConstantInt *Int = dyn_cast<ConstantInt>(op0)) {
-                    if (Int->getZExtValue() == 0) {
-                        Zero = op0;
-                        NonZero = op1;
-                    }
-                }
-                if (ConstantInt *Int = dyn_cast<ConstantInt>(op1)) {
-                    if (Zero != nullptr) {
-                        errs() << "Comparing two constant does not make sense" << *Cmp;
-                        return false;
-                    }
+    Value *op0 = Cmp->getOperand(0);
+    Value *op1 = Cmp->getOperand(1);
+    Value *NonZero = nullptr;
+    Value *Zero = nullptr;
+    bool isTrueFalse = false;
+    if (ConstantInt *Int = dyn_cast<ConstantInt>(op0)) {
+        if (Int->getZExtValue() == 0) {
+            Zero = op0;
+            NonZero = op1;
+        }
+    }
+    if (ConstantInt *Int = dyn_cast<ConstantInt>(op1)) {
+        if (Zero != nullptr) {
+            lssErrs() << "Comparing two constant does not make sense" << *Cmp;
+            return false;
+        }
 
-                    if (Int->getZExtValue() == 0) {
-                        Zero = op1;
-                        NonZero = op0;
-                    }
-                }
-                // neither value is zero, assume true
-                if (!Zero)
-                    return true;
-
-                if (CastInst *CI = dyn_cast<CastInst>(NonZero))
-                    NonZero = CI->getOperand(0);
-
-                if (!isa<CallInst>(NonZero))
-                    return true;
-
-                Function *F = cast<CallInst>(NonZero)->getCalledFunction();
-                if (!F)
-                    return true;
-
-                if (isTrueFalseFunc(F))
-                    isTrueFalse = true;
-
-                CmpInst::Predicate Pred = Cmp->getPredicate();
-                switch (Pred) {
-                case CmpInst::ICMP_EQ:
-                    // == 0
-                    if (isTrueFalse) {
-                        if (TB == BB)
-                            return true;
-                        else
-                            return false;
-                    } else {
-                        if (FB == BB) // false branch
-                            return true;
-                        else
-                            return false;
-                    }
+        if (Int->getZExtValue() == 0) {
+            Zero = op1;
+            NonZero = op0;
+        }
+    }
+    // neither value is zero, assume true
+    if (!Zero)
+        return true;
 
-                case CmpInst::ICMP_NE:
-                    // != 0
-                    if (isTrueFalse) {
-                        if (FB == BB)
-                            return true;
-                        else
-                            return false;
-                    } else {
-                        if (TB == BB) // true branch
-                            return true;
-                        else
-                            return false;
-                    }
+    if (CastInst *CI = dyn_cast<CastInst>(NonZero))
+        NonZero = CI->getOperand(0);
 
-                case CmpInst::ICMP_SLT:
-                    if (op1 == Zero) {
-                        // < 0
-                        if (TB == BB)
-                            return true;
-                        else
-                            return false;
-                    } else {
-                        // 0 < ?
-                        return true;
-                    }
+    if (!isa<CallInst>(NonZero))
+        return true;
 
-                case CmpInst::ICMP_SGE:
-                    if (op1 == Zero) {
-                        // >= 0
-                        if (FB == BB)
-                            return true;
-                        else
-                            return false;
-                    } else {
-                        // 0 >= ?
-                        return true;
-                    }
-                default:
-                    return true;
-                }
-            } else { // P != Ancestor
-                if (Visited.insert(P).second)
-                    WorkList.push_back(P);
-            }
+    Function *F = cast<CallInst>(NonZero)->getCalledFunction();
+    if (!F)
+        return true;
+
+    if (isTrueFalseFunc(F))
+        isTrueFalse = true;
+
+    CmpInst::Predicate Pred = Cmp->getPredicate();
+    switch (Pred) {
+    case CmpInst::ICMP_EQ:
+        // == 0
+        if (isTrueFalse) {
+            if (TB == BB)
+                return true;
+            else
+                return false;
+        } else {
+            if (FB == BB) // false branch
+                return true;
+            else
+                return false;
+        }
+
+    case CmpInst::ICMP_NE:
+        // != 0
+        if (isTrueFalse) {
+            if (FB == BB)
+                return true;
+            else
+                return false;
+        } else {
+            if (TB == BB) // true branch
+                return true;
+            else
+                return false;
         }
-    }
 
-    // should neve reach here
-    llvm_unreachable("Ancestor should always be reachable from descendent");
+    case CmpInst::ICMP_SLT:
+        if (op1 == Zero) {
+            // < 0
+            if (TB == BB)
+                return true;
+            else
+                return false;
+        } else {
+            // 0 < ?
+            return true;
+        }
+
+    case CmpInst::ICMP_SGE:
+        if (op1 == Zero) {
+            // >= 0
+            if (FB == BB)
+                return true;
+            else
+                return false;
+        } else {
+            // 0 >= ?
+            return true;
+        }
+    default:
+        return true;
+    }
 }
 
 bool LinuxSS::checkControlDep(BBSet &CheckList, BBSet &BlackList) {
@@ -319,53 +465,46 @@ bool LinuxSS::checkControlDep(BBSet &CheckList, BBSet &BlackList) {
     if (CheckList.empty())
         return false;
 
+    // only needed while the function is checked, so not kept around
     Function *F = (*CheckList.begin())->getParent();
+    std::unique_ptr<ControlDeps> CDG = buildControlDeps(F);
+    ControlDeps &CD = *CDG;
 
     // ignore bb that is post-dominated by any check
-    BBSet Checked;
-    for (BasicBlock *BB : CheckList) {
-        for (BasicBlock &B : *F) {
-            if (gPDT->dominates(BB, &B)) {
-                Checked.insert(&B);
-            }
-        }
-    }
+    BitVector Checked(CD.size());
+    for (BasicBlock *BB : CheckList)
+        Checked |= CD.PostDominated[CD.Index[BB]];
     // including those in blacklist
     for (BasicBlock *BB : BlackList) {
-        Checked.insert(BB);
-        for (BasicBlock &B : *F) {
-            if (gPDT->dominates(BB, &B)) {
-                Checked.insert(&B);
-            }
-        }
+        Checked.set(CD.Index[BB]);
+        Checked |= CD.PostDominated[CD.Index[BB]];
     }
 
     for (BasicBlock *BB : CheckList) {
         // check current BB
-        ret |= dumpControlDep(BB, Checked);
-        Checked.insert(BB);
+        unsigned I = CD.Index[BB];
+        ret |= dumpControlDep(CD, I, Checked);
+        Checked.set(I);
 
         // check bb that dominates current bb
-        for (BasicBlock &B : *F) {
-            if (gDT->dominates(&B, BB)) {
-                if (Checked.count(&B))
-                    continue;
+        for (unsigned D : CD.Dominators[I].set_bits()) {
+            if (Checked.test(D))
+                continue;
 
-                // dominator condition may have two cases
-                // 1) if the condition is an error, directly return, e.g.,
-                //      rc = check_perm();
-                //      if (rc)
-                //        return rc;
-                //    this is not the case we're interested in
-                // 2) if the condition is an error, the fall back to another check, e.g.,
-                //      if (uid == cred->euid || uid == cred->suid)
-                //    this is the case we're interested in
-                //
-                if (!isErrorBranch(&B, BB))
-                    continue;
+            // dominator condition may have two cases
+            // 1) if the condition is an error, directly return, e.g.,
+            //      rc = check_perm();
+            //      if (rc)
+            //        return rc;
+            //    this is not the case we're interested in
+            // 2) if the condition is an error, the fall back to another check, e.g.,
+            //      if (uid == cred->euid || uid == cred->suid)
+            //    this is the case we're interested in
+            //
+            if (!isErrorBranch(CD, CD.Blocks[D], BB))
+                continue;
 
-                ret |= dumpControlDep(&B, Checked);
-            }
+            ret |= dumpControlDep(CD, D, Checked);
         }
 
     }
@@ -373,119 +512,126 @@ bool LinuxSS::checkControlDep(BBSet &CheckList, BBSet &BlackList) {
     return ret;
 }
 
-void LinuxSS::collectRetVal(Value *V, BasicBlock *BB, RetSet &RS, ValueSet &Visited) {
+const LinuxSS::RetSet &LinuxSS::getRetVals(Function *F) {
+    static const RetSet Empty;
+    auto itr = RetVals.find(F);
+    if (itr == RetVals.end() || !itr->second)
+        return Empty;
+    return *itr->second;
+}
 
-    User *U = dyn_cast<User>(V);
-    if (U == nullptr)
-        return;
+void LinuxSS::collectRetVal(Function *F, RetSet &RS) {
 
-    if (ConstantInt *INT = dyn_cast<ConstantInt>(U)) {
-        RS.insert(std::make_pair(INT, BB));
-        return;
-    }
+    // values still to be traced, with the block they flow from;
+    // pushed in reverse so they are traced in operand order
+    SmallVector<RetPair, 16> WorkList;
+    ValueSet Visited;
+    // pointers whose stores have been followed
+    SmallPtrSet<Value*, 8> Scanned;
+    SmallVector<StoreInst*, 8> Stores;
 
-    // always process constant int
-    // so check visited here
-    if (!Visited.insert(V).second)
-        return;
-    
-    if (ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) {
-        if (CE->isCast()) {
-            Value *S = CE->getOperand(0);
-            collectRetVal(S, BB, RS, Visited);
-            return;
-        }
-        // fall through far other cases
-    }
+    for (BasicBlock &RB : *F) {
+        ReturnInst *R = dyn_cast<ReturnInst>(RB.getTerminator());
+        if (R == nullptr || R->getReturnValue() == nullptr)
+            continue;
+        WorkList.push_back(std::make_pair(R->getReturnValue(), &RB));
 
-    if (PHINode *PHI = dyn_cast<PHINode>(U)) {
-        for (unsigned i = 0, e = PHI->getNumIncomingValues(); i != e; ++i) {
-            collectRetVal(PHI->getIncomingValue(i),
-                    PHI->getIncomingBlock(i), RS, Visited);
-        }
-        return;
-    }
+        while (!WorkList.empty()) {
+            Value *V = WorkList.back().first;
+            BasicBlock *BB = WorkList.back().second;
+            WorkList.pop_back();
 
-    if (SelectInst *SI = dyn_cast<SelectInst>(U)) {
-        collectRetVal(SI->getTrueValue(), SI->getParent(), RS, Visited);
-        collectRetVal(SI->getFalseValue(), SI->getParent(), RS, Visited);
-        return;
-    }
+            User *U = dyn_cast<User>(V);
+            if (U == nullptr)
+                continue;
 
-    if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
-        Value *LV = LI->getPointerOperand();
-        // check for store operations
-        // return values (variables) are supposed to be local,
-        // so global alias analysis is not necessary;
-        // but what about local ones (FIXME)?
-        //
-        // FIXME: store -> load -> store -> load
-        for (Value::user_iterator UI = LV->user_begin(), UE = LV->user_end();
-                 UI != UE; ++UI) {
-
-            if (StoreInst *SI = dyn_cast<StoreInst>(*UI))
-                collectRetVal(SI->getValueOperand(),
-                        SI->getParent(), RS, Visited);
-        }
-        return;
-    }
+            if (ConstantInt *INT = dyn_cast<ConstantInt>(U)) {
+                RS.insert(std::make_pair(INT, BB));
+                continue;
+            }
 
-    if (CastInst *CI = dyn_cast<CastInst>(U)) {
-        Value *S = CI->getOperand(0);
-        collectRetVal(S, CI->getParent(), RS, Visited);
-        return;
-    }
+            // always process constant int
+            // so check visited here
+            if (!Visited.insert(V).second)
+                continue;
 
-    if (CallInst *CI = dyn_cast<CallInst>(U)) {
-        // do not consider forwarded return value
-        // except ERR_PTR
-        Function *F = CI->getCalledFunction();
-        if (F) {
-            if (F->hasName() && !F->getName().compare("ERR_PTR")) {
-                collectRetVal(CI->getArgOperand(0),
-                        CI->getParent(), RS, Visited);
+            if (ConstantExpr *CE = dyn_cast<ConstantExpr>(U)) {
+                if (CE->isCast()) {
+                    Value *S = CE->getOperand(0);
+                    WorkList.push_back(std::make_pair(S, BB));
+                    continue;
+                }
+                // fall through far other cases
             }
-        }
-        return;
-    }
 
-#if 0
-    for (User::op_iterator OI = U->op_begin(), OE = U->op_end();
-             OI != OE; ++OI) {
-        if (!isa<User>(*OI))
-            continue;
+            if (PHINode *PHI = dyn_cast<PHINode>(U)) {
+                for (unsigned i = PHI->getNumIncomingValues(); i != 0; --i) {
+                    WorkList.push_back(std::make_pair(PHI->getIncomingValue(i - 1),
+                            PHI->getIncomingBlock(i - 1)));
+                }
+                continue;
+            }
 
-        if (Visited.insert(*OI).second)
-            WorkList.push_back(*OI);
-    }
-#else
-    LSS_DEBUG("unsupported op: " << *U << "\n");
-    RS.insert(std::make_pair(U, BB));
-#endif
+            if (SelectInst *SI = dyn_cast<SelectInst>(U)) {
+                WorkList.push_back(std::make_pair(SI->getFalseValue(), SI->getParent()));
+                WorkList.push_back(std::make_pair(SI->getTrueValue(), SI->getParent()));
+                continue;
+            }
 
-}
+            if (LoadInst *LI = dyn_cast<LoadInst>(U)) {
+                Value *LV = LI->getPointerOperand();
+                // check for store operations
+                // return values (variables) are supposed to be local,
+                // so global alias analysis is not necessary;
+                // but what about local ones (FIXME)?
+                //
+                // FIXME: store -> load -> store -> load
+                //
+                // stored values are traced the first time the pointer is loaded,
+                // so the users of each pointer are only scanned once
+                if (!Scanned.insert(LV).second)
+                    continue;
 
-bool LinuxSS::runOnFunction(Function *F) {
+                Stores.clear();
+                for (User *PU : LV->users()) {
+                    if (StoreInst *SI = dyn_cast<StoreInst>(PU))
+                        Stores.push_back(SI);
+                }
+                for (auto SI = Stores.rbegin(), SE = Stores.rend(); SI != SE; ++SI)
+                    WorkList.push_back(std::make_pair((*SI)->getValueOperand(),
+                            (*SI)->getParent()));
+                continue;
+            }
 
-    bool ret = false;
+            if (CastInst *CI = dyn_cast<CastInst>(U)) {
+                Value *S = CI->getOperand(0);
+                WorkList.push_back(std::make_pair(S, CI->getParent()));
+                continue;
+            }
 
-    // calculate the dominator tree for current function
-    gDT->recalculate(*F);
-    gPDT->recalculate(*F);
+            if (CallInst *CI = dyn_cast<CallInst>(U)) {
+                // do not consider forwarded return value
+                // except ERR_PTR
+                Function *Callee = CI->getCalledFunction();
+                if (Callee) {
+                    if (Callee->hasName() && !Callee->getName().compare("ERR_PTR")) {
+                        WorkList.push_back(std::make_pair(CI->getArgOperand(0),
+                                CI->getParent()));
+                    }
+                }
+                continue;
+            }
 
-    ValueSet Visited;
-    RetSet RS;
-    for (BasicBlock &BB : *F) {
-        Instruction *T = BB.getTerminator();
-        if (ReturnInst *R = dyn_cast<ReturnInst>(T)) {
-            Value *RV = R->getReturnValue();
-            if (RV != nullptr)
-                collectRetVal(RV, &BB, RS, Visited);
+            LSS_DEBUG("unsupported op: " << *U << "\n");
+            RS.insert(std::make_pair(U, BB));
         }
     }
+}
+
+bool LinuxSS::runOnFunction(Function *F) {
 
     BBSet CheckList, BlackList;
-    for (RetPair const& RP : RS) {
+    for (RetPair const& RP : getRetVals(F)) {
         Value *V = RP.first;
         BasicBlock *BB = RP.second;
 
@@ -508,7 +654,8 @@ bool LinuxSS::runOnFunction(Function *F) {
         }
     }
 
-    ret = checkControlDep(CheckList, BlackList);
+    // control dependences are only needed (and built) from here on
+    checkControlDep(CheckList, BlackList);
 
     return false;
 }
@@ -524,13 +671,45 @@ bool LinuxSS::doFinalization(Module *M) {
 bool LinuxSS::doModulePass(Module *M) {
     bool changed = true, ret = false;
 
-    while (changed) {
-        changed = false;
-        for (Function &F : *M) {
-            if (F.isIntrinsic() || F.isDeclaration())
-                continue;
-            changed |= runOnFunction(&F);
+    std::vector<Function*> Funcs;
+    for (Function &F : *M) {
+        if (F.isIntrinsic() || F.isDeclaration())
+            continue;
+        Funcs.push_back(&F);
+        RetVals[&F];
+    }
+
+    // run Fn on each function in parallel, then print their logs in order
+    auto forEachFunc = [&](auto Fn) {
+        std::vector<FuncLog> Logs(Funcs.size());
+        parallelForEachN(0, Funcs.size(), [&](size_t i) {
+            CurLog = &Logs[i];
+            Fn(i);
+            CurLog = nullptr;
+        });
+        for (FuncLog &L : Logs) {
+            errs() << L.ES.str();
+            outs() << L.OS.str();
+        }
+    };
+
+    // return values do not change across iterations and are also looked up
+    // for callees, so collect them all up front
+    forEachFunc([&](size_t i) {
+        std::unique_ptr<RetSet> &RS = RetVals.find(Funcs[i])->second;
+        if (!RS) {
+            RS.reset(new RetSet());
+            collectRetVal(Funcs[i], *RS);
         }
+    });
+
+    // functions only share SecConds, analyze them in parallel
+    std::vector<char> Changed(Funcs.size());
+    while (changed) {
+        forEachFunc([&](size_t i) {
+            Changed[i] = runOnFunction(Funcs[i]);
+        });
+        changed = std::find(Changed.begin(), Changed.end(), 1) != Changed.end();
         ret |= changed;
     }
     return ret;
@@ -2,12 +2,17 @@
 #define _LINUX_SS_H
 
 #include <llvm/IR/Dominators.h>
+#include <llvm/ADT/BitVector.h>
 #include <llvm/ADT/SmallSet.h>
 #include "Global.h"
 
+#include <memory>
+#include <mutex>
 #include <set>
 #include <unordered_set>
 
+struct SecCondsData { typedef std::set<llvm::Value*> Type; };
+
 class LinuxSS : public IterativeModulePass {
 public:
     typedef std::pair<llvm::Value*, llvm::BasicBlock*> RetPair;
@@ -25,33 +30,52 @@ public:
 #endif
 
 private:
-    PostDomTree *gPDT;
-    DomTree *gDT;
+    // Control dependences and (post-)dominance of the blocks of a function,
+    // sets are bit vectors indexed by block number (order in the function)
+    struct ControlDeps {
+        std::vector<llvm::BasicBlock*> Blocks;
+        llvm::DenseMap<const llvm::BasicBlock*, unsigned> Index;
+        // branch blocks each block is control dependent on
+        std::vector<llvm::BitVector> DependsOn;
+        // the block itself and all it is transitively control dependent on
+        std::vector<llvm::BitVector> Closure;
+        // blocks control dependent on each successor edge of a block
+        std::vector<llvm::SmallVector<llvm::BitVector, 2> > Controls;
+        // blocks dominating / post-dominated by each block
+        std::vector<llvm::BitVector> Dominators;
+        std::vector<llvm::BitVector> PostDominated;
+
+        unsigned size() const { return Blocks.size(); }
+    };
+    // Only built for functions returning one of the checked errors
+    std::unique_ptr<ControlDeps> buildControlDeps(llvm::Function*);
+
+    // Constant (or untraceable) return values of each function, with the
+    // block they flow from. Filled before functions are analyzed in parallel,
+    // read-only afterwards.
+    llvm::DenseMap<const llvm::Function*, std::unique_ptr<RetSet> > RetVals;
+    const RetSet &getRetVals(llvm::Function*);
+
+    std::set<llvm::Value*> &SecConds;
+    std::mutex SecCondsLock;
 
     bool runOnFunction(llvm::Function*);
-    void collectRetVal(llvm::Value*, llvm::BasicBlock*, RetSet&, ValueSet&);
+    void collectRetVal(llvm::Function*, RetSet&);
     bool checkControlDep(BBSet&, BBSet&);
     bool isTrueFalseFunc(llvm::Function*);
-    bool isErrorBranch(llvm::BasicBlock*, llvm::BasicBlock*);
-    bool dumpControlDep(llvm::BasicBlock*, BBSet&);
+    bool isErrorBranch(ControlDeps&, llvm::BasicBlock*, llvm::BasicBlock*);
+    bool dumpControlDep(ControlDeps&, unsigned, llvm::BitVector&);
     bool collectCondition(llvm::Value*);
 
 public:
     LinuxSS(GlobalContext *Ctx_)
-        : IterativeModulePass(Ctx_, "LinuxSS") {
-#if LLVM_VERSION_MAJOR <= 4
-        gPDT = new PostDomTree(true);
-        gDT = new DomTree(false);
-#else
-        gPDT = new PostDomTree();
-        gDT = new DomTree();
-#endif
-        Ctx->add("SecConds", new std::set<llvm::Value*>());
+        : IterativeModulePass(Ctx_, "LinuxSS"),
+          SecConds(Ctx_->PassData.add<SecCondsData>()) {
     }
 
     ~LinuxSS() {
-        delete gPDT;
-        delete gDT;
+        // only used while the pass runs
+        Ctx->PassData.release<SecCondsData>();
     }
 
     virtual bool doModulePass(llvm::Module*);
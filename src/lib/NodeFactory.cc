@@ -69,9 +69,9 @@ NodeIndex AndersNodeFactory::createOpaqueObjectNode(const Value* val, const bool
     return nextIdx;
 }
 
-NodeIndex AndersNodeFactory::createObjectNode(const Value* val, const Type* ty, const bool uniono, const bool heap) {
+NodeIndex AndersNodeFactory::createObjectNode(const Value* val, const Type* ty, const bool uniono, const bool heap, const bool opaque) {
     unsigned nextIdx = nodes.size();
-    nodes.emplace_back(AndersNode(AndersNode::OBJ_NODE, nextIdx, val, ty, 0, uniono, heap));
+    nodes.emplace_back(AndersNode(AndersNode::OBJ_NODE, nextIdx, val, ty, 0, uniono, heap, opaque));
     if (val != nullptr) {
         if (objNodeMap.count(val))
             return objNodeMap[val];
@@ -81,13 +81,13 @@ NodeIndex AndersNodeFactory::createObjectNode(const Value* val, const Type* ty,
     return nextIdx;
 }
 
-NodeIndex AndersNodeFactory::createObjectNode(const NodeIndex base, const unsigned offset, const bool uniono, const bool heap) {
+NodeIndex AndersNodeFactory::createObjectNode(const NodeIndex base, const unsigned offset, const bool uniono, const bool heap, const bool opaque) {
     assert(offset != 0);
 
     unsigned nextIdx = nodes.size();
     assert(nextIdx == base + offset);
     const Value *val = getValueForNode(base);
-    nodes.emplace_back(AndersNode(AndersNode::OBJ_NODE, nextIdx, val, NULL, offset, uniono, heap));
+    nodes.emplace_back(AndersNode(AndersNode::OBJ_NODE, nextIdx, val, NULL, offset, uniono, heap, opaque));
 
     return nextIdx;
 }
@@ -115,7 +115,7 @@ NodeIndex AndersNodeFactory::createVarargNode(const llvm::Function* f) {
 NodeIndex AndersNodeFactory::getValueNodeFor(const Value* val) {
     if (const Constant* c = dyn_cast<Constant>(val))
         if (!isa<GlobalValue>(c))
-            return getValueNodeForConstant(c);
+            return getValueNodeForConstant(c, module);
 
     if (const GlobalVariable *globalVar = dyn_cast<GlobalVariable>(val)) {
         auto GID = globalVar->getGUID();
@@ -142,7 +142,7 @@ NodeIndex AndersNodeFactory::getValueNodeFor(const Value* val) {
     }
 }
 
-NodeIndex AndersNodeFactory::getValueNodeForConstant(const llvm::Constant* c) {
+NodeIndex AndersNodeFactory::getValueNodeForConstant(const llvm::Constant* c, llvm::Module* M) {
     if (!isa<PointerType>(c->getType()))
         return ConstantIntIndex;
 
@@ -154,7 +154,7 @@ NodeIndex AndersNodeFactory::getValueNodeForConstant(const llvm::Constant* c) {
         switch (ce->getOpcode()){
             case Instruction::GetElementPtr:
             {
-                NodeIndex baseNode = getValueNodeForConstant(ce->getOperand(0));
+                NodeIndex baseNode = getValueNodeForConstant(ce->getOperand(0), M);
                 assert(baseNode != InvalidIndex && "missing base val node for gep");
 
                 if (baseNode == NullObjectIndex)
@@ -165,7 +165,7 @@ NodeIndex AndersNodeFactory::getValueNodeForConstant(const llvm::Constant* c) {
                     return UniversalPtrIndex;
                 }
 
-                unsigned fieldNum = constGEPtoFieldNum(ce);
+                unsigned fieldNum = constGEPtoFieldNum(ce, M);
                 if (fieldNum == 0)
                     return baseNode;
 
@@ -216,7 +216,7 @@ NodeIndex AndersNodeFactory::getValueNodeForConstant(const llvm::Constant* c) {
 NodeIndex AndersNodeFactory::getObjectNodeFor(const Value* val) {
     if (const Constant* c = dyn_cast<const Constant>(val))
         if(!isa<GlobalValue>(c))
-            return getObjectNodeForConstant(c);
+            return getObjectNodeForConstant(c, module);
 
     if (const GlobalVariable *globalVar = dyn_cast<GlobalVariable>(val)) {
         auto GID = globalVar->getGUID();
@@ -247,7 +247,7 @@ NodeIndex AndersNodeFactory::getObjectNodeFor(const Value* val) {
         return itr->second;
 }
 
-NodeIndex AndersNodeFactory::getObjectNodeForConstant(const llvm::Constant* c) {
+NodeIndex AndersNodeFactory::getObjectNodeForConstant(const llvm::Constant* c, llvm::Module* M) {
     if(!isa<PointerType>(c->getType()))
         return getUniversalPtrNode();
 
@@ -259,12 +259,12 @@ NodeIndex AndersNodeFactory::getObjectNodeForConstant(const llvm::Constant* c) {
         switch (ce->getOpcode()) {
             case Instruction::GetElementPtr:
             {
-                NodeIndex baseNode = getObjectNodeForConstant(ce->getOperand(0));
+                NodeIndex baseNode = getObjectNodeForConstant(ce->getOperand(0), M);
                 assert(baseNode != InvalidIndex && "missing base obj node for gep");
                 if (baseNode == NullObjectIndex || baseNode == UniversalObjIndex)
                     return baseNode;
 
-                return getOffsetObjectNode(baseNode, constGEPtoFieldNum(ce));
+                return getOffsetObjectNode(baseNode, constGEPtoFieldNum(ce, M));
             }
             case Instruction::IntToPtr:
                 // FIXME
@@ -273,7 +273,7 @@ NodeIndex AndersNodeFactory::getObjectNodeForConstant(const llvm::Constant* c) {
                 // FIXME
                 return NullObjectIndex;
             case Instruction::BitCast:
-                return getObjectNodeForConstant(ce->getOperand(0));
+                return getObjectNodeForConstant(ce->getOperand(0), M);
             default:
                 errs() << "Constant Expr not yet handled: " << *ce << "\n";
                 llvm_unreachable(0);
@@ -311,9 +311,11 @@ NodeIndex AndersNodeFactory::getVarargNodeFor(const llvm::Function* f) {
         return itr->second;
 }
 
-unsigned AndersNodeFactory::constGEPtoFieldNum(const llvm::ConstantExpr* expr) const {
+unsigned AndersNodeFactory::constGEPtoFieldNum(const llvm::ConstantExpr* expr, llvm::Module* module) const {
     const GEPOperator* GEP = dyn_cast<GEPOperator>(expr);
     assert(GEP != NULL && "constGEPtoFieldNum receives a non-gep value!");
+    assert(module != NULL && "constGEPtoFieldNum receives a NULL module!");
+    const llvm::DataLayout* dataLayout = &module->getDataLayout();
 
     // we assume the base pointer has already been recursively processed
     // so there is no need to strip
@@ -127,7 +127,7 @@ private:
     GepMap gepMap;
     llvm::DenseMap<NodeIndex, std::pair<NodeIndex, unsigned> > gepNodeMap;
 
-    unsigned constGEPtoFieldNum(const llvm::ConstantExpr* expr) const;
+    unsigned constGEPtoFieldNum(const llvm::ConstantExpr* expr, llvm::Module* module) const;
 public:
     AndersNodeFactory();
 
@@ -145,9 +145,11 @@ public:
     NodeIndex createValueNode(const llvm::Value* val = NULL);
     NodeIndex createObjectNode(const llvm::Value* val = NULL,
         const llvm::Type* ty = NULL,
-        const bool uniono = false, const bool heap = false);
+        const bool uniono = false, const bool heap = false,
+        const bool opaque = false);
     NodeIndex createObjectNode(const NodeIndex base, const unsigned offset,
-        const bool uniono = false, const bool heap = false);
+        const bool uniono = false, const bool heap = false,
+        const bool opaque = false);
     NodeIndex createOpaqueObjectNode(const llvm::Value* val = NULL,
         const bool heap = false);
     NodeIndex createReturnNode(const llvm::Function* f);
@@ -155,9 +157,9 @@ public:
 
     // Map lookup interfaces (return NULL if value not found)
     NodeIndex getValueNodeFor(const llvm::Value* val);
-    NodeIndex getValueNodeForConstant(const llvm::Constant* c);
+    NodeIndex getValueNodeForConstant(const llvm::Constant* c, llvm::Module* M);
     NodeIndex getObjectNodeFor(const llvm::Value* val);
-    NodeIndex getObjectNodeForConstant(const llvm::Constant* c);
+    NodeIndex getObjectNodeForConstant(const llvm::Constant* c, llvm::Module* M);
     NodeIndex getReturnNodeFor(const llvm::Function* f);
     NodeIndex getVarargNodeFor(const llvm::Function* f);
 
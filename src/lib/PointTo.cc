@@ -17,6 +17,7 @@
 #include <llvm/IR/Value.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/Support/Parallel.h>
 
 #include "Common.h"
 #include "Annotation.h"
@@ -29,7 +30,8 @@ using namespace llvm;
 
 static NodeIndex processStruct(const Value* v, const StructType* stType, bool isHeap,
                                AndersNodeFactory &nodeFactory,
-                               StructAnalyzer &structAnalyzer) {
+                               StructAnalyzer &structAnalyzer,
+                               bool isOpaque = false) {
 
   if (stType->isOpaque()) {
     errs() << "Opaque struct type ";
@@ -58,9 +60,9 @@ static NodeIndex processStruct(const Value* v, const StructType* stType, bool is
   // construct variables only if they are used. We want to do the simplest thing first
   NodeIndex obj = nodeFactory.getObjectNodeFor(v);
   if (obj == AndersNodeFactory::InvalidIndex) { // avoid re-creating nodes
-    obj = nodeFactory.createObjectNode(v, stType, stInfo->isFieldUnion(0), isHeap);
+    obj = nodeFactory.createObjectNode(v, stType, stInfo->isFieldUnion(0), isHeap, isOpaque);
     for (unsigned i = 1; i < stSize; ++i)
-      nodeFactory.createObjectNode(obj, i, stInfo->isFieldUnion(i), isHeap);
+      nodeFactory.createObjectNode(obj, i, stInfo->isFieldUnion(i), isHeap, isOpaque);
   }
 
   return obj;
@@ -215,82 +217,111 @@ static void createNodeForGlobals(Module *M, AndersNodeFactory &nodeFactory,
   }
 }
 
-static NodeIndex createNodeForHeapObject(const Instruction *I, int SizeArg, int FlagArg,
-                                    AndersNodeFactory &nodeFactory, StructAnalyzer &structAnalyzer) {
-
-#if 1 //LLVM_VERSION_MAJOR > 13
-  // Assuming opaque pointer type
-  // We don't know what it points to, so we create an opaque object node
-  return nodeFactory.createOpaqueObjectNode(I, true);
-#else
-  const Type* elemType = pType->getElementType();
-
-  // TODO: using casting is not the best way, consider sizeof
-  if (elemType->isIntegerTy(8)) {
-    // Check all the users of inst
-    // TODO: use a working list to handle load/store
-    for (auto U: I->users()) {
-      if (const CastInst *CI = dyn_cast<CastInst>(U)) {
-        pType = dyn_cast<PointerType>(CI->getType());
-        if (!pType) continue;
-        elemType = pType->getElementType();
-        break;
-      }
-    }
+// a struct type is a better guess of the allocation type if it is larger,
+// unless it no longer fits into the known allocation size
+static inline bool isBetterHeapType(const StructInfo *oldInfo, const StructInfo *newInfo,
+                                    uint64_t size) {
+  if (oldInfo == nullptr)
+    return true;
+  if (size != 0) {
+    bool oldFit = oldInfo->getAllocSize() <= size;
+    bool newFit = newInfo->getAllocSize() <= size;
+    if (oldFit != newFit)
+      return newFit;
   }
+  return newInfo->getExpandedSize() > oldInfo->getExpandedSize();
+}
 
-  unsigned maxSize = 0;
-  uint64_t allocSize = 1;
-  const StructInfo* stInfo = nullptr;
-  bool isUnion = false;
-  while (const ArrayType* arrayType = dyn_cast<ArrayType>(elemType)) {
-    allocSize *= arrayType->getNumElements();
-    elemType = arrayType->getElementType();
+// infer the allocation type of a heap object from how the returned ptr is used:
+// casts to a struct ptr, GEPs through a struct type, and stores of the ptr
+// into a field of struct ptr type
+static const StructType* inferHeapType(const Instruction *I, int SizeArg,
+                                       Module *M, StructAnalyzer &structAnalyzer) {
+  uint64_t size = 0;
+  if (SizeArg >= 0) {
+    if (const ConstantInt *CI = dyn_cast<ConstantInt>(I->getOperand(SizeArg)))
+      size = CI->getZExtValue();
   }
-  if (allocSize == 0) allocSize = 1;
 
-  if (const StructType* structType = dyn_cast<StructType>(elemType)) {
-    stInfo = structAnalyzer.getStructInfo(structType, nodeFactory.getModule());
-    assert(stInfo != nullptr && "structInfoMap should have info for all structs!");
-    if (!structType->isLiteral() && structType->getStructName().startswith("union"))
-      isUnion = true;
-    maxSize = stInfo->getExpandedSize();
-    allocSize *= stInfo->getAllocSize();
-  }
+  const StructType *bestTy = nullptr;
+  const StructInfo *bestInfo = nullptr;
+  auto consider = [&](Type *T) {
+    while (const ArrayType *arrayType = dyn_cast<ArrayType>(T))
+      T = arrayType->getElementType();
+    const StructType *STy = dyn_cast<StructType>(T);
+    if (!STy || STy->isOpaque())
+      return;
+    // unions are handled as a single object anyway
+    if (!STy->isLiteral() && STy->getName().startswith("union"))
+      return;
+    const StructInfo *stInfo = structAnalyzer.getStructInfo(STy, M);
+    if (stInfo == nullptr || stInfo->isEmpty())
+      return;
+    if (isBetterHeapType(bestInfo, stInfo, size)) {
+      bestTy = STy;
+      bestInfo = stInfo;
+    }
+  };
 
-  // if size arg exists
-  if (SizeArg >= 0) {
-    const Value *SV = I->getOperand(SizeArg);
-    if (const ConstantInt *size = dyn_cast<ConstantInt>(SV)) {
-      uint64_t zext_size = size->getZExtValue();
-      if (zext_size > allocSize) {
-        assert(zext_size < (uint64_t)UINT_MAX);
-        maxSize = zext_size;
+  SmallVector<const Value*, 8> worklist;
+  SmallPtrSet<const Value*, 8> visited;
+  worklist.push_back(I);
+  while (!worklist.empty()) {
+    const Value *V = worklist.pop_back_val();
+    if (!visited.insert(V).second)
+      continue;
+    for (auto U: V->users()) {
+      if (const BitCastInst *BC = dyn_cast<BitCastInst>(U)) {
+        // the struct type is taken from the GEPs on the casted ptr
+        worklist.push_back(BC);
+      } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(U)) {
+        if (GEP->getPointerOperand() == V)
+          consider(GEP->getSourceElementType());
+      } else if (const StoreInst *SI = dyn_cast<StoreInst>(U)) {
+        if (SI->getValueOperand() != V)
+          continue;
+        // the field the ptr is stored to tells its type
+        const GEPOperator *Slot = dyn_cast<GEPOperator>(SI->getPointerOperand());
+        if (!Slot)
+          continue;
+        if (PointerType *VT = dyn_cast<PointerType>(Slot->getResultElementType())) {
+          if (!VT->isOpaque())
+            consider(VT->getPointerElementType());
+        }
       }
     }
-  } else {
-    // FIXME: kmem_cache_alloc
   }
 
-  if (maxSize == 0) maxSize = StructInfo::getMaxStructSize();
-
-  // Create the first heap node
-  NodeIndex obj = nodeFactory.getObjectNodeFor(I);
-  if (obj == AndersNodeFactory::InvalidIndex) {
-    obj = nodeFactory.createObjectNode(I, isUnion, true);
-    for (unsigned i = 1; i < maxSize; ++i) {
-      isUnion = (stInfo && i < stInfo->getExpandedSize()) ? stInfo->isFieldUnion(i) : false;
-      nodeFactory.createObjectNode(obj, i, isUnion, true);
-    }
+  if (bestTy != nullptr) {
+    PT_LOG("Inferred heap type " << *bestTy << " for " << *I << "\n");
   }
-#endif
+  return bestTy;
+}
+
+static NodeIndex createNodeForHeapObject(const Instruction *I, int SizeArg, int FlagArg,
+                                    AndersNodeFactory &nodeFactory, StructAnalyzer &structAnalyzer) {
+
+  // The heap object is created with the inferred type, so it rarely needs to be
+  // resized later. But the inferred type is only a guess, so the object remains
+  // opaque, which allows extendObjectSize() and allocator wrapper detection.
+  if (const StructType *STy = inferHeapType(I, SizeArg, nodeFactory.getModule(), structAnalyzer))
+    return processStruct(I, STy, true, nodeFactory, structAnalyzer, true);
+
+  // We don't know what it points to, so we create an opaque object node
+  return nodeFactory.createOpaqueObjectNode(I, true);
 }
 
+// points-to edges (obj -> target) collected from global initializers
+typedef std::vector<std::pair<NodeIndex, NodeIndex> > InitEdgeList;
+
+// NOTE: may run concurrently for different modules, so it must not modify
+// the node factory (including its current module) nor the global PtsGraph
 static void processInitializer(NodeIndex obj, const Type *objTy, Constant *init,
-                               AndersNodeFactory &nodeFactory,
-                               PtsGraph &ptsGraph) {
+                               Module *M, AndersNodeFactory &nodeFactory,
+                               InitEdgeList &edges) {
 
   assert(obj != AndersNodeFactory::InvalidIndex && "Invalid node index for global object");
+  const DataLayout *dataLayout = &M->getDataLayout();
 
   // collapse array type
   while (const ArrayType *arrayType = dyn_cast<ArrayType>(objTy))
@@ -299,8 +330,14 @@ static void processInitializer(NodeIndex obj, const Type *objTy, Constant *init,
   // look for global values in the initializer
   if (ConstantArray *CA = dyn_cast<ConstantArray>(init)) {
     // array, always collapse, process element by element
-    for (unsigned i = 0; i != CA->getNumOperands(); ++i)
-      processInitializer(obj, objTy, CA->getOperand(i), nodeFactory, ptsGraph);
+    // constants are uniqued, so repeated elements (e.g., tables filled with
+    // the same handler) only need to be processed once for the collapsed obj
+    SmallPtrSet<const Constant*, 16> visited;
+    for (unsigned i = 0; i != CA->getNumOperands(); ++i) {
+      Constant *elem = CA->getOperand(i);
+      if (visited.insert(elem).second)
+        processInitializer(obj, objTy, elem, M, nodeFactory, edges);
+    }
   } else if (ConstantStruct *CS = dyn_cast<ConstantStruct>(init)) {
     // handle struct type specially, could be tricky because of type mismatch
     // GV could be allocated using the used type (see createNodeForGlobals)
@@ -310,7 +347,6 @@ static void processInitializer(NodeIndex obj, const Type *objTy, Constant *init,
       PT_LOG("Initializer type mismatch for " << *CS << " vs " << *objTy << "\n");
       assert(CSTy->isLiteral() && "Non-literal struct type mismatch");
       const StructType *STy = dyn_cast<StructType>(objTy);
-      auto dataLayout = nodeFactory.getDataLayout();
       auto objSize = dataLayout->getTypeAllocSize(const_cast<Type*>(objTy));
       for (unsigned i = 0, j = 0; i != CSTy->getNumElements(); ++i) {
         // XXX try a heuristic
@@ -318,13 +354,13 @@ static void processInitializer(NodeIndex obj, const Type *objTy, Constant *init,
         auto elemSize = dataLayout->getTypeAllocSize(elemTy);
         if (elemSize % objSize == 0) {
           // element size is a multiple of object size, use base type
-          processInitializer(obj, objTy, CS->getOperand(i), nodeFactory, ptsGraph);
+          processInitializer(obj, objTy, CS->getOperand(i), M, nodeFactory, edges);
         } else {
           // we could be looking at a sub-field
           assert(STy != NULL && "Struct initializer for non-struct type");
           NodeIndex field = nodeFactory.getOffsetObjectNode(obj, j);
           assert(field != AndersNodeFactory::InvalidIndex && "Invalid node index for field");
-          processInitializer(field, STy->getElementType(j), CS->getOperand(i), nodeFactory, ptsGraph);
+          processInitializer(field, STy->getElementType(j), CS->getOperand(i), M, nodeFactory, edges);
           // advance to next field if not array type
           if (!elemTy->isArrayTy()) ++j;
         }
@@ -338,20 +374,20 @@ static void processInitializer(NodeIndex obj, const Type *objTy, Constant *init,
           elemTy = arrayType->getElementType();
         NodeIndex field = nodeFactory.getOffsetObjectNode(obj, i);
         assert(field != AndersNodeFactory::InvalidIndex && "Invalid node index for field");
-        processInitializer(field, elemTy, CS->getOperand(i), nodeFactory, ptsGraph);
+        processInitializer(field, elemTy, CS->getOperand(i), M, nodeFactory, edges);
       }
     }
   } else if (ConstantVector *CV = dyn_cast<ConstantVector>(init)) {
     // FIXME: handle vector type
     // for (unsigned i = 0; i != CV->getNumOperands(); ++i)
-    //   processInitializer(obj, objTy, CV->getOperand(i), nodeFactory, ptsGraph);
+    //   processInitializer(obj, objTy, CV->getOperand(i), M, nodeFactory, edges);
     WARNING("Unhandled vector initializer: " << *init << "\n");
   } else if (ConstantAggregateZero *CAZ = dyn_cast<ConstantAggregateZero>(init)) {
     // zero initializer
     Type *Ty = CAZ->getType();
     if (isa<ArrayType>(Ty) || isa<VectorType>(Ty)) {
       // array or vector, process element only once
-      processInitializer(obj, objTy, CAZ->getSequentialElement(), nodeFactory, ptsGraph);
+      processInitializer(obj, objTy, CAZ->getSequentialElement(), M, nodeFactory, edges);
     } else {
       StructType *CSTy = dyn_cast<StructType>(Ty);
       assert(CSTy != NULL && "Invalid zero initializer type");
@@ -367,36 +403,36 @@ static void processInitializer(NodeIndex obj, const Type *objTy, Constant *init,
           elem = cast<ConstantAggregateZero>(elem)->getSequentialElement();
         }
         NodeIndex field = nodeFactory.getOffsetObjectNode(obj, i);
-        processInitializer(field, elemTy, elem, nodeFactory, ptsGraph);
+        processInitializer(field, elemTy, elem, M, nodeFactory, edges);
       }
     }
   } else {
     // non-aggregate initializer
     assert(objTy->isSingleValueType() && "Single value initializer for non single value type");
     if (isa<ConstantPointerNull>(init)) {
-      ptsGraph[obj].insert(nodeFactory.getNullObjectNode());
+      edges.emplace_back(obj, nodeFactory.getNullObjectNode());
     } else if (isa<GlobalVariable>(init)) {
       NodeIndex objNode = nodeFactory.getObjectNodeFor(init); // already handles name to def mapping
       assert(objNode != AndersNodeFactory::InvalidIndex && "Invalid node index for global variable");
-      ptsGraph[obj].insert(objNode);
+      edges.emplace_back(obj, objNode);
       PT_LOG("assign global variable " << cast<GlobalVariable>(init)->getName() << " to " << obj << "\n");
     } else if (isa<Function>(init)) {
       NodeIndex objNode = nodeFactory.getObjectNodeFor(init); // already handles name to def mapping
       assert(objNode != AndersNodeFactory::InvalidIndex && "Invalid node index for function");
-      ptsGraph[obj].insert(objNode);
+      edges.emplace_back(obj, objNode);
       PT_LOG("assign function " << cast<Function>(init)->getName() << " to " << obj << "\n");
     } else if (isa<ConstantExpr>(init)) {
       ConstantExpr *CE = cast<ConstantExpr>(init);
       switch (CE->getOpcode()) {
         case Instruction::GetElementPtr: {
-          NodeIndex field = nodeFactory.getObjectNodeForConstant(CE);
+          NodeIndex field = nodeFactory.getObjectNodeForConstant(CE, M);
           assert(!AndersNodeFactory::isSpecialNode(field) && "Invalid node index for field");
-          ptsGraph[obj].insert(field);
+          edges.emplace_back(obj, field);
           break;
         }
         case Instruction::BitCast: {
           // BitCast, process the operand
-          processInitializer(obj, objTy, CE->getOperand(0), nodeFactory, ptsGraph);
+          processInitializer(obj, objTy, CE->getOperand(0), M, nodeFactory, edges);
           break;
         }
         // case Instruction::IntToPtr: {
@@ -447,7 +483,7 @@ void populateNodeFactory(GlobalContext &GlobalCtx) {
         continue;
     
       int size, flag;
-      if (isAllocFn(F.getName(), &size, &flag))
+      if (isAllocFn(&F, &size, &flag))
         continue;
     
       // Scan the function body
@@ -472,7 +508,7 @@ void populateNodeFactory(GlobalContext &GlobalCtx) {
           case Instruction::Call: {
             const CallInst *CI = dyn_cast<CallInst>(I);
             if (Function *CF = CI->getCalledFunction()) {
-              if (isAllocFn(CF->getName(), &size, &flag)) {
+              if (isAllocFn(CF, &size, &flag)) {
                 NodeIndex obj = createNodeForHeapObject(CI, size, flag, nodeFactory, structAnalyzer);
                 ptsGraph[valNode].insert(obj);
                 GlobalCtx.AllocSites.insert(CI);
@@ -497,19 +533,35 @@ void populateNodeFactory(GlobalContext &GlobalCtx) {
 
   // iterate again to process global initializers
   // collecting point2 information for global values
-  for (auto i = GlobalCtx.Modules.begin(), e = GlobalCtx.Modules.end(); i != e; ++i) {
-    Module *M = i->first;
-    nodeFactory.setDataLayout(&(M->getDataLayout()));
-    nodeFactory.setModule(M);
+  // modules are processed in parallel, each into its own edge list, and
+  // the lists are merged in module order so the result is deterministic
+  std::vector<InitEdgeList> moduleEdges(GlobalCtx.Modules.size());
+  parallelForEachN(0, GlobalCtx.Modules.size(), [&](size_t i) {
+    Module *M = GlobalCtx.Modules[i].first;
 
     for (auto &GV: M->globals()) {
       if (GV.hasInitializer()) {
         NodeIndex obj = nodeFactory.getObjectNodeFor(&GV);
         const Type *Ty = nodeFactory.getObjectType(obj);
         //PT_LOG("Processing initializer for global " << GV.getName() << " type " << *Ty << " with " << *GV.getInitializer() << "\n");
-        processInitializer(obj, Ty, GV.getInitializer(), nodeFactory, ptsGraph);
+        processInitializer(obj, Ty, GV.getInitializer(), M, nodeFactory, moduleEdges[i]);
+      }
+    }
+  });
+
+  // edges of the same (collapsed) object are mostly adjacent, so only look up
+  // the destination set when the source changes
+  for (auto &edges : moduleEdges) {
+    NodeIndex src = AndersNodeFactory::InvalidIndex;
+    AndersPtsSet *dst = nullptr;
+    for (auto &edge : edges) {
+      if (edge.first != src) {
+        src = edge.first;
+        dst = &ptsGraph[src];
       }
+      dst->insert(edge.second);
     }
+    InitEdgeList().swap(edges);
   }
 }
 
@@ -576,8 +628,9 @@ unsigned offsetToFieldNum(const Type* type, int64_t off, const DataLayout* dataL
       assert(stInfo != NULL && "structInfoMap should have info for all structs!");
       stType = const_cast<StructType*>(stInfo->getRealType());
 
-      const StructLayout* stLayout = stInfo->getDataLayout()->getStructLayout(stType);
-      uint64_t allocSize = stInfo->getDataLayout()->getTypeAllocSize(stType);
+      // use the caller's layout, which is only touched by the thread of its module
+      const StructLayout* stLayout = dataLayout->getStructLayout(stType);
+      uint64_t allocSize = dataLayout->getTypeAllocSize(stType);
       PT_LOG("allocSize = " << allocSize << ", offset = " << off << "\n");
       if (!allocSize)
         return 0;
@@ -586,14 +639,14 @@ unsigned offsetToFieldNum(const Type* type, int64_t off, const DataLayout* dataL
       offset %= allocSize;
       unsigned idx = stLayout->getElementContainingOffset(offset);
       if (!stType->isLiteral() && stType->getName().startswith("union")) {
-        offset -= stInfo->getDataLayout()->getTypeAllocSize(stType);
+        offset -= dataLayout->getTypeAllocSize(stType);
         if (offset <= 0)
           break;
       }
       ret += stInfo->getOffset(idx);
 
       if (!stType->isLiteral() && stType->getName().startswith("union")) {
-        offset -= stInfo->getDataLayout()->getTypeAllocSize(stType);
+        offset -= dataLayout->getTypeAllocSize(stType);
       } else {
         offset -= stLayout->getElementOffset(idx);
       }
@@ -655,8 +708,8 @@ NodeIndex extendObjectSize(NodeIndex oldObj, const StructType* stType,
   itr->second.reset(oldObj);
   nodeFactory.removeNodeForObject(val);
 
-  // create new obj
-  NodeIndex newObj = processStruct(val, stType, isHeap, nodeFactory, structAnalyzer);
+  // create new obj, the new type is still a guess, so keep it resizable
+  NodeIndex newObj = processStruct(val, stType, isHeap, nodeFactory, structAnalyzer, true);
 
   // update ptr2set
   updateObjectNode(oldObj, newObj, nodeFactory, ptsGraph);
@@ -0,0 +1,311 @@
+/*
+ * Persisted points-to results
+ *
+ * Copyright (C) 2024 Chengyu Song
+ *
+ * For licensing details see LICENSE
+ */
+
+#include <llvm/Support/LEB128.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+#include "DBFile.h"
+#include "PtsDB.h"
+
+using namespace llvm;
+
+const char PointsToDB::Magic[8] = {'K', 'A', 'P', 'T', 'S', 'D', 'B', '1'};
+
+bool PointsToDB::load(StringRef path)
+{
+  std::unique_ptr<MemoryBuffer> buf = loadWithMagic(path, Magic, sizeof(FileHeader));
+  if (!buf)
+    return false;
+
+  const char* start = buf->getBufferStart();
+  uint64_t size = buf->getBufferSize();
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(start);
+
+  uint64_t moduleStart = sizeof(FileHeader);
+  uint64_t functionStart = moduleStart + (uint64_t)header->numModules * sizeof(FileName);
+  uint64_t valueStart = functionStart + (uint64_t)header->numFunctions * sizeof(FileFunction);
+  uint64_t objectStart = valueStart + (uint64_t)header->numValues * sizeof(FileValue);
+  uint64_t pointeeStart = objectStart + (uint64_t)header->numObjects * sizeof(FileObject);
+  uint64_t stringStart = pointeeStart + header->pointeeSize;
+  uint64_t stringSize = header->stringSize;
+  if (stringStart + stringSize != size)
+    return false;
+
+  const FileName* mods = reinterpret_cast<const FileName*>(start + moduleStart);
+  for (uint32_t i = 0; i < header->numModules; ++i) {
+    if ((uint64_t)mods[i].nameOffset + mods[i].nameSize > stringSize)
+      return false;
+  }
+  const FileFunction* funcs = reinterpret_cast<const FileFunction*>(start + functionStart);
+  for (uint32_t i = 0; i < header->numFunctions; ++i) {
+    if ((uint64_t)funcs[i].nameOffset + funcs[i].nameSize > stringSize ||
+        funcs[i].module >= header->numModules)
+      return false;
+  }
+  const FileValue* vals = reinterpret_cast<const FileValue*>(start + valueStart);
+  for (uint32_t i = 0; i < header->numValues; ++i) {
+    if (vals[i].pointeeOffset > header->pointeeSize)
+      return false;
+  }
+
+  modules = mods;
+  functions = funcs;
+  values = vals;
+  objects = reinterpret_cast<const FileObject*>(start + objectStart);
+  pointees = reinterpret_cast<const uint8_t*>(start + pointeeStart);
+  strings = start + stringStart;
+  numModules = header->numModules;
+  numFunctions = header->numFunctions;
+  numValues = header->numValues;
+  numObjects = header->numObjects;
+  pointeeSize = header->pointeeSize;
+  buffer = std::move(buf);
+  return true;
+}
+
+uint32_t PointsToDB::findModule(StringRef name) const
+{
+  const FileName* end = modules + numModules;
+  const FileName* mod = std::lower_bound(modules, end, name,
+      [this](const FileName& m, StringRef n) { return getString(m.nameOffset, m.nameSize) < n; });
+  if (mod == end || getString(mod->nameOffset, mod->nameSize) != name)
+    return None;
+  return mod - modules;
+}
+
+uint32_t PointsToDB::findFunction(uint32_t module, StringRef name) const
+{
+  auto key = std::make_pair(module, name);
+  const FileFunction* end = functions + numFunctions;
+  const FileFunction* func = std::lower_bound(functions, end, key,
+      [this](const FileFunction& f, const std::pair<uint32_t, StringRef>& k) {
+        return std::make_pair((uint32_t)f.module, getString(f.nameOffset, f.nameSize)) < k;
+      });
+  if (func == end || func->module != module || getString(func->nameOffset, func->nameSize) != name)
+    return None;
+  return func - functions;
+}
+
+StringRef PointsToDB::getModuleName(uint32_t module) const
+{
+  if (module >= numModules)
+    return StringRef();
+  return getString(modules[module].nameOffset, modules[module].nameSize);
+}
+
+StringRef PointsToDB::getFunctionName(uint32_t function) const
+{
+  if (function >= numFunctions)
+    return StringRef();
+  return getString(functions[function].nameOffset, functions[function].nameSize);
+}
+
+const PointsToDB::FileValue* PointsToDB::findValue(const ValueKey& key) const
+{
+  const FileValue* end = values + numValues;
+  const FileValue* val = std::lower_bound(values, end, key,
+      [](const FileValue& v, const ValueKey& k) { return getKey(v.key) < k; });
+  if (val == end || !(getKey(val->key) == key))
+    return nullptr;
+  return val;
+}
+
+void PointsToDB::decodePointees(const FileValue* val, SmallVectorImpl<uint32_t>& objs) const
+{
+  const uint8_t* p = pointees + val->pointeeOffset;
+  const uint8_t* end = pointees + pointeeSize;
+  uint64_t obj = 0;
+  for (uint32_t i = 0; i < val->numPointees; ++i) {
+    unsigned n;
+    const char* error = nullptr;
+    obj += decodeULEB128(p, &n, end, &error);
+    if (error || obj >= numObjects)
+      return;
+    objs.push_back(obj);
+    p += n;
+  }
+}
+
+bool PointsToDB::getPointees(const ValueKey& key, SmallVectorImpl<uint32_t>& objs) const
+{
+  const FileValue* val = findValue(key);
+  if (!val)
+    return false;
+  decodePointees(val, objs);
+  return true;
+}
+
+PointsToDB::ObjectInfo PointsToDB::getObject(uint32_t object) const
+{
+  assert(object < numObjects);
+  const FileObject& obj = objects[object];
+  return ObjectInfo{getKey(obj.site), obj.offset, obj.size, obj.flags};
+}
+
+bool PointsToDB::mayAlias(const ValueKey& a, const ValueKey& b) const
+{
+  const FileValue* va = findValue(a);
+  const FileValue* vb = findValue(b);
+  if (!va || !vb)
+    return true;
+
+  // null does not count as a common object, not even with the universal one
+  SmallVector<uint32_t, 16> pa, pb;
+  decodePointees(va, pa);
+  decodePointees(vb, pb);
+  auto isNull = [this](uint32_t obj) { return objects[obj].flags & NullObject; };
+  pa.erase(std::remove_if(pa.begin(), pa.end(), isNull), pa.end());
+  pb.erase(std::remove_if(pb.begin(), pb.end(), isNull), pb.end());
+  for (uint32_t obj : pa)
+    if (objects[obj].flags & UniversalObject)
+      return !pb.empty();
+  for (uint32_t obj : pb)
+    if (objects[obj].flags & UniversalObject)
+      return !pa.empty();
+
+  // both are sorted
+  auto i = pa.begin(), j = pb.begin();
+  while (i != pa.end() && j != pb.end()) {
+    if (*i < *j)
+      ++i;
+    else if (*j < *i)
+      ++j;
+    else
+      return true;
+  }
+  return false;
+}
+
+bool PointsToDB::save(StringRef path)
+{
+  // sort modules by name, functions by (module, name)
+  std::vector<uint32_t> moduleOrder(pendingModules.size());
+  std::iota(moduleOrder.begin(), moduleOrder.end(), 0);
+  std::sort(moduleOrder.begin(), moduleOrder.end(),
+      [this](uint32_t a, uint32_t b) { return pendingModules[a] < pendingModules[b]; });
+  std::vector<uint32_t> moduleMap(pendingModules.size());
+  for (uint32_t i = 0; i < moduleOrder.size(); ++i)
+    moduleMap[moduleOrder[i]] = i;
+
+  for (auto& func : pendingFunctions)
+    func.first = moduleMap[func.first];
+  std::vector<uint32_t> functionOrder(pendingFunctions.size());
+  std::iota(functionOrder.begin(), functionOrder.end(), 0);
+  std::sort(functionOrder.begin(), functionOrder.end(),
+      [this](uint32_t a, uint32_t b) { return pendingFunctions[a] < pendingFunctions[b]; });
+  std::vector<uint32_t> functionMap(pendingFunctions.size());
+  for (uint32_t i = 0; i < functionOrder.size(); ++i)
+    functionMap[functionOrder[i]] = i;
+
+  auto remap = [&](ValueKey& key) {
+    if (key.module != None)
+      key.module = moduleMap[key.module];
+    if (key.function != None)
+      key.function = functionMap[key.function];
+  };
+
+  // objects by (site, offset), so numbers do not depend on the analysis order
+  for (auto& obj : pendingObjects)
+    remap(obj.first.site);
+  std::vector<uint32_t> objectOrder(pendingObjects.size());
+  std::iota(objectOrder.begin(), objectOrder.end(), 0);
+  std::sort(objectOrder.begin(), objectOrder.end(), [this](uint32_t a, uint32_t b) {
+    const auto& oa = pendingObjects[a];
+    const auto& ob = pendingObjects[b];
+    return std::tie(oa.first.site, oa.first.offset, oa.second) <
+           std::tie(ob.first.site, ob.first.offset, ob.second);
+  });
+  std::vector<uint32_t> objectMap(pendingObjects.size());
+  for (uint32_t i = 0; i < objectOrder.size(); ++i)
+    objectMap[objectOrder[i]] = i;
+
+  for (auto& val : pendingValues) {
+    remap(val.first);
+    for (auto& obj : val.second)
+      obj = objectMap[obj];
+    std::sort(val.second.begin(), val.second.end());
+    val.second.erase(std::unique(val.second.begin(), val.second.end()), val.second.end());
+  }
+  std::sort(pendingValues.begin(), pendingValues.end(),
+      [](const std::pair<ValueKey, std::vector<uint32_t> >& a,
+         const std::pair<ValueKey, std::vector<uint32_t> >& b) { return a.first < b.first; });
+
+  FileHeader header;
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.numModules = pendingModules.size();
+  header.numFunctions = pendingFunctions.size();
+  header.numValues = pendingValues.size();
+  header.numObjects = pendingObjects.size();
+
+  auto setKey = [](FileKey& fk, const ValueKey& key) {
+    fk.module = key.module;
+    fk.function = key.function;
+    fk.index = key.index;
+  };
+
+  uint64_t stringSize = 0;
+  std::vector<FileName> mods(moduleOrder.size());
+  for (uint32_t i = 0; i < moduleOrder.size(); ++i) {
+    const std::string& name = pendingModules[moduleOrder[i]];
+    mods[i].nameOffset = stringSize;
+    mods[i].nameSize = name.size();
+    stringSize += name.size();
+  }
+  std::vector<FileFunction> funcs(functionOrder.size());
+  for (uint32_t i = 0; i < functionOrder.size(); ++i) {
+    const auto& func = pendingFunctions[functionOrder[i]];
+    funcs[i].module = func.first;
+    funcs[i].nameOffset = stringSize;
+    funcs[i].nameSize = func.second.size();
+    funcs[i].reserved = 0;
+    stringSize += func.second.size();
+  }
+  header.stringSize = stringSize;
+
+  std::string encoded;
+  raw_string_ostream ES(encoded);
+  std::vector<FileValue> vals(pendingValues.size());
+  for (size_t i = 0; i < pendingValues.size(); ++i) {
+    setKey(vals[i].key, pendingValues[i].first);
+    vals[i].numPointees = pendingValues[i].second.size();
+    vals[i].pointeeOffset = ES.tell();
+    uint32_t prev = 0;
+    for (uint32_t obj : pendingValues[i].second) {
+      encodeULEB128(obj - prev, ES);
+      prev = obj;
+    }
+  }
+  ES.flush();
+  header.pointeeSize = encoded.size();
+
+  std::vector<FileObject> objs(objectOrder.size());
+  for (uint32_t i = 0; i < objectOrder.size(); ++i) {
+    const ObjectInfo& obj = pendingObjects[objectOrder[i]].first;
+    setKey(objs[i].site, obj.site);
+    objs[i].offset = obj.offset;
+    objs[i].size = obj.size;
+    objs[i].flags = obj.flags;
+  }
+
+  return writeFileAtomically(path, [&](raw_ostream& OS) {
+    OS.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    OS.write(reinterpret_cast<const char*>(mods.data()), mods.size() * sizeof(FileName));
+    OS.write(reinterpret_cast<const char*>(funcs.data()), funcs.size() * sizeof(FileFunction));
+    OS.write(reinterpret_cast<const char*>(vals.data()), vals.size() * sizeof(FileValue));
+    OS.write(reinterpret_cast<const char*>(objs.data()), objs.size() * sizeof(FileObject));
+    OS << encoded;
+    for (uint32_t i : moduleOrder)
+      OS << pendingModules[i];
+    for (uint32_t i : functionOrder)
+      OS << pendingFunctions[i].second;
+  });
+}
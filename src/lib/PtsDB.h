@@ -0,0 +1,170 @@
+#ifndef PTS_DB_H
+#define PTS_DB_H
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Points-to results of CallGraphPass, keyed by the position of the value in
+// the bitcode so they can be queried without re-running the analysis.
+// The file is mapped into memory and searched in place, its format is
+//   header | modules | functions | values | objects | pointees | string table
+// Modules are sorted by name, functions by (module, name), values by key.
+// Pointees of a value are the sorted object numbers, delta and LEB128 encoded.
+class PointsToDB
+{
+public:
+	static const uint32_t None = ~0U;
+
+	// A value is identified by its module, function and its number in the
+	// function, arguments first, then instructions in order.
+	// Globals have no function and are numbered in module order, a function
+	// itself has no number.
+	struct ValueKey {
+		uint32_t module = None;
+		uint32_t function = None;
+		uint32_t index = None;
+
+		bool operator<(const ValueKey& k) const {
+			return std::tie(module, function, index) < std::tie(k.module, k.function, k.index);
+		}
+		bool operator==(const ValueKey& k) const {
+			return module == k.module && function == k.function && index == k.index;
+		}
+	};
+
+	enum ObjectFlags {
+		HeapObject = 1,
+		UnionObject = 2,
+		OpaqueObject = 4,
+		// may be any object, aliases everything
+		UniversalObject = 8,
+		NullObject = 16,
+	};
+
+	// A field of an abstract object, site is the allocation site if known
+	struct ObjectInfo {
+		ValueKey site;
+		uint32_t offset;
+		uint32_t size;
+		uint32_t flags;
+	};
+
+private:
+	struct FileHeader {
+		char magic[8];
+		llvm::support::ulittle32_t numModules;
+		llvm::support::ulittle32_t numFunctions;
+		llvm::support::ulittle32_t numValues;
+		llvm::support::ulittle32_t numObjects;
+		llvm::support::ulittle64_t pointeeSize;
+		llvm::support::ulittle64_t stringSize;
+	};
+
+	struct FileName {
+		llvm::support::ulittle32_t nameOffset;
+		llvm::support::ulittle32_t nameSize;
+	};
+
+	struct FileFunction {
+		llvm::support::ulittle32_t module;
+		llvm::support::ulittle32_t nameOffset;
+		llvm::support::ulittle32_t nameSize;
+		llvm::support::ulittle32_t reserved;
+	};
+
+	struct FileKey {
+		llvm::support::ulittle32_t module;
+		llvm::support::ulittle32_t function;
+		llvm::support::ulittle32_t index;
+	};
+
+	struct FileValue {
+		FileKey key;
+		llvm::support::ulittle32_t numPointees;
+		llvm::support::ulittle64_t pointeeOffset;
+	};
+
+	struct FileObject {
+		FileKey site;
+		llvm::support::ulittle32_t offset;
+		llvm::support::ulittle32_t size;
+		llvm::support::ulittle32_t flags;
+	};
+
+	static const char Magic[8];
+
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+	const FileName* modules = nullptr;
+	const FileFunction* functions = nullptr;
+	const FileValue* values = nullptr;
+	const FileObject* objects = nullptr;
+	const uint8_t* pointees = nullptr;
+	const char* strings = nullptr;
+	uint32_t numModules = 0, numFunctions = 0, numValues = 0, numObjects = 0;
+	uint64_t pointeeSize = 0;
+
+	// results to save, object and function numbers are the ones returned by
+	// addObject and addFunction until save renumbers them
+	std::vector<std::string> pendingModules;
+	std::vector<std::pair<uint32_t, std::string> > pendingFunctions;
+	std::vector<std::pair<ObjectInfo, uint32_t> > pendingObjects;
+	std::vector<std::pair<ValueKey, std::vector<uint32_t> > > pendingValues;
+
+	llvm::StringRef getString(uint32_t offset, uint32_t size) const {
+		return llvm::StringRef(strings + offset, size);
+	}
+	static ValueKey getKey(const FileKey& k) {
+		return ValueKey{k.module, k.function, k.index};
+	}
+	const FileValue* findValue(const ValueKey& key) const;
+	void decodePointees(const FileValue* val, llvm::SmallVectorImpl<uint32_t>& objs) const;
+
+public:
+	// Return false if the file does not exist or is not a valid database
+	bool load(llvm::StringRef path);
+
+	// Return None if the module or function is not in the database
+	uint32_t findModule(llvm::StringRef name) const;
+	uint32_t findFunction(uint32_t module, llvm::StringRef name) const;
+	llvm::StringRef getModuleName(uint32_t module) const;
+	llvm::StringRef getFunctionName(uint32_t function) const;
+
+	// Return false if key has no points-to set
+	bool getPointees(const ValueKey& key, llvm::SmallVectorImpl<uint32_t>& objs) const;
+	ObjectInfo getObject(uint32_t object) const;
+	// Values without a points-to set may alias anything
+	bool mayAlias(const ValueKey& a, const ValueKey& b) const;
+
+	size_t getNumModules() const { return numModules; }
+	size_t getNumFunctions() const { return numFunctions; }
+	size_t getNumValues() const { return numValues; }
+	size_t getNumObjects() const { return numObjects; }
+
+	// Builder, the loaded results are not kept
+	uint32_t addModule(llvm::StringRef name) {
+		pendingModules.push_back(name.str());
+		return pendingModules.size() - 1;
+	}
+	uint32_t addFunction(uint32_t module, llvm::StringRef name) {
+		pendingFunctions.emplace_back(module, name.str());
+		return pendingFunctions.size() - 1;
+	}
+	// tie breaks objects with the same site and offset, e.g., no site
+	uint32_t addObject(const ObjectInfo& obj, uint32_t tie) {
+		pendingObjects.emplace_back(obj, tie);
+		return pendingObjects.size() - 1;
+	}
+	void addValue(const ValueKey& key, std::vector<uint32_t>&& objs) {
+		pendingValues.emplace_back(key, std::move(objs));
+	}
+	bool save(llvm::StringRef path);
+};
+
+#endif
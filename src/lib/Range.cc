@@ -17,38 +17,72 @@
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/ScalarEvolution.h>
 #include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 #include "llvm/Support/CommandLine.h"
+#include <llvm/Support/Parallel.h>
 
 #include "Annotation.h"
 #include "Range.h"
+#include "RangeDB.h"
 
 using namespace llvm;
 
 static cl::opt<std::string> WatchID(
 	"w", cl::desc("Watch sID"), cl::value_desc("sID"));
 
-static void insertVRM(Value *V, CRange R, ValueRangeMap &VRM) {
-	auto v = std::make_pair(V, R);
-	auto r = VRM.insert(v);
-	if (!r.second)
-		r.first->second = R;
+static cl::opt<std::string> RangeDBPath(
+	"range-db", cl::desc("Write value ranges to file"), cl::value_desc("file"));
+
+#define RA_LOG(stmt) KA_LOG(2, "Range: " << stmt)
+
+// Push the bounds that grew to the extremes of the domain
+static CRange widenRange(const CRange &Old, CRange New)
+{
+	if (Old.isEmptySet())
+		return New;
+	New.match(Old);
+	if (Old.contains(New))
+		return Old;
+
+	unsigned W = Old.getBitWidth();
+	if (!Old.isWrappedSet() && !New.isWrappedSet()) {
+		APInt Lo = New.getUnsignedMin().ult(Old.getUnsignedMin()) ?
+			APInt::getMinValue(W) : Old.getUnsignedMin();
+		APInt Hi = New.getUnsignedMax().ugt(Old.getUnsignedMax()) ?
+			APInt::getMaxValue(W) : Old.getUnsignedMax();
+		return CRange(ConstantRange::getNonEmpty(Lo, Hi + 1));
+	}
+	if (!Old.isSignWrappedSet() && !New.isSignWrappedSet()) {
+		APInt Lo = New.getSignedMin().slt(Old.getSignedMin()) ?
+			APInt::getSignedMinValue(W) : Old.getSignedMin();
+		APInt Hi = New.getSignedMax().sgt(Old.getSignedMax()) ?
+			APInt::getSignedMaxValue(W) : Old.getSignedMax();
+		return CRange(ConstantRange::getNonEmpty(Lo, Hi + 1));
+	}
+	return CRange::makeFullSet(W);
+}
+
+// Old is a post-fixpoint, so the recomputed range is sound as well
+static CRange narrowRange(const CRange &Old, CRange New)
+{
+	New.match(Old);
+	return Old.intersectWith(New);
 }
 
-static void insertRM(std::string ID, CRange R, RangeMap &RM) {
-	auto v = std::make_pair(ID, R);
-	auto r = RM.insert(v);
-	if (!r.second)
-		r.first->second = R;
+static void insertVRM(Value *V, CRange R, ValueRangeMap &VRM,
+					  ValueRangeMap::Factory &Factory) {
+	VRM = Factory.add(VRM, V, R);
 }
 
-bool RangePass::unionRange(StringRef sID, const CRange &R,
+bool RangePass::unionRange(ValueId sID, const CRange &R,
 						   Value *V = NULL)
 {
-	if (R.isEmptySet())
+	if (R.isEmptySet() || sID == InvalidValueId)
 		return false;
 	
-	if (WatchID == sID && V) {
+	if (WatchedID == sID && V) {
 		if (Instruction *I = dyn_cast<Instruction>(V))
 			errs() << I->getParent()->getParent()->getName() << "(): ";
 		V->print(errs());
@@ -56,35 +90,90 @@ bool RangePass::unionRange(StringRef sID, const CRange &R,
 	}
 	
 	bool changed = true;
-	RangeMap::iterator it = IntRanges.find(sID);
-	if (it != IntRanges.end()) {
-		changed = it->second.safeUnion(R);
-		if (changed && sID == WatchID)
-			errs() << sID << " + " << R << " = " << it->second << "\n";
+	if (CRange *CR = IntRanges.find(sID)) {
+		CRange New = *CR;
+		changed = New.safeUnion(R);
+		if (changed) {
+			// ranges that keep growing, e.g., counters in memory
+			if (sID >= UpdateCount.size())
+				UpdateCount.resize(sID + 1);
+			if (++UpdateCount[sID] > MaxIterations)
+				New = widenRange(*CR, New);
+			*CR = New;
+		}
+		if (changed && sID == WatchedID)
+			errs() << WatchID << " + " << R << " = " << *CR << "\n";
 	} else {
-		IntRanges.insert(std::make_pair(sID, R));
-		if (sID == WatchID)
-			errs() << sID << " = " << R << "\n";
+		IntRanges.insert(sID, R);
+		if (sID == WatchedID)
+			errs() << WatchID << " = " << R << "\n";
+	}
+	if (changed) {
+		if (sID >= Changes.size())
+			Changes.resize(sID + 1);
+		Changes.set(sID);
 	}
-	if (changed)
-		Changes.insert(sID);
 	return changed;
 }
 
-bool RangePass::unionRange(BasicBlock *BB, Value *V,
-						   const CRange &R)
+//
+// Global ranges produced while analyzing an SCC go to its summary first,
+// so tasks of different SCCs never write IntRanges concurrently
+//
+bool RangePass::addToSummary(Instruction *I, ValueId sID, const CRange &R)
 {
-	if (R.isEmptySet())
+	if (R.isEmptySet() || sID == InvalidValueId)
+		return false;
+
+	RangeSummary &Sum = *getState(I->getFunction()).Summary;
+	auto it = Sum.Ranges.find(sID);
+	if (it == Sum.Ranges.end()) {
+		Sum.Ranges.insert(std::make_pair(sID, RangeSummary::Entry{R, I, 0}));
+		++Sum.Version;
+		return true;
+	}
+
+	CRange New = it->second.Range;
+	if (!New.safeUnion(R))
 		return false;
+	// recursion may keep growing the range
+	if (++it->second.Updates > MaxIterations)
+		New = widenRange(it->second.Range, New);
+	it->second.Range = New;
+	++Sum.Version;
+	return true;
+}
+
+// Union of the global range and the pending one in the summary of the SCC
+bool RangePass::lookupRange(FuncState &S, ValueId sID, CRange &CR)
+{
+	bool found = false;
+	auto merge = [&](const CRange &R) {
+		if (found)
+			CR.safeUnion(R);
+		else
+			CR = R;
+		found = true;
+	};
+
+	S.Reads.insert(sID);
+	if (const CRange *R = IntRanges.find(sID))
+		merge(*R);
+	if (S.Summary) {
+		auto it = S.Summary->Ranges.find(sID);
+		if (it != S.Summary->Ranges.end())
+			merge(it->second.Range);
+	}
+	return found;
+}
+
+void RangePass::setRange(BasicBlock *BB, Value *V, const CRange &R)
+{
+	if (R.isEmptySet())
+		return;
 	
-	bool changed = true;
-	ValueRangeMap &VRM = FuncVRMs[BB];
-	ValueRangeMap::iterator it = VRM.find(V);
-	if (it != VRM.end())
-		changed = it->second.safeUnion(R);
-	else
-		VRM.insert(std::make_pair(V, R));
-	return changed;
+	BlockValueRangeMaps &VRMs = *getState(BB->getParent()).VRMs;
+	VRMs.set(BB, VRMs.Factory.add(VRMs.get(BB), V, R));
 }
 
 CRange RangePass::getRange(BasicBlock *BB, Value *V)
@@ -93,54 +182,52 @@ CRange RangePass::getRange(BasicBlock *BB, Value *V)
 	if (ConstantInt *C = dyn_cast<ConstantInt>(V))
 		return CRange(C->getValue());
 	
-	ValueRangeMap &VRM = FuncVRMs[BB];
-	ValueRangeMap::iterator invrm = VRM.find(V);
-	
-	if (invrm != VRM.end()) {
-		//errs() << "Find V = " << *V << ", CR = " << invrm->second << "\n";
-		return invrm->second;
-	}
-	
 	// V must be integer or pointer to integer
 	IntegerType *Ty = dyn_cast<IntegerType>(V->getType());
-	if (PointerType *PTy = dyn_cast<PointerType>(V->getType()))
-		Ty = dyn_cast<IntegerType>(PTy->getElementType());
+	if (V->getType()->isPointerTy())
+		Ty = dyn_cast<IntegerType>(V->getType()->getPointerElementType());
 	assert(Ty != NULL);
+	CRange Fullset(Ty->getBitWidth(), true);
+
+	FuncState &S = getState(BB->getParent());
+	if (S.Diverged)
+		return Fullset;
+
+	ValueRangeMap VRM = S.VRMs->get(BB);
+	if (const CRange *invrm = VRM.lookup(V)) {
+		//errs() << "Find V = " << *V << ", CR = " << *invrm << "\n";
+		return *invrm;
+	}
 	
 	// not found in VRM, lookup global range, return empty set by default
 	CRange CR(Ty->getBitWidth(), false);
-	CRange Fullset(Ty->getBitWidth(), true);
 	
-	RangeMap &IRM = IntRanges;
-	std::string sID;
+	ValueId sID = InvalidValueId;
 	if (CallInst *CI = dyn_cast<CallInst>(V)) {
 		// calculate union of values ranges returned by all possible callees
-		if (!CI->isInlineAsm() && Ctx->Callees.count(CI)) {
-			FuncSet &CEEs = Ctx->Callees[CI];
-			for (Function *F : CEEs) {
-				sID = getRetId(F);
-				RangeMap::iterator it;
-				if ((it = IRM.find(sID)) != IRM.end())
-					CR.safeUnion(it->second);
+		auto Callees = Ctx->Callees.find(CI);
+		if (!CI->isInlineAsm() && Callees != Ctx->Callees.end()) {
+			for (const Function *F : Callees->second) {
+				sID = Ctx->ValueIds.lookupRetId(F);
+				CRange R(Ty->getBitWidth(), false);
+				if (lookupRange(S, sID, R))
+					CR.safeUnion(R);
 			}
 		}
 	} else {
 		// arguments & loads
 		if (isa<Argument>(V)) 
-			sID = getArgId(cast<Argument>(V));
+			sID = Ctx->ValueIds.lookupArgId(cast<Argument>(V));
 		else if (isa<LoadInst>(V))
-			sID = getLoadId(cast<LoadInst>(V));
+			sID = Ctx->ValueIds.lookupValueId(V);
 
-		if (!sID.empty()) {
-			RangeMap::iterator it;
-			if ((it = IRM.find(sID)) != IRM.end())
-				CR = it->second;
-		}
+		if (sID != InvalidValueId)
+			lookupRange(S, sID, CR);
 		// might load part of a struct field
 		CR = CR.zextOrTrunc(Ty->getBitWidth());
 	}
 	if (!CR.isEmptySet())
-		VRM.insert(std::make_pair(V, CR));
+		S.VRMs->set(BB, S.VRMs->Factory.add(VRM, V, CR));
 	return CR;
 }
 
@@ -148,7 +235,7 @@ void RangePass::collectInitializers(GlobalVariable *GV, Constant *I)
 {	
 	// global var
 	if (ConstantInt *CI = dyn_cast<ConstantInt>(I)) {
-		unionRange(getVarId(GV), CI->getValue(), GV);
+		unionRange(Ctx->ValueIds.getVarId(GV), CI->getValue(), GV);
 	}
 	
 	// structs
@@ -169,8 +256,8 @@ void RangePass::collectInitializers(GlobalVariable *GV, Constant *I)
 			} else if (Ty->isIntegerTy()) {
 				ConstantInt *CI = 
 					dyn_cast<ConstantInt>(I->getOperand(i));
-				StringRef sID = getStructId(ST, GV->getParent(), i);
-				if (!sID.empty() && CI)
+				ValueId sID = Ctx->ValueIds.getStructId(ST, GV->getParent(), i);
+				if (CI)
 					unionRange(sID, CI->getValue(), GV);
 			}
 		}
@@ -191,6 +278,9 @@ void RangePass::collectInitializers(GlobalVariable *GV, Constant *I)
 //
 bool RangePass::doInitialization(Module *M)
 {	
+	if (!WatchID.empty())
+		WatchedID = Ctx->ValueIds.intern(WatchID);
+
 	// Looking for global variables
 	for (Module::global_iterator i = M->global_begin(), 
 		 e = M->global_end(); i != e; ++i) {
@@ -256,53 +346,68 @@ CRange RangePass::visitPHINode(PHINode *PHI)
 	IntegerType *Ty = cast<IntegerType>(PHI->getType());
 	CRange CR(Ty->getBitWidth(), false);
 	
+	bool isLoopHeader = false;
 	for (unsigned i = 0, n = PHI->getNumIncomingValues(); i < n; ++i) {
 		BasicBlock *Pred = PHI->getIncomingBlock(i);
-		// skip back edges
 		if (isBackEdge(Edge(Pred, PHI->getParent())))
-			continue;
+			isLoopHeader = true;
 		CR.safeUnion(getRange(Pred, PHI->getIncomingValue(i)));
 	}
-	return CR;
+	if (!isLoopHeader)
+		return CR;
+
+	// loop-carried values are widened while ascending, narrowed while descending
+	FuncState &S = getState(PHI->getFunction());
+	auto it = S.LoopPHIs.find(PHI);
+	if (it == S.LoopPHIs.end()) {
+		S.LoopPHIs.insert(std::make_pair(PHI, CR));
+		return CR;
+	}
+	it->second = S.Narrowing ? narrowRange(it->second, CR) : widenRange(it->second, CR);
+	return it->second;
 }
 
 bool RangePass::visitCallInst(CallInst *CI)
 {
 	bool changed = false;
-	if (CI->isInlineAsm() || Ctx->Callees.count(CI) == 0)
+	auto Callees = Ctx->Callees.find(CI);
+	if (CI->isInlineAsm() || Callees == Ctx->Callees.end())
 		return false;
 
 	// update arguments of all possible callees
-	FuncSet &CEEs = Ctx->Callees[CI];
+	const FuncSet &CEEs = Callees->second;
 	for (FuncSet::iterator i = CEEs.begin(), e = CEEs.end(); i != e; ++i) {
 		// skip vaarg and builtin functions
 		if ((*i)->isVarArg() 
 			|| (*i)->getName().find('.') != StringRef::npos)
 			continue;
 		
-		for (unsigned j = 0; j < CI->getNumArgOperands(); ++j) {
+		// callees may take fewer arguments than passed (see isSafeCall of
+		// SafeStackPass), only their parameters have IDs
+		unsigned NumArgs = std::min<unsigned>(CI->arg_size(), (*i)->arg_size());
+		for (unsigned j = 0; j < NumArgs; ++j) {
 			Value *V = CI->getArgOperand(j);
 			// skip non-integer arguments
 			if (!V->getType()->isIntegerTy())
 				continue;
-			std::string sID = getArgId(*i, j);
-			changed |= unionRange(sID, getRange(CI->getParent(), V), CI);
+			ValueId sID = Ctx->ValueIds.lookupArgId(*i, j);
+			changed |= addToSummary(CI, sID, getRange(CI->getParent(), V));
 		}
 	}
 	// range for the return value of this call site
 	if (CI->getType()->isIntegerTy())
-		changed |= unionRange(getRetId(CI), getRange(CI->getParent(), CI), CI);
+		changed |= addToSummary(CI, Ctx->ValueIds.lookupValueId(CI), getRange(CI->getParent(), CI));
 	return changed;
 }
 
 bool RangePass::visitStoreInst(StoreInst *SI)
 {
-	std::string sID = getStoreId(SI);
+	ValueId sID = Ctx->ValueIds.lookupValueId(SI);
 	Value *V = SI->getValueOperand();
-	if (V->getType()->isIntegerTy() && !sID.empty()) {
+	if (V->getType()->isIntegerTy() && sID != InvalidValueId) {
 		CRange CR = getRange(SI->getParent(), V);
-		unionRange(SI->getParent(), SI->getPointerOperand(), CR);
-		return unionRange(sID, CR, SI);
+		setRange(SI->getParent(), SI->getPointerOperand(), CR);
+		return addToSummary(SI, sID, CR);
 	}
 	return false;
 }
@@ -313,8 +418,8 @@ bool RangePass::visitReturnInst(ReturnInst *RI)
 	if (!V || !V->getType()->isIntegerTy())
 		return false;
 	
-	std::string sID = getRetId(RI->getParent()->getParent());
-	return unionRange(sID, getRange(RI->getParent(), V), RI);
+	ValueId sID = Ctx->ValueIds.lookupRetId(RI->getParent()->getParent());
+	return addToSummary(RI, sID, getRange(RI->getParent(), V));
 }
 
 bool RangePass::updateRangeFor(Instruction *I)
@@ -348,13 +453,14 @@ bool RangePass::updateRangeFor(Instruction *I)
 	} else if (CallInst *CI = dyn_cast<CallInst>(I)) {
 		CR = getRange(CI->getParent(), CI);
 	}
-	changed |= unionRange(I->getParent(), I, CR);
+	setRange(I->getParent(), I, CR);
 	
 	return changed;
 }
 
 bool RangePass::isBackEdge(const Edge &E)
 {
+	const EdgeList &BackEdges = getState(E.second->getParent()).BackEdges;
 	return std::find(BackEdges.begin(), BackEdges.end(), E)	!= BackEdges.end();
 }
 
@@ -392,21 +498,19 @@ void RangePass::visitBranchInst(BranchInst *BI, BasicBlock *BB,
 									ICI->getPredicate(), RCR);
 		//errs() << "NV = " << *LHS << ", CR = " << LCR.intersectWith(PRCR) << "\n";
 		//errs() << "NV = " << *RHS << ", CR = " << RCR.intersectWith(PLCR) << "\n";
-		insertVRM(LHS, LCR.intersectWith(PRCR), VRM);
-		insertVRM(RHS, RCR.intersectWith(PLCR), VRM);
+		insertVRM(LHS, LCR.intersectWith(PRCR), VRM, getState(BB->getParent()).VRMs->Factory);
+		insertVRM(RHS, RCR.intersectWith(PLCR), VRM, getState(BB->getParent()).VRMs->Factory);
 	} else {
-		// false target, use inverse predicate
-		// N.B. why there's no getSwappedInversePredicate()...
-		ICI->swapOperands();
+		// false target, use inverse predicate; functions are analyzed in
+		// parallel, so do not swap the operands to get the swapped inverse
 		CRange PLCR = CRange::makeICmpRegion(
-									ICI->getInversePredicate(), RCR);
-		ICI->swapOperands();
+									CmpInst::getSwappedPredicate(ICI->getInversePredicate()), RCR);
 		CRange PRCR = CRange::makeICmpRegion(
 									ICI->getInversePredicate(), RCR);
 		//errs() << "NV = " << *LHS << ", CR = " << LCR.intersectWith(PRCR) << "\n";
 		//errs() << "NV = " << *RHS << ", CR = " << RCR.intersectWith(PLCR) << "\n";
-		insertVRM(LHS, LCR.intersectWith(PRCR), VRM);
-		insertVRM(RHS, RCR.intersectWith(PLCR), VRM);
+		insertVRM(LHS, LCR.intersectWith(PRCR), VRM, getState(BB->getParent()).VRMs->Factory);
+		insertVRM(RHS, RCR.intersectWith(PLCR), VRM, getState(BB->getParent()).VRMs->Factory);
 	}
 }
 
@@ -433,7 +537,7 @@ void RangePass::visitSwitchInst(SwitchInst *SI, BasicBlock *BB,
 			CR.safeUnion(i.getCaseValue()->getValue());
 		CR = CR.inverse();
 	}
-	insertVRM(V, VCR.intersectWith(CR), VRM);
+	insertVRM(V, VCR.intersectWith(CR), VRM, getState(BB->getParent()).VRMs->Factory);
 }
 
 void RangePass::visitTerminator(Instruction *I, BasicBlock *BB,
@@ -449,122 +553,288 @@ void RangePass::visitTerminator(Instruction *I, BasicBlock *BB,
 
 bool RangePass::updateRangeFor(BasicBlock *BB)
 {
-	bool changed = false;
+	BlockValueRangeMaps &VRMs = *getState(BB->getParent()).VRMs;
+	ValueRangeMap OldVRM = VRMs.get(BB);
 
 	// propagate value ranges from pred BBs, ranges in BB are union of ranges
-	// in pred BBs, constrained by each terminator.
+	// in pred BBs, constrained by each terminator. Recomputed on every visit,
+	// so ranges can also shrink while narrowing.
+	ValueRangeMap BBVRM = VRMs.Factory.getEmptyMap();
 	for (pred_iterator i = pred_begin(BB), e = pred_end(BB);
 			i != e; ++i) {
 		BasicBlock *Pred = *i;
 		if (isBackEdge(Edge(Pred, BB)))
 			continue;
 		
-		ValueRangeMap &PredVRM = FuncVRMs[Pred];
-		ValueRangeMap &BBVRM = FuncVRMs[BB];
-		
-		// Copy from its predecessor
-		ValueRangeMap VRM(PredVRM.begin(), PredVRM.end());
+		// Share the predecessor's map, refining only creates new paths
+		ValueRangeMap VRM = VRMs.get(Pred);
 		// Refine according to the terminator
 		visitTerminator(Pred->getTerminator(), BB, VRM);
 		
 		// union with other predecessors
+		if (BBVRM.isEmpty() || BBVRM == VRM) {
+			BBVRM = VRM;
+			continue;
+		}
 		for (ValueRangeMap::iterator j = VRM.begin(), je = VRM.end();
 			 j != je; ++j) {
-			ValueRangeMap::iterator it = BBVRM.find(j->first);
-			if (it != BBVRM.end())
-				it->second.safeUnion(j->second);
-			else
-				BBVRM.insert(*j);
+			const CRange *Old = BBVRM.lookup(j->first);
+			if (Old == NULL) {
+				BBVRM = VRMs.Factory.add(BBVRM, j->first, j->second);
+			} else {
+				CRange CR = *Old;
+				if (CR.safeUnion(j->second))
+					BBVRM = VRMs.Factory.add(BBVRM, j->first, CR);
+			}
 		}
 	}
+	VRMs.set(BB, BBVRM);
 	
 	// Now run through instructions
 	for (BasicBlock::iterator i = BB->begin(), e = BB->end(); 
 		 i != e; ++i) {
-		changed |= updateRangeFor(&*i);
+		updateRangeFor(&*i);
 	}
 	
-	return changed;
+	// maps are canonicalized, same content means same tree
+	return !(VRMs.get(BB) == OldVRM);
 }
 
-bool RangePass::updateRangeFor(Function *F)
+void RangePass::updateRangeFor(Function *F)
 {
-	bool changed = false;
+	auto Start = std::chrono::steady_clock::now();
+	FuncState &S = getState(F);
+	++S.Rounds;
 
 	//errs() << "Processing " << F->getName() << "\n";
-	BackEdges.clear();
-	FindFunctionBackedges(*F, BackEdges);
-	
-	for (BasicBlock &BB : *F)
-		changed |= updateRangeFor(&BB);
-	
-	return changed;
+
+	// the worklist always takes the earliest pending block in RPO
+	ReversePostOrderTraversal<Function *> RPOT(F);
+	std::vector<BasicBlock *> Order(RPOT.begin(), RPOT.end());
+	DenseMap<BasicBlock *, unsigned> Index;
+	for (unsigned i = 0; i < Order.size(); ++i)
+		Index[Order[i]] = i;
+
+	BitVector Pending(Order.size(), true);
+	unsigned Visits = 0, MaxVisits = MaxIterations * Order.size();
+	for (int i = Pending.find_first(); i >= 0; i = Pending.find_first()) {
+		if (++Visits > MaxVisits) {
+			// the block maps are not a fixpoint, so their ranges may be too
+			// small; fall back to full ranges, one sweep propagates them
+			WARNING("Range of " << F->getName() << " does not converge\n");
+			S.Diverged = true;
+			for (BasicBlock *BB : Order)
+				updateRangeFor(BB);
+			Visits += Order.size();
+			break;
+		}
+		Pending.reset(i);
+		if (!updateRangeFor(Order[i]))
+			continue;
+		for (BasicBlock *Succ : successors(Order[i])) {
+			auto it = Index.find(Succ);
+			if (it != Index.end())
+				Pending.set(it->second);
+		}
+	}
+
+	// recover the precision lost by widening
+	if (!S.BackEdges.empty() && !S.Diverged) {
+		S.Narrowing = true;
+		for (unsigned n = 0; n < NarrowingPasses; ++n) {
+			for (BasicBlock *BB : Order)
+				updateRangeFor(BB);
+			Visits += Order.size();
+		}
+		S.Narrowing = false;
+	}
+
+	S.Visits += Visits;
+	S.Micros += std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - Start).count();
 }
 
-bool RangePass::doModulePass(Module *M)
+//
+// Everything shared by the SCC tasks is created up front, so the tasks
+// only read the ID pool (through its lookup* functions) and the call graph
+//
+void RangePass::prepare(ModuleList &modules)
 {
-	unsigned itr = 0;
-	bool changed = true, ret = false;
-
-	while (changed) {
-		// if some values converge too slowly, expand them to full-set
-		if (++itr > MaxIterations) {
-			for (ChangeSet::iterator it = Changes.begin(), ie = Changes.end();
-				 it != ie; ++it) {
-				RangeMap::iterator i = IntRanges.find(*it);
-				i->second = CRange(i->second.getBitWidth(), true);
+	ValueIdPool &IDs = Ctx->ValueIds;
+	for (auto &M : modules) {
+		for (Function &F : *M.first) {
+			// callees may be declarations in this module
+			IDs.getRetId(&F);
+			for (unsigned i = 0; i < F.arg_size(); ++i)
+				IDs.getArgId(&F, i);
+			if (F.empty())
+				continue;
+
+			for (inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i) {
+				if (LoadInst *LI = dyn_cast<LoadInst>(&*i))
+					IDs.getLoadId(LI);
+				else if (StoreInst *SI = dyn_cast<StoreInst>(&*i))
+					IDs.getStoreId(SI);
+				else if (CallInst *CI = dyn_cast<CallInst>(&*i))
+					IDs.getRetId(CI);
 			}
+
+			std::unique_ptr<BlockValueRangeMaps> &VRMs = FuncVRMs[&F];
+			if (!VRMs)
+				VRMs.reset(new BlockValueRangeMaps());
+			std::unique_ptr<FuncState> &S = States[&F];
+			S.reset(new FuncState());
+			S->VRMs = VRMs.get();
+			FindFunctionBackedges(F, S->BackEdges);
 		}
-		changed = false;
-		Changes.clear();
-		for (Module::iterator i = M->begin(), e = M->end(); i != e; ++i)
-			if (!i->empty())
-				changed |= updateRangeFor(&*i);
-		ret |= changed;
-	}
-	return ret;
+	}
+
+	getCallGraphSCCs(Ctx, SCCs, SCCLevels);
+	for (unsigned i = 0; i < SCCs.size(); ++i)
+		for (Function *F : SCCs[i])
+			SCCOf[F] = i;
 }
 
-// write back
-bool RangePass::doFinalization(Module *M) {
-#if 0
-	LLVMContext &VMCtx = M->getContext();
-	for (Module::iterator f = M->begin(), fe = M->end(); f != fe; ++f) {
-		Function *F = &*f;
-		for (inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i) {
-			Instruction *I = &*i;
-			if (!isa<LoadInst>(I) && !isa<CallInst>(I))
-				continue;
-			I->setMetadata("intrange", NULL);
-			std::string id = getValueId(I);
-			if (id == "")
-				continue;
-			RangeMap &IRM = IntRanges;
-			RangeMap::iterator it = IRM.find(id);
-			if (it == IRM.end())
-				continue;
-			CRange &R = it->second;
-			if (R.isEmptySet() || R.isFullSet())
+// Iterate the functions of a (recursive) SCC until its summary is stable
+void RangePass::analyzeSCC(const FuncSCC &SCC, RangeSummary &Sum)
+{
+	for (Function *F : SCC)
+		getState(F).Summary = &Sum;
+
+	unsigned Version;
+	do {
+		Version = Sum.Version;
+		for (Function *F : SCC)
+			updateRangeFor(F);
+	} while (SCC.size() > 1 && Sum.Version != Version);
+
+	for (Function *F : SCC)
+		getState(F).Summary = NULL;
+}
+
+//
+// SCCs of the same level do not call each other, so they are analyzed in
+// parallel; their summaries are merged into IntRanges between levels,
+// in SCC order to keep the result deterministic.
+// SCCs reading a global range that changed are analyzed again.
+//
+void RangePass::run(ModuleList &modules)
+{
+	errs() << "[" << ID << "] Initializing " << modules.size() << " modules ";
+	for (auto &M : modules) {
+		doInitialization(M.first);
+		errs() << ".";
+	}
+	errs() << "\n";
+
+	prepare(modules);
+	unsigned MaxLevel = 0;
+	for (unsigned L : SCCLevels)
+		MaxLevel = std::max(MaxLevel, L);
+
+	BitVector Dirty(SCCs.size(), true);
+	for (Iteration = 0; Dirty.any(); ++Iteration) {
+		unsigned Analyzed = 0;
+		for (unsigned L = 0; L <= MaxLevel; ++L) {
+			std::vector<unsigned> Work;
+			for (unsigned i : Dirty.set_bits())
+				if (SCCLevels[i] == L)
+					Work.push_back(i);
+			if (Work.empty())
 				continue;
+			for (unsigned i : Work)
+				Dirty.reset(i);
+
+			std::vector<RangeSummary> Sums(Work.size());
+			parallelForEachN(0, Work.size(), [&](size_t i) {
+				analyzeSCC(SCCs[Work[i]], Sums[i]);
+			});
+			Analyzed += Work.size();
+
+			for (unsigned i = 0; i < Work.size(); ++i) {
+				// sort by ID, DenseMap order is not stable
+				std::vector<std::pair<ValueId, RangeSummary::Entry *> > Entries;
+				for (auto &E : Sums[i].Ranges)
+					Entries.push_back(std::make_pair(E.first, &E.second));
+				llvm::sort(Entries, [](const std::pair<ValueId, RangeSummary::Entry *> &A,
+									   const std::pair<ValueId, RangeSummary::Entry *> &B) {
+					return A.first < B.first;
+				});
+				for (auto &E : Entries)
+					unionRange(E.first, E.second->Range, E.second->Source);
+
+				for (Function *F : SCCs[Work[i]]) {
+					FuncState &S = getState(F);
+					for (ValueId sID : S.Reads) {
+						if (sID >= Readers.size())
+							Readers.resize(sID + 1);
+						auto &R = Readers[sID];
+						if (std::find(R.begin(), R.end(), Work[i]) == R.end())
+							R.push_back(Work[i]);
+					}
+					S.Reads.clear();
+				}
+			}
 
-			ConstantInt *Lo = ConstantInt::get(VMCtx, R.getLower());
-			ConstantInt *Hi = ConstantInt::get(VMCtx, R.getUpper());
-			Value *RL[] = { Lo, Hi };
-			MDNode *MD = MDNode::get(VMCtx, RL);
-			I->setMetadata("intrange", MD);
+			for (unsigned sID : Changes.set_bits())
+				if (sID < Readers.size())
+					for (unsigned i : Readers[sID])
+						Dirty.set(i);
+			Changes.reset();
 		}
+		errs() << "[" << ID << " / " << Iteration << "] Analyzed "
+			   << Analyzed << " SCCs\n";
+	}
+
+	errs() << "[" << ID << "] Postprocessing ...\n";
+	for (auto &M : modules)
+		doFinalization(M.first);
+	if (!RangeDBPath.empty())
+		exportRanges(RangeDBPath);
+	errs() << "[" << ID << "] Done!\n\n";
+}
+
+bool RangePass::doFinalization(Module *M) {
+	for (Function &F : *M) {
+		auto it = States.find(&F);
+		if (it == States.end())
+			continue;
+		RA_LOG(F.getName() << ": " << it->second->Rounds << " rounds, "
+			   << it->second->Visits << " block visits, "
+			   << it->second->Micros << " us\n");
 	}
-#endif
 	return false;
 }
 
 
+// Empty and full sets carry no information and are left out
+void RangePass::exportRanges(StringRef Path)
+{
+	RangeDB DB;
+	unsigned Count = 0;
+	for (unsigned ID : IntRanges.ids().set_bits()) {
+		const SmallRange *R = IntRanges.find(ID)->getSmall();
+		if (R && !R->isEmptySet() && !R->isFullSet()) {
+			DB.add(Ctx->ValueIds.getName(ID), *R);
+			++Count;
+		}
+	}
+	if (!DB.save(Path)) {
+		WARNING("Failed to write ranges to " << Path << "\n");
+		return;
+	}
+	RA_LOG("Wrote " << Count << " ranges to " << Path << "\n");
+}
+
 void RangePass::dumpRange()
 {
 	raw_ostream &OS = outs();
-	for (RangeMap::iterator i = IntRanges.begin(), 
-		e = IntRanges.end(); i != e; ++i) {
-		OS << i->first << " " << i->second << "\n";
-	}
+	// sort by name for stable output
+	std::vector<std::pair<StringRef, const CRange *> > Ranges;
+	for (unsigned ID : IntRanges.ids().set_bits())
+		Ranges.push_back(std::make_pair(Ctx->ValueIds.getName(ID), IntRanges.find(ID)));
+	std::sort(Ranges.begin(), Ranges.end());
+	for (auto &R : Ranges)
+		OS << R.first << " " << *R.second << "\n";
 }
 
@@ -2,37 +2,157 @@
 #define _RANGE_H
 
 #include <map>
+#include <memory>
+
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/ImmutableMap.h>
 
 #include "Global.h"
+#include "CallGraph.h"
 #include "CRange.h"
 
-typedef std::map<std::string, CRange> RangeMap;
-typedef std::map<llvm::Value*, CRange> ValueRangeMap;
-typedef std::map<llvm::BasicBlock*, ValueRangeMap> FuncValueRangeMaps;
+// Global ranges indexed by ValueId, IDs are dense so a vector suffices
+class RangeMap {
+private:
+	std::vector<CRange> Ranges;
+	llvm::BitVector Known;
 
-#define IntRanges (*(RangeMap *)(Ctx->get("IntRanges")))
-#define FuncVRMs (*(FuncValueRangeMaps *)(Ctx->get("FuncVRMs")))
+public:
+	// Return NULL if ID has no range yet
+	CRange *find(ValueId ID) {
+		return ID < Known.size() && Known[ID] ? &Ranges[ID] : nullptr;
+	}
+	const CRange *find(ValueId ID) const {
+		return ID < Known.size() && Known[ID] ? &Ranges[ID] : nullptr;
+	}
+
+	void insert(ValueId ID, const CRange &R) {
+		if (ID >= Ranges.size()) {
+			Ranges.resize(ID + 1, CRange(1, false));
+			Known.resize(ID + 1);
+		}
+		Ranges[ID] = R;
+		Known.set(ID);
+	}
+
+	// IDs with a range
+	const llvm::BitVector &ids() const { return Known; }
+	size_t size() const { return Known.count(); }
+};
+
+namespace llvm {
+template <> struct ImutProfileInfo<CRange> {
+	typedef const CRange value_type;
+	typedef const CRange &value_type_ref;
+
+	static void Profile(FoldingSetNodeID &ID, value_type_ref X) {
+		X.Profile(ID);
+	}
+};
+}
+
+// Per-block value ranges are persistent maps, so a block that does not
+// refine the ranges of its predecessor shares the same tree.
+// Each function has its own factory, functions are analyzed in parallel.
+typedef llvm::ImmutableMap<llvm::Value*, CRange> ValueRangeMap;
+
+struct BlockValueRangeMaps {
+	ValueRangeMap::Factory Factory;
+	llvm::DenseMap<llvm::BasicBlock*, ValueRangeMap> Maps;
+
+	ValueRangeMap get(llvm::BasicBlock *BB) {
+		auto it = Maps.find(BB);
+		return it == Maps.end() ? Factory.getEmptyMap() : it->second;
+	}
+
+	void set(llvm::BasicBlock *BB, const ValueRangeMap &VRM) {
+		auto r = Maps.insert(std::make_pair(BB, VRM));
+		if (!r.second)
+			r.first->second = VRM;
+	}
+};
+
+typedef llvm::DenseMap<const llvm::Function*,
+		std::unique_ptr<BlockValueRangeMaps> > FuncValueRangeMaps;
+
+// Results of RangePass, they outlive the pass for SafeStackPass, the last
+// consumer; its caller releases them once the safe stack analysis is done
+struct IntRangesData { typedef RangeMap Type; };
+struct FuncVRMsData { typedef FuncValueRangeMaps Type; };
 
 class RangePass : public IterativeModulePass {
 private:
 	const unsigned MaxIterations;	
+	// descending sweeps after a function converges with widening
+	const unsigned NarrowingPasses;
+	ValueId WatchedID;
+	RangeMap &IntRanges;
+	FuncValueRangeMaps &FuncVRMs;
+
+	// Global ranges (args of callees, returns, stores) contributed by an SCC,
+	// merged into IntRanges once the SCC converges
+	struct RangeSummary {
+		struct Entry {
+			CRange Range;
+			llvm::Value *Source;
+			unsigned Updates;
+		};
+		llvm::DenseMap<ValueId, Entry> Ranges;
+		// bumped whenever a range grows
+		unsigned Version = 0;
+	};
+
+	typedef std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *> Edge;
+	typedef llvm::SmallVector<Edge, 16> EdgeList;
+
+	// Per function state, only touched by the task analyzing its SCC
+	struct FuncState {
+		BlockValueRangeMaps *VRMs;
+		EdgeList BackEdges;
+		// ranges of PHIs joining back edges, widened or narrowed on each visit
+		llvm::DenseMap<llvm::PHINode *, CRange> LoopPHIs;
+		bool Narrowing = false;
+		// gave up on a fixpoint, all non-constant values have full ranges
+		bool Diverged = false;
+		RangeSummary *Summary = NULL;
+		// global ranges read since the last merge
+		llvm::DenseSet<ValueId> Reads;
+
+		unsigned Rounds = 0;
+		unsigned Visits = 0;
+		uint64_t Micros = 0;
+	};
+	llvm::DenseMap<const llvm::Function *, std::unique_ptr<FuncState> > States;
+	FuncState &getState(const llvm::Function *F) { return *States.find(F)->second; }
+
+	// call graph SCCs, bottom-up
+	std::vector<FuncSCC> SCCs;
+	std::vector<unsigned> SCCLevels;
+	llvm::DenseMap<const llvm::Function *, unsigned> SCCOf;
 	
 	bool safeUnion(CRange &CR, const CRange &R);
-	bool unionRange(llvm::StringRef, const CRange &, llvm::Value *);
-	bool unionRange(llvm::BasicBlock *, llvm::Value *, const CRange &);
+	bool unionRange(ValueId, const CRange &, llvm::Value *);
+	bool addToSummary(llvm::Instruction *, ValueId, const CRange &);
+	bool lookupRange(FuncState &, ValueId, CRange &);
+	void setRange(llvm::BasicBlock *, llvm::Value *, const CRange &);
 	CRange getRange(llvm::BasicBlock *, llvm::Value *);
 
 	void collectInitializers(llvm::GlobalVariable *, llvm::Constant *);
-	bool updateRangeFor(llvm::Function *);
+	void prepare(ModuleList &);
+	void analyzeSCC(const FuncSCC &, RangeSummary &);
+	void updateRangeFor(llvm::Function *);
 	bool updateRangeFor(llvm::BasicBlock *);
 	bool updateRangeFor(llvm::Instruction *);
 
-	typedef std::set<std::string> ChangeSet;
+	// IDs whose global range changed since the last check
+	typedef llvm::BitVector ChangeSet;
 	ChangeSet Changes;
-	
-	typedef std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *> Edge;
-	typedef llvm::SmallVector<Edge, 16> EdgeList;
-	EdgeList BackEdges;
+	// number of times each global range grew, widened after MaxIterations
+	std::vector<unsigned> UpdateCount;
+	// SCCs that read each global range, revisited when it changes
+	std::vector<llvm::SmallVector<unsigned, 2> > Readers;
 	
 	bool isBackEdge(const Edge &);
 	
@@ -54,14 +174,19 @@ private:
 
 public:
 	RangePass(GlobalContext *Ctx_)
-		: IterativeModulePass(Ctx_, "Range"), MaxIterations(10) {
-		Ctx->add("IntRanges", new RangeMap());
-		Ctx->add("FuncVRMs", new FuncValueRangeMaps());
+		: IterativeModulePass(Ctx_, "Range"), MaxIterations(10),
+		  NarrowingPasses(2), WatchedID(InvalidValueId),
+		  IntRanges(Ctx_->PassData.add<IntRangesData>()),
+		  FuncVRMs(Ctx_->PassData.add<FuncVRMsData>()) {
 	}
 	
 	virtual bool doInitialization(llvm::Module *);
-	virtual bool doModulePass(llvm::Module *M);
 	virtual bool doFinalization(llvm::Module *);
+	// functions are analyzed per call graph SCC instead of per module
+	virtual void run(ModuleList &modules);
+
+	// binary sidecar, see RangeDB
+	void exportRanges(llvm::StringRef Path);
 
 	// debug
 	void dumpRange();
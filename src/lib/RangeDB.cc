@@ -0,0 +1,95 @@
+/*
+ * Persisted value ranges
+ *
+ * Copyright (C) 2024 Chengyu Song
+ *
+ * For licensing details see LICENSE
+ */
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "DBFile.h"
+#include "RangeDB.h"
+
+using namespace llvm;
+
+const char RangeDB::Magic[8] = {'K', 'A', 'R', 'N', 'G', 'D', 'B', '1'};
+
+bool RangeDB::load(StringRef path)
+{
+  std::unique_ptr<MemoryBuffer> buf = loadWithMagic(path, Magic, sizeof(FileHeader));
+  if (!buf)
+    return false;
+
+  const char* start = buf->getBufferStart();
+  uint64_t size = buf->getBufferSize();
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(start);
+
+  uint64_t recordEnd = sizeof(FileHeader) + (uint64_t)header->numRecords * sizeof(FileRecord);
+  uint64_t stringSize = header->stringSize;
+  if (recordEnd + stringSize != size)
+    return false;
+
+  const FileRecord* recs = reinterpret_cast<const FileRecord*>(start + sizeof(FileHeader));
+  for (uint32_t i = 0; i < header->numRecords; ++i) {
+    if ((uint64_t)recs[i].nameOffset + recs[i].nameSize > stringSize ||
+        recs[i].width == 0 || recs[i].width > 64)
+      return false;
+  }
+
+  records = recs;
+  strings = start + recordEnd;
+  numRecords = header->numRecords;
+  buffer = std::move(buf);
+  return true;
+}
+
+bool RangeDB::lookup(StringRef name, SmallRange& range) const
+{
+  const FileRecord* end = records + numRecords;
+  const FileRecord* rec = std::lower_bound(records, end, name,
+      [this](const FileRecord& r, StringRef n) { return getName(r) < n; });
+  if (rec == end || getName(*rec) != name)
+    return false;
+
+  range.Lower = rec->lower;
+  range.Upper = rec->upper;
+  range.Width = rec->width;
+  return true;
+}
+
+bool RangeDB::save(StringRef path)
+{
+  std::sort(pending.begin(), pending.end(),
+      [](const std::pair<std::string, SmallRange>& a,
+         const std::pair<std::string, SmallRange>& b) { return a.first < b.first; });
+
+  FileHeader header;
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.numRecords = pending.size();
+  header.reserved = 0;
+
+  std::vector<FileRecord> recs(pending.size());
+  uint64_t stringSize = 0;
+  for (size_t i = 0; i < pending.size(); ++i) {
+    const SmallRange& range = pending[i].second;
+    recs[i].nameOffset = stringSize;
+    recs[i].nameSize = pending[i].first.size();
+    recs[i].width = range.Width;
+    recs[i].reserved = 0;
+    recs[i].lower = range.Lower;
+    recs[i].upper = range.Upper;
+    stringSize += pending[i].first.size();
+  }
+  header.stringSize = stringSize;
+
+  return writeFileAtomically(path, [&](raw_ostream& OS) {
+    OS.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    OS.write(reinterpret_cast<const char*>(recs.data()), recs.size() * sizeof(FileRecord));
+    for (auto& entry : pending)
+      OS << entry.first;
+  });
+}
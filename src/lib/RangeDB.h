@@ -0,0 +1,64 @@
+#ifndef RANGE_DB_H
+#define RANGE_DB_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "CRange.h"
+
+// Value ranges computed by RangePass, keyed by value ID (see ValueIdPool).
+// The file is mapped into memory and searched in place, its format is
+//   header | records (sorted by name) | string table
+// Only ranges of up to 64 bits are recorded.
+class RangeDB
+{
+	struct FileHeader {
+		char magic[8];
+		llvm::support::ulittle32_t numRecords;
+		llvm::support::ulittle32_t reserved;
+		llvm::support::ulittle64_t stringSize;
+	};
+
+	struct FileRecord {
+		llvm::support::ulittle32_t nameOffset;
+		llvm::support::ulittle32_t nameSize;
+		llvm::support::ulittle32_t width;
+		llvm::support::ulittle32_t reserved;
+		llvm::support::ulittle64_t lower;
+		llvm::support::ulittle64_t upper;
+	};
+
+	static const char Magic[8];
+
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+	const FileRecord* records = nullptr;
+	const char* strings = nullptr;
+	uint32_t numRecords = 0;
+
+	// ranges to save
+	std::vector<std::pair<std::string, SmallRange> > pending;
+
+	llvm::StringRef getName(const FileRecord& rec) const {
+		return llvm::StringRef(strings + rec.nameOffset, rec.nameSize);
+	}
+
+public:
+	// Return false if the file does not exist or is not a valid database
+	bool load(llvm::StringRef path);
+	// Return false if name has no range
+	bool lookup(llvm::StringRef name, SmallRange& range) const;
+	size_t size() const { return numRecords; }
+
+	void add(llvm::StringRef name, const SmallRange& range) {
+		pending.emplace_back(name.str(), range);
+	}
+	// Write the added ranges, the loaded ones are not kept
+	bool save(llvm::StringRef path);
+};
+
+#endif
@@ -19,15 +19,20 @@
 #include <llvm/IR/InlineAsm.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/DerivedTypes.h>
-#include <llvm/IR/CallSite.h>
 #include <llvm/Pass.h>
 #include <llvm/ADT/Triple.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/ADT/SmallPtrSet.h>
-#include <llvm/ADT/Statistic.h>
 #include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Parallel.h>
 #include <llvm/Support/raw_os_ostream.h>
+#include <atomic>
+#include <mutex>
 #include <set>
 #include <map>
 #include <queue>
@@ -39,163 +44,185 @@ using namespace llvm;
 
 #define SSS_DEBUG(stmt) KA_LOG(2, stmt)
 
-STATISTIC(NumFunctions, "Total number of functions");
-STATISTIC(NumUnsafeStackFunctions, "Number of functions with unsafe stack");
-
-STATISTIC(NumAllocas, "Total number of allocas");
-STATISTIC(NumUnsafeStaticAllocas, "Number of unsafe static allocas");
-STATISTIC(NumUnsafeDynamicAllocas, "Number of unsafe dynamic allocas");
-STATISTIC(NumUnsafeStackStore, "Number of unsafe stack pointer store");
-STATISTIC(NumUnsafeStackGEP, "Number of unsafe stack pointer alrithmetic");
-STATISTIC(NumUnsafeStackCall, "Number of unsafe stack pointer passed as argument");
-STATISTIC(NumUnsafeStackRet, "Number of unsafe stack pointer returned");
-
-/// Check whether a given variable is a stack pointer
-bool SafeStackPass::isStackPointer(Value *V) {
+static cl::opt<std::string> StatsCSV(
+	"safe-stack-csv", cl::desc("Write per function safe stack stats as CSV"),
+	cl::value_desc("file"));
+
+static cl::opt<std::string> StatsJSON(
+	"safe-stack-json", cl::desc("Write per module safe stack stats as JSON"),
+	cl::value_desc("file"));
+
+const char *SafeStackPass::StatNames[NumStatKinds] = {
+	"NumAllocas",
+	"NumUnsafeStaticAllocas",
+	"NumUnsafeDynamicAllocas",
+	"NumUnsafeStackStore",
+	"NumUnsafeStackGEP",
+	"NumUnsafeStackCall",
+	"NumUnsafeStackRet",
+};
+
+const char *SafeStackPass::StatDescs[NumStatKinds] = {
+	"Total number of allocas",
+	"Number of unsafe static allocas",
+	"Number of unsafe dynamic allocas",
+	"Number of unsafe stack pointer store",
+	"Number of unsafe stack pointer alrithmetic",
+	"Number of unsafe stack pointer passed as argument",
+	"Number of unsafe stack pointer returned",
+};
+
+static std::atomic<unsigned> NextGeneration(0);
+
+SafeStackPass::SafeStackPass(GlobalContext *Ctx_)
+	: IterativeModulePass(Ctx_, "SafeStackStats"),
+	  Generation(NextGeneration++) { }
+
+// Records of the calling thread, registered with the pass on first use in
+// each generation
+std::vector<SafeStackPass::FuncStats> &SafeStackPass::getThreadStats() {
+	static thread_local unsigned OwnerGen = ~0U;
+	static thread_local std::vector<FuncStats> *Records = NULL;
+	if (OwnerGen != Generation) {
+		std::lock_guard<std::mutex> Guard(ThreadStatsLock);
+		ThreadStats.emplace_back(new std::vector<FuncStats>());
+		Records = ThreadStats.back().get();
+		OwnerGen = Generation;
+	}
+	return *Records;
+}
 
-	SmallPtrSet<Value*, 16> Visited;
-	SmallVector<Value*, 8> WorkList;
+enum { StackSource = 1, OtherSource = 2 };
 
-	Visited.insert(V);
-	WorkList.push_back(V);
+SafeStackPass::FuncFacts &SafeStackPass::getFacts(const Function *F) {
+	std::unique_ptr<FuncFacts> &FF = Facts[F];
+	if (!FF)
+		FF.reset(new FuncFacts());
+	return *FF;
+}
 
-	while (!WorkList.empty()) {
-		Value *v = WorkList.pop_back_val();
+/// Sources a value is derived from through its def chain: allocas and
+/// arguments are stack, call results and inline asm are not.
+/// GEPs only follow the base pointer, other instructions all operands.
+void SafeStackPass::computeSources(const Function *F, FuncFacts &FF) {
+	DenseMap<const Value*, unsigned> &Sources = FF.Sources;
+	auto sourceOf = [&](const Value *V) -> unsigned {
+		if (isa<Argument>(V))
+			return StackSource;
+		if (isa<InlineAsm>(V))
+			return OtherSource;
+		if (isa<Instruction>(V))
+			return Sources.lookup(V);
+		return 0;
+	};
 
-		// handle different source type
-		if (Argument *arg = dyn_cast<Argument>(v)) {
-			// FIXME: check whether an argument is ALWAYS from stack
-			//
-			SSS_DEBUG("\tARG: " << *arg);
-			if (Function *pf = arg->getParent()) {
-				SSS_DEBUG(" <<<<< " << pf->getName());
+	// PHIs may use values defined later, sweep until nothing changes
+	ReversePostOrderTraversal<const Function*> RPOT(F);
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (const BasicBlock *BB : RPOT) {
+			for (const Instruction &I : *BB) {
+				unsigned S = 0;
+				if (isa<AllocaInst>(I))
+					S = StackSource;
+				else if (isa<CallInst>(I) || isa<InvokeInst>(I))
+					S = OtherSource;
+				else if (isa<GetElementPtrInst>(I))
+					S = sourceOf(I.getOperand(0));
+				else
+					for (const Value *Op : I.operands())
+						S |= sourceOf(Op);
+
+				unsigned &Old = Sources[&I];
+				if ((Old | S) != Old) {
+					Old |= S;
+					changed = true;
+				}
 			}
-			SSS_DEBUG("\n");
-			return true;
-		} else if (InlineAsm *iasm = dyn_cast<InlineAsm>(v)) {
-			SSS_DEBUG("\t INLINE_ASM: " << iasm->getAsmString() << "\n");
-			return false;
-		}
-
-		User *u = dyn_cast<User>(v);
-		if (u == NULL) {
-			continue;
-		}
-
-		if (Constant *cv = dyn_cast<Constant>(u)) {
-			SSS_DEBUG("\tCONST: " << *cv << "\n");
-			continue;
-		}
-
-		Instruction *I = dyn_cast<Instruction>(u);
-		if (I == NULL)
-			continue;
-
-		if (isa<AllocaInst>(I)) {
-			SSS_DEBUG("\t ALLOCA: " << *I <<"\n");
-			return true;
 		}
+	}
+	FF.HasSources = true;
+}
 
-		if (isa<CallInst>(I) || isa<InvokeInst>(I))
-			// Any buffer returned by a function should
-			// never be a stack
-			return false;
+/// Check whether a given variable is a stack pointer, i.e., only derived
+/// from allocas and arguments
+bool SafeStackPass::isStackPointer(const Value *V) {
+	if (const Argument *arg = dyn_cast<Argument>(V)) {
+		// FIXME: check whether an argument is ALWAYS from stack
+		//
+		SSS_DEBUG("\tARG: " << *arg << " <<<<< " << arg->getParent()->getName() << "\n");
+		return true;
+	}
 
-		if (isa<GetElementPtrInst>(I)) {
-			// Check the base pointer only
-			//
-			Value *base = I->getOperand(0);
-			if (Visited.count(base) == 0) {
-				Visited.insert(base);
-				WorkList.push_back(base);
-			}
-			continue;
-		}
+	const Instruction *I = dyn_cast<Instruction>(V);
+	if (I == NULL)
+		return false;
 
-		// follow the def chain
-		for (User::op_iterator oi = I->op_begin(), oe = I->op_end();
-				 oi != oe; ++oi) {
-			if (Visited.count(*oi) == 0) {
-				Visited.insert(*oi);
-				WorkList.push_back(*oi);
-			}
-		}
-	}
+	const Function *F = I->getFunction();
+	FuncFacts &FF = getFacts(F);
+	if (!FF.HasSources)
+		computeSources(F, FF);
 	// by default, conservatively assumes its unsafe
-	return false;
+	return FF.Sources.lookup(I) == StackSource;
 }
 
-bool SafeStackPass::isSafeCall(CallInst *CI, unsigned ArgNo, uint64_t Size) {
+/// Whether passing an object of the given size as argument ArgNo of CI is
+/// safe, looked up in the summaries of all possible callees.
+bool SafeStackPass::isSafeCall(const CallInst *CI, unsigned ArgNo, uint64_t Size) {
 
 	// FIXME: assume inline asm as always safe
 	if (CI->isInlineAsm())
 		return true;
 
-	FuncSet &FS = Ctx->Callees[CI];
-	if (FS.empty()) {
+	auto Callees = Ctx->Callees.find(CI);
+	if (Callees == Ctx->Callees.end() || Callees->second.empty()) {
 		WARNING("Cannot find callee(s), assumes unsafe\n");
 		return true;
 	}
 
 	bool ret = true;
-	for (Function *F : FS) {
+	for (const Function *F : Callees->second) {
 		// check arg_size
-		if (!F->isVarArg() && CI->getNumArgOperands() != F->arg_size()) {
+		if (!F->isVarArg() && CI->arg_size() != F->arg_size()) {
 			WARNING("Arg mismatch: " << F->getName() << "\n");
 			continue;
 		}
 
-		std::pair<Function*, unsigned> key = std::make_pair(F, ArgNo);
-		fi_iterator fi = FuncInfo.find(key);
-		if (fi != FuncInfo.end()) {
-			ret &= fi->second;
-			continue;
-		}
-
-		// FIXME: if recursive, assume ??safe??
-		fi = FuncInfo.insert(std::make_pair(key, true)).first;
-
 #if LLVM_VERSION_MAJOR <= 4
 		if (F->doesNotCapture(ArgNo)) {
 			// LLVM 'nocapture' attribute is only set for arguments whose address
 			// is not stored, passed around, or used in any other non-trivial way.
 			// We assume that passing a pointer to an object as a 'nocapture'
 			// argument is safe.
-			fi->second = true;
 			continue;
 		}
 #endif
 
 		if (F->isIntrinsic()) {
 			// intrinsic, assumes safe
-			fi->second = true;
 			continue;
 		}
 
 		if (F->isVarArg()) {
 			// FIXME vararg assmes safe
-			fi->second = true;
 			continue;
 		}
 
 		if (F->isDeclaration()) {
-			if (SafeFuncs.count(F->getName().str())) {
-				fi->second = true;
+			if (SafeFuncs.count(F->getName().str()))
 				continue;
-			}
 
 			// try to find the definition
-			StringRef FuncName = F->getName();
+			std::string FuncName = F->getName().str();
 
 			// for unknown reason, llvm tends to use SyS for syscall
 			// making sys_* pure declaration, try to solve this here
 			//
-			if (FuncName.startswith("sys_")) {
-				std::string SyS = "SyS_" + FuncName.substr(4).str();
-				FuncName = SyS;
-			}
+			if (StringRef(FuncName).startswith("sys_"))
+				FuncName = "SyS_" + FuncName.substr(4);
 
-			auto itr = Ctx->Funcs.find(FuncName);
+			auto itr = Ctx->Funcs.find(GlobalValue::getGUID(FuncName));
 			if (itr != Ctx->Funcs.end())
 				F = itr->second;
 
@@ -203,32 +230,94 @@ bool SafeStackPass::isSafeCall(CallInst *CI, unsigned ArgNo, uint64_t Size) {
 			if (F->isDeclaration()) {
 				// no body, assumes unsafe
 				WARNING("Declaration only: " << F->getName() << "\n");
-				fi->second = false;
 				return false;
 			}
 		}
 
-		unsigned index = 0;
-		Argument *A = nullptr;
-		for (Function::arg_iterator ai = F->arg_begin(), ae = F->arg_end();
-				 ai != ae; ++ai, ++index) {
-			if (index == ArgNo) {
-				A = &*ai;
-				break;
+		const ArgSummary *S = getArgSummary(F, ArgNo, CI->getFunction());
+		bool safe = S && (Size ? S->SafeIfSized : S->SafeUnsized);
+		if (!safe)
+			SSS_DEBUG("Unsafe function: " << F->getName() << " arg " << ArgNo << "\n");
+		ret &= safe;
+	}
+	return ret;
+}
+
+/// Return NULL if the summary of F is not available to a call from Caller
+const SafeStackPass::ArgSummary *SafeStackPass::getArgSummary(const Function *F,
+		unsigned ArgNo, const Function *Caller) {
+	auto itr = ArgSummaries.find(F);
+	if (itr == ArgSummaries.end() || ArgNo >= itr->second.size())
+		return NULL;
+
+	// while summarizing, a callee outside of Callees (e.g., SyS_*) may not
+	// have been summarized yet
+	if (!Summarized) {
+		unsigned Callee = SCCOf.lookup(F), Current = SCCOf.lookup(Caller);
+		if (Callee != Current && SCCLevels[Callee] >= SCCLevels[Current])
+			return NULL;
+	}
+	return &itr->second[ArgNo];
+}
+
+/// Summaries start optimistic (safe) and only ever get refined to unsafe,
+/// so recursive SCCs are iterated until nothing changes
+void SafeStackPass::summarizeSCC(const FuncSCC &SCC) {
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (Function *F : SCC) {
+			SmallVector<ArgSummary, 4> &Sums = ArgSummaries.find(F)->second;
+			for (unsigned i = 0; i < Sums.size(); ++i) {
+				ArgSummary &S = Sums[i];
+				const Argument *A = F->getArg(i);
+				// any object size will do, GEPs are only checked against 0
+				bool SafeIfSized = S.SafeIfSized && isSafeUse(A, 1);
+				bool SafeUnsized = S.SafeUnsized && SafeIfSized && isSafeUse(A, 0);
+				if (SafeIfSized != S.SafeIfSized || SafeUnsized != S.SafeUnsized) {
+					S.SafeIfSized = SafeIfSized;
+					S.SafeUnsized = SafeUnsized;
+					changed = true;
+				}
 			}
 		}
-		assert(A != nullptr);
-		SSS_DEBUG("Check function " << F->getName() << " arg = " << *A << "\n");
+	}
+}
+
+/// Summarize the arguments of all defined functions bottom-up over the call
+/// graph, SCCs on the same level are summarized in parallel
+void SafeStackPass::computeArgSummaries() {
+	// create all tables up front, tasks only touch those of their own SCC
+	for (auto &M : Ctx->Modules) {
+		for (Function &F : *M.first) {
+			if (F.isDeclaration())
+				continue;
+			getFacts(&F);
+			if (F.isVarArg())
+				continue;
+			ArgSummaries[&F].assign(F.arg_size(), ArgSummary());
+		}
+	}
 
-		fi->second = isSafeUse(A, Size);
-		if (!fi->second)
-			SSS_DEBUG("Unsafe function: " << F->getName() << "\n");
-		ret &= fi->second;
+	getCallGraphSCCs(Ctx, SCCs, SCCLevels);
+	std::vector<std::vector<unsigned> > ByLevel;
+	for (unsigned i = 0; i < SCCs.size(); ++i) {
+		for (Function *F : SCCs[i])
+			SCCOf[F] = i;
+		if (SCCLevels[i] >= ByLevel.size())
+			ByLevel.resize(SCCLevels[i] + 1);
+		ByLevel[SCCLevels[i]].push_back(i);
 	}
-	return ret;
+
+	for (auto &Level : ByLevel) {
+		parallelForEachN(0, Level.size(), [&](size_t i) {
+			summarizeSCC(SCCs[Level[i]]);
+		});
+	}
+	Summarized = true;
 }
 
-bool SafeStackPass::isSafeGEP(GetElementPtrInst *GEP, uint64_t Size) {
+bool SafeStackPass::isSafeGEP(const GetElementPtrInst *GEP, uint64_t Size) {
 #ifdef DO_RANGE_ANALYSIS
 	Type *Ty = GEP->getPointerOperand()->getType();
 	Ty = Ty->getContainedType(0);
@@ -267,116 +356,131 @@ bool SafeStackPass::isSafeGEP(GetElementPtrInst *GEP, uint64_t Size) {
 #endif
 }
 
-/// Check whether a given value (V) should be put on the safe
-/// stack or not. The function analyzes all uses of AI and checks whether it is
-/// only accessed in a memory safe way (as decided statically).
-bool SafeStackPass::isSafeUse(Value *V, uint64_t Size) {
-	// Go through all uses of this alloca and check whether all accesses to the
-	// allocated object are statically known to be memory safe and, hence, the
-	// object can be placed on the safe stack.
-
-	SmallPtrSet<CallInst*, 4> CallSites;
-	SmallPtrSet<Value*, 16> Visited;
-	SmallVector<Value*, 8> WorkList;
-	WorkList.push_back(V);
-
-	// A DFS search through all uses of the alloca in bitcasts/PHI/GEPs/etc.
-	while (!WorkList.empty()) {
-		Value *v = WorkList.pop_back_val();
-		for (Use &UI : v->uses()) {
-			Instruction *I = dyn_cast<Instruction>(UI.getUser());
-			assert(v == UI.get());
-			if (I == NULL)
+/// Values of F whose uses are not statically known to be memory safe for
+/// an object of the given size, either directly or through values derived
+/// from them by casts/binary ops/PHIs/selects/GEPs.
+/// Stores and calls are checked by isSafeUse() for the object itself.
+const SafeStackPass::UnsafeMap &SafeStackPass::getUnsafeUses(const Function *F,
+															 uint64_t Size) {
+	FuncFacts &FF = getFacts(F);
+	auto itr = FF.Unsafe.find(Size);
+	if (itr != FF.Unsafe.end())
+		return itr->second;
+
+	UnsafeMap &Unsafe = FF.Unsafe[Size];
+	SmallVector<const Value*, 16> WorkList;
+	auto markOperands = [&](const Instruction *I, UnsafeReason R) {
+		for (const Value *Op : I->operands()) {
+			if (isa<Constant>(Op) || isa<BasicBlock>(Op))
 				continue;
+			if (Unsafe.insert(std::make_pair(Op, R)).second)
+				WorkList.push_back(Op);
+		}
+	};
 
-			// handle cast and binary ops here, opcode is not clean
-			if (isa<CastInst>(I) || isa<BinaryOperator>(I)) {
-				if (Visited.insert(I).second)
-					WorkList.push_back(I);
-				continue;
+	// forward: uses that are unsafe by themselves
+	for (const Instruction &I : instructions(F)) {
+		// handle cast and binary ops here, opcode is not clean
+		if (isa<CastInst>(I) || isa<BinaryOperator>(I))
+			continue;
+
+		switch (I.getOpcode()) {
+		case Instruction::Load:
+			// Loading from a pointer is safe
+		case Instruction::VAArg:
+			// "va-arg" from a pointer is safe
+		case Instruction::Store:
+			// Storing to the pointee is safe
+		case Instruction::PHI:
+		case Instruction::Select:
+		case Instruction::ICmp:
+		case Instruction::Switch:
+		case Instruction::Call:
+			break;
+
+		case Instruction::GetElementPtr:
+			// We assume that GEP on static alloca with constant indices is safe,
+			// otherwise a compiler would detect it and warn during compilation.
+			// However, if the array size itself is not constant, the access
+			// might still be unsafe at runtime.
+			// GEP with non-constant indices can lead to memory errors
+			if (Size == 0 ||
+				(!cast<GetElementPtrInst>(I).hasAllConstantIndices() &&
+				 !isSafeGEP(cast<GetElementPtrInst>(&I), Size))) {
+				SSS_DEBUG("Unsafe GEP " << I << "\n");
+				markOperands(&I, UnsafeGEP);
 			}
+			break;
 
-			switch (I->getOpcode()) {
-			case Instruction::Load:
-				// Loading from a pointer is safe
-				break;
-			case Instruction::VAArg:
-				// "va-arg" from a pointer is safe
-				break;
-			case Instruction::Store:
-				if (V == I->getOperand(0)) {
-					// Stored the pointer - check if the target pointer points to heap
-					//
-					if (!isStackPointer(I->getOperand(1))) {
-						if (isa<AllocaInst>(V))
-							NumUnsafeStackStore++;
-						SSS_DEBUG("Unsafe store " << *I << "\n");
-						return false;
-					}
-				}
-				// Storing to the pointee is safe
-				break;
-
-			case Instruction::GetElementPtr:
-				// We assume that GEP on static alloca with constant indices is safe,
-				// otherwise a compiler would detect it and warn during compilation.
-
-				if (Size == 0) {
-					// However, if the array size itself is not constant, the access
-					// might still be unsafe at runtime.
-					if (isa<AllocaInst>(V))
-						NumUnsafeStackGEP++;
-					SSS_DEBUG("Unsafe GEP - nc size" << *I << "\n");
-					return false;
-				}
+		case Instruction::Ret:
+			// Value returned is always considered as unsafe
+			markOperands(&I, UnsafeRet);
+			break;
 
-				if (!cast<GetElementPtrInst>(I)->hasAllConstantIndices() &&
-					!isSafeGEP(cast<GetElementPtrInst>(I), Size)) {
-					// GEP with non-constant indices can lead to memory errors
-					//
-					if (isa<AllocaInst>(V))
-						NumUnsafeStackGEP++;
-					SSS_DEBUG("Unsafe GEP - nc indices" << *I << "\n");
-					return false;
-				}
+		default:
+			// The object is unsafe if it is used in any other way.
+			markOperands(&I, UnsafeUse);
+			break;
+		}
+	}
 
-				/* fallthough */
-			case Instruction::PHI:
-			case Instruction::Select:
-				// The object can be safe or not, depending on how the result of the
-				// BitCast/PHI/Select/GEP/etc. is used.
-				if (Visited.insert(I).second)
-					WorkList.push_back(cast<Instruction>(I));
-				break;
-
-			case Instruction::ICmp:
-			case Instruction::Switch:
-				break;
-
-			case Instruction::Ret:
-				// Value returned is always considered as unsafe
-				if (isa<AllocaInst>(V))
-					NumUnsafeStackRet++;
-				SSS_DEBUG("Unsafe RET" << *I << "\n");
-				return false;
+	// backward: the object can be safe or not, depending on how the result
+	// of the BitCast/PHI/Select/GEP/etc. is used
+	while (!WorkList.empty()) {
+		const Instruction *I = dyn_cast<Instruction>(WorkList.pop_back_val());
+		if (I == NULL)
+			continue;
+		if (isa<CastInst>(I) || isa<BinaryOperator>(I) || isa<PHINode>(I) ||
+			isa<SelectInst>(I) || isa<GetElementPtrInst>(I))
+			markOperands(I, Unsafe.find(I)->second);
+	}
+	return Unsafe;
+}
 
-			case Instruction::Call: {
-				CallInst *CI = cast<CallInst>(I);
-				CallSites.insert(CI);
-				break;
-			}
+/// Check whether a given value (V) should be put on the safe
+/// stack or not. The function analyzes all uses of AI and checks whether it is
+/// only accessed in a memory safe way (as decided statically).
+bool SafeStackPass::isSafeUse(const Value *V, uint64_t Size, FuncStats *Stats) {
+	const Function *F = NULL;
+	if (const Argument *A = dyn_cast<Argument>(V))
+		F = A->getParent();
+	else if (const Instruction *I = dyn_cast<Instruction>(V))
+		F = I->getFunction();
+	assert(F != NULL);
+
+	const UnsafeMap &Unsafe = getUnsafeUses(F, Size);
+	auto itr = Unsafe.find(V);
+	if (itr != Unsafe.end()) {
+		if (Stats) {
+			if (itr->second == UnsafeGEP)
+				++Stats->Counts[NumUnsafeStackGEP];
+			else if (itr->second == UnsafeRet)
+				++Stats->Counts[NumUnsafeStackRet];
+		}
+		SSS_DEBUG("Unsafe use of " << *V << "\n");
+		return false;
+	}
 
-			default:
-				// The object is unsafe if it is used in any other way.
-				SSS_DEBUG("UNKNOWN use " << *I << "\n");
+	SmallPtrSet<const CallInst*, 4> CallSites;
+	for (const User *U : V->users()) {
+		if (const StoreInst *SI = dyn_cast<StoreInst>(U)) {
+			// Stored the pointer - check if the target pointer points to heap
+			//
+			if (SI->getValueOperand() == V &&
+				!isStackPointer(SI->getPointerOperand())) {
+				if (Stats)
+					++Stats->Counts[NumUnsafeStackStore];
+				SSS_DEBUG("Unsafe store " << *SI << "\n");
 				return false;
 			}
+		} else if (const CallInst *CI = dyn_cast<CallInst>(U)) {
+			CallSites.insert(CI);
 		}
 	}
 
 	// Handle calls at the end to minimize affects of recursion
 	bool ret = true;
-	for (CallInst *CI : CallSites) {
+	for (const CallInst *CI : CallSites) {
 		// Given we don't care about information leak attacks at this point,
 		// the object is considered safe if a pointer to it is passed to a
 		// function that only reads memory nor returns any value. This function
@@ -389,26 +493,17 @@ bool SafeStackPass::isSafeUse(Value *V, uint64_t Size) {
 			continue;
 
 		SSS_DEBUG("Check CallSite " << *CI << "\n");
-#if 0
-		CallSite CS(CI);
-		CallSite::arg_iterator B = CS.arg_begin(), E = CS.arg_end();
-		for (CallSite::arg_iterator A = B; A != E; ++A)
-			if (A->get() == V && !CS.doesNotCapture(A - B))
-			// The parameter is not marked 'nocapture' - unsafe
-			return false;
-#else
 		unsigned i = 0;
-		for (Use &A : CI->arg_operands()) {
+		for (const Use &A : CI->args()) {
 			if (A.get() == V && !isSafeCall(CI, i, Size)) {
 				// The parameter is not marked 'nocapture' - unsafe
-				//if (isa<AllocaInst>(V))
-				//	NumUnsafeStackCall++;
+				//if (Stats)
+				//	++Stats->Counts[NumUnsafeStackCall];
 				SSS_DEBUG("Unsafe call " << *CI << "\n");
 				ret = false;
 			}
 			++i;
 		}
-#endif
 	}
 
 	// All uses of the alloca are safe, we can place it on the safe stack.
@@ -416,7 +511,8 @@ bool SafeStackPass::isSafeUse(Value *V, uint64_t Size) {
 }
 
 bool SafeStackPass::runOnFunction(Function *F) {
-	++NumFunctions;
+	FuncStats FS;
+	FS.F = F;
 
 	SmallVector<AllocaInst*, 16> StaticAllocas;
 	SmallVector<AllocaInst*, 4> DynamicAllocas;
@@ -435,7 +531,7 @@ bool SafeStackPass::runOnFunction(Function *F) {
 		Instruction *I = &*It;
 
 		if (AllocaInst *AI = dyn_cast<AllocaInst>(I)) {
-			++NumAllocas;
+			++FS.Counts[NumAllocas];
 
 			uint64_t size = 0;
 			if (AI->isArrayAllocation()) {
@@ -456,14 +552,14 @@ bool SafeStackPass::runOnFunction(Function *F) {
 
 			SSS_DEBUG("Alloca:" << *AI << ", size = " << size << ", F = " << F->getName() << "\n");
 
-			if (isSafeUse(AI, size))
+			if (isSafeUse(AI, size, &FS))
 				continue;
 
 			if (AI->isStaticAlloca()) { // buffer with constant size
-				++NumUnsafeStaticAllocas;
+				++FS.Counts[NumUnsafeStaticAllocas];
 				StaticAllocas.push_back(AI);
 			} else {
-				++NumUnsafeDynamicAllocas; // buffer with variable size
+				++FS.Counts[NumUnsafeDynamicAllocas]; // buffer with variable size
 				DynamicAllocas.push_back(AI);
 			}
 
@@ -492,8 +588,8 @@ bool SafeStackPass::runOnFunction(Function *F) {
 		}
 	}
 
-	if (!StaticAllocas.empty() || !DynamicAllocas.empty())
-		++NumUnsafeStackFunctions;
+	FS.UnsafeStack = !StaticAllocas.empty() || !DynamicAllocas.empty();
+	getThreadStats().push_back(FS);
 
 	return false;
 }
@@ -520,39 +616,146 @@ bool SafeStackPass::doInitialization(Module *M) {
 }
 
 bool SafeStackPass::doFinalization(Module *M) {
+	// all module passes are done by the first finalization
+	if (StatsMerged)
+		return false;
+
+	mergeStats();
+	if (!StatsCSV.empty() && !exportStatsCSV(StatsCSV))
+		WARNING("Failed to write safe stack stats to " << StatsCSV << "\n");
+	if (!StatsJSON.empty() && !exportStatsJSON(StatsJSON))
+		WARNING("Failed to write safe stack stats to " << StatsJSON << "\n");
 	return false;
 }
 
 bool SafeStackPass::doModulePass(Module *M) {
-	bool changed = true, ret = false;
+	if (!Summarized)
+		computeArgSummaries();
+
+	// functions only share the (complete) summaries, analyze them in parallel
+	std::vector<Function*> Funcs;
+	for (Function &F : *M)
+		if (!F.isDeclaration())
+			Funcs.push_back(&F);
+
+	std::vector<char> Changed(Funcs.size(), 0);
+	parallelForEachN(0, Funcs.size(), [&](size_t i) {
+		Changed[i] = runOnFunction(Funcs[i]);
+	});
+	return std::find(Changed.begin(), Changed.end(), 1) != Changed.end();
+}
 
-	while (changed) {
-		changed = false;
-		for (Function &F : *M)
-			changed |= runOnFunction(&F);
-		ret |= changed;
+// Collect the records of all threads, sorted by module then function
+void SafeStackPass::mergeStats() {
+	for (auto &Records : ThreadStats)
+		Stats.insert(Stats.end(), Records->begin(), Records->end());
+	ThreadStats.clear();
+	// the records are freed, threads must register new ones
+	Generation = NextGeneration++;
+
+	std::sort(Stats.begin(), Stats.end(),
+		[](const FuncStats &A, const FuncStats &B) {
+			StringRef MA = A.F->getParent()->getModuleIdentifier();
+			StringRef MB = B.F->getParent()->getModuleIdentifier();
+			if (MA != MB)
+				return MA < MB;
+			return A.F->getName() < B.F->getName();
+		});
+	StatsMerged = true;
+}
+
+bool SafeStackPass::exportStatsCSV(StringRef Path) {
+	std::error_code EC;
+	raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+	if (EC)
+		return false;
+
+	OS << "module,function,UnsafeStack";
+	for (unsigned i = 0; i < NumStatKinds; ++i)
+		OS << "," << StatNames[i];
+	OS << "\n";
+
+	for (const FuncStats &FS : Stats) {
+		OS << FS.F->getParent()->getModuleIdentifier() << ","
+		   << FS.F->getName() << "," << FS.UnsafeStack;
+		for (unsigned i = 0; i < NumStatKinds; ++i)
+			OS << "," << FS.Counts[i];
+		OS << "\n";
 	}
-	return ret;
+	return !OS.has_error();
 }
 
-static void PrintStat(raw_ostream &OS, Statistic &S) {
-	OS << format("%8u %s - %s\n", S.getValue(), S.getName(), S.getDesc());
+// Modules with their totals and per function records
+bool SafeStackPass::exportStatsJSON(StringRef Path) {
+	std::error_code EC;
+	raw_fd_ostream OS(Path, EC, sys::fs::OF_Text);
+	if (EC)
+		return false;
+
+	json::OStream J(OS, 2);
+	auto writeCounts = [&](const unsigned *Counts) {
+		for (unsigned i = 0; i < NumStatKinds; ++i)
+			J.attribute(StatNames[i], Counts[i]);
+	};
+
+	J.arrayBegin();
+	for (auto B = Stats.begin(), E = Stats.end(); B != E; ) {
+		const Module *M = B->F->getParent();
+		auto End = std::find_if(B, E,
+			[M](const FuncStats &FS) { return FS.F->getParent() != M; });
+
+		unsigned Totals[NumStatKinds] = {};
+		unsigned UnsafeFuncs = 0;
+		for (auto I = B; I != End; ++I) {
+			for (unsigned i = 0; i < NumStatKinds; ++i)
+				Totals[i] += I->Counts[i];
+			UnsafeFuncs += I->UnsafeStack;
+		}
+
+		J.objectBegin();
+		J.attribute("module", M->getModuleIdentifier());
+		J.attribute("NumFunctions", (int64_t)(End - B));
+		J.attribute("NumUnsafeStackFunctions", UnsafeFuncs);
+		writeCounts(Totals);
+		J.attributeArray("functions", [&] {
+			for (auto I = B; I != End; ++I) {
+				J.objectBegin();
+				J.attribute("name", I->F->getName());
+				J.attribute("UnsafeStack", I->UnsafeStack);
+				writeCounts(I->Counts);
+				J.objectEnd();
+			}
+		});
+		J.objectEnd();
+		B = End;
+	}
+	J.arrayEnd();
+	OS << "\n";
+	return !OS.has_error();
+}
+
+static void PrintStat(raw_ostream &OS, unsigned Value, const char *Name, const char *Desc) {
+	OS << format("%8u %s - %s\n", Value, Name, Desc);
 }
 
 void SafeStackPass::dumpStats() {
+	if (!StatsMerged || !ThreadStats.empty())
+		mergeStats();
+
+	unsigned Totals[NumStatKinds] = {};
+	unsigned UnsafeFuncs = 0;
+	for (const FuncStats &FS : Stats) {
+		for (unsigned i = 0; i < NumStatKinds; ++i)
+			Totals[i] += FS.Counts[i];
+		UnsafeFuncs += FS.UnsafeStack;
+	}
+
 	outs() << "SafeStack Statistics:\n";
 
-	PrintStat(outs(), NumFunctions);
-	PrintStat(outs(), NumUnsafeStackFunctions);
+	PrintStat(outs(), Stats.size(), "NumFunctions", "Total number of functions");
+	PrintStat(outs(), UnsafeFuncs, "NumUnsafeStackFunctions", "Number of functions with unsafe stack");
 	//PrintStat(outs(), NumUnsafeStackRestorePointsFunctions);
 
-	PrintStat(outs(), NumAllocas);
-	PrintStat(outs(), NumUnsafeStaticAllocas);
-	PrintStat(outs(), NumUnsafeDynamicAllocas);
-	//PrintStat(outs(), NumUnsafeStackRestorePoints);
-
-	PrintStat(outs(), NumUnsafeStackStore);
-	PrintStat(outs(), NumUnsafeStackGEP);
-	PrintStat(outs(), NumUnsafeStackCall);
+	for (unsigned i = 0; i < NumStatKinds; ++i)
+		PrintStat(outs(), Totals[i], StatNames[i], StatDescs[i]);
 }
-
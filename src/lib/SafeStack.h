@@ -1,23 +1,96 @@
 #ifndef _SAFE_STACK_H
 #define _SAFE_STACK_H
 
+#include <memory>
+#include <mutex>
+
 #include "Global.h"
+#include "CallGraph.h"
 
 class SafeStackPass : public IterativeModulePass {
-	std::map<std::pair<Function*, unsigned>, bool> FuncInfo;
-	typedef std::map<std::pair<Function*, unsigned>, bool>::iterator fi_iterator;
-
 	std::set<std::string> SafeFuncs;
 
+	// Whether passing a stack object as an argument is safe: the callee
+	// never stores it to non-stack memory, returns it, or accesses it with
+	// unchecked GEPs (objects of unknown size allow no GEP at all)
+	struct ArgSummary {
+		bool SafeIfSized = true;
+		bool SafeUnsized = true;
+	};
+	llvm::DenseMap<const llvm::Function*, llvm::SmallVector<ArgSummary, 4> > ArgSummaries;
+	bool Summarized = false;
+
+	// call graph SCCs, bottom-up
+	std::vector<FuncSCC> SCCs;
+	std::vector<unsigned> SCCLevels;
+	llvm::DenseMap<const llvm::Function*, unsigned> SCCOf;
+
+	void computeArgSummaries();
+	void summarizeSCC(const FuncSCC&);
+	const ArgSummary *getArgSummary(const llvm::Function*, unsigned,
+									const llvm::Function*);
+
+	// why a value may be unsafe, for stats
+	enum UnsafeReason { UnsafeGEP, UnsafeRet, UnsafeUse };
+	typedef llvm::DenseMap<const llvm::Value*, UnsafeReason> UnsafeMap;
+
+	// Memoized facts of a function, each table is computed in one sweep
+	// on its first query
+	struct FuncFacts {
+		// sources each value is derived from (StackSource | OtherSource)
+		llvm::DenseMap<const llvm::Value*, unsigned> Sources;
+		bool HasSources = false;
+		// per object size, values with a (transitively) unsafe use
+		std::map<uint64_t, UnsafeMap> Unsafe;
+	};
+	llvm::DenseMap<const llvm::Function*, std::unique_ptr<FuncFacts> > Facts;
+
+	FuncFacts &getFacts(const llvm::Function*);
+	void computeSources(const llvm::Function*, FuncFacts&);
+	const UnsafeMap &getUnsafeUses(const llvm::Function*, uint64_t);
+
+	enum StatKind {
+		NumAllocas,
+		NumUnsafeStaticAllocas,
+		NumUnsafeDynamicAllocas,
+		NumUnsafeStackStore,
+		NumUnsafeStackGEP,
+		NumUnsafeStackCall,
+		NumUnsafeStackRet,
+		NumStatKinds
+	};
+	static const char *StatNames[NumStatKinds];
+	static const char *StatDescs[NumStatKinds];
+
+	struct FuncStats {
+		const llvm::Function *F;
+		bool UnsafeStack = false;
+		unsigned Counts[NumStatKinds] = {};
+	};
+
+	// Each thread appends to its own records, merged after the module passes.
+	// Merging frees them and starts a new generation, so threads register
+	// new records if more functions are analyzed afterwards.
+	unsigned Generation;
+	std::mutex ThreadStatsLock;
+	std::vector<std::unique_ptr<std::vector<FuncStats> > > ThreadStats;
+	std::vector<FuncStats> Stats;
+	bool StatsMerged = false;
+
+	std::vector<FuncStats> &getThreadStats();
+	void mergeStats();
+	bool exportStatsCSV(llvm::StringRef);
+	bool exportStatsJSON(llvm::StringRef);
+
 	bool runOnFunction(llvm::Function*);
-	bool isSafeUse(llvm::Value*, uint64_t);
-	bool isStackPointer(llvm::Value*);
-	bool isSafeCall(llvm::CallInst*, unsigned, uint64_t);
-	bool isSafeGEP(llvm::GetElementPtrInst*, uint64_t);
+	// Stats is only given for allocas
+	bool isSafeUse(const llvm::Value*, uint64_t, FuncStats *Stats = NULL);
+	bool isStackPointer(const llvm::Value*);
+	bool isSafeCall(const llvm::CallInst*, unsigned, uint64_t);
+	bool isSafeGEP(const llvm::GetElementPtrInst*, uint64_t);
 
 public:
-	SafeStackPass(GlobalContext *Ctx_)
-		: IterativeModulePass(Ctx_, "SafeStackStats") { }
+	SafeStackPass(GlobalContext *Ctx_);
 
 	virtual bool doModulePass(llvm::Module*);
 	virtual bool doInitialization(llvm::Module*);
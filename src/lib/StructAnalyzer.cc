@@ -9,8 +9,12 @@
  * For licensing details see LICENSE
  */
 
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/IR/TypeFinder.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+
+#include <cstring>
 
 #include "StructAnalyzer.h"
 #include "Annotation.h"
@@ -24,48 +28,233 @@ using namespace llvm;
 const StructType* StructInfo::maxStruct = NULL;
 unsigned StructInfo::maxStructSize = 0;
 
-void StructAnalyzer::addContainer(const StructType* container, StructInfo& containee, unsigned offset, const Module* M)
+// Shared pools
+std::vector<const Type*> StructInfo::elementTypePool;
+std::vector<StructInfo::ContainerEntry> StructInfo::containerPool;
+
+void StructInfo::finalize(Builder& builder, const StructType* st, const Module* M, const DataLayout* layout,
+                          uint64_t size)
+{
+  assert(builder.fieldSize.size() == builder.fieldFlags.size());
+  stType = st;
+  module = M;
+  dataLayout = layout;
+
+  numFields = builder.fieldFlags.size();
+  if (numFields == 0)
+    builder.fieldSize.resize(1);
+  builder.fieldSize[0] = numFields;
+
+  numFieldSize = builder.fieldSize.size();
+  numFieldOffset = builder.fieldOffset.size();
+  numRealSize = builder.fieldRealSize.size();
+  numOffsetMap = builder.offsetMap.size();
+  numTypeRanges = builder.elementType.empty() ? 0 : builder.elementType.rbegin()->first + 1;
+
+  unsigned flagWords = (numFields + sizeof(unsigned) - 1) / sizeof(unsigned);
+  record.reserve(flagBase() + flagWords);
+  record.insert(record.end(), builder.fieldSize.begin(), builder.fieldSize.end());
+  record.insert(record.end(), builder.fieldOffset.begin(), builder.fieldOffset.end());
+  record.insert(record.end(), builder.fieldRealSize.begin(), builder.fieldRealSize.end());
+  record.insert(record.end(), builder.offsetMap.begin(), builder.offsetMap.end());
+  for (unsigned i = 0; i < numTypeRanges; ++i) {
+    record.push_back(elementTypePool.size());
+    auto itr = builder.elementType.find(i);
+    if (itr != builder.elementType.end())
+      elementTypePool.insert(elementTypePool.end(), itr->second.begin(), itr->second.end());
+  }
+  record.push_back(elementTypePool.size());
+  record.resize(flagBase() + flagWords, 0);
+  if (numFields)
+    memcpy(&record[flagBase()], builder.fieldFlags.data(), numFields);
+
+  allocSize = size;
+  finalized = true;
+}
+
+static inline bool isUnionType(const StructType* st)
+{
+  return !st->isLiteral() && st->getName().startswith("union");
+}
+
+namespace {
+// Record words of a struct in the layout database:
+//   # elements | # field sizes | # field offsets | # real sizes | # offset map | # fields | # nested structs |
+//   element offsets | field sizes | field offsets | real sizes | offset map | field flags (4 per word) |
+//   nested structs (element, offset, stride, count, field)
+struct LayoutView {
+  enum { NumElements, NumFieldSize, NumFieldOffset, NumRealSize, NumOffsetMap, NumFields, NumNested, HeaderSize };
+  static const unsigned NestedSize = 5;
+  typedef ArrayRef<StructLayoutDB::Word> Words;
+
+  Words elementOffsets, fieldSize, fieldOffset, realSize, offsetMap, flags, nested;
+  unsigned numFields = 0;
+  bool valid = false;
+
+  explicit LayoutView(Words words)
+  {
+    if (words.size() < HeaderSize)
+      return;
+    numFields = words[NumFields];
+    uint64_t numFlagWords = (numFields + 3) / 4;
+    uint64_t total = HeaderSize + numFlagWords + (uint64_t)words[NumNested] * NestedSize;
+    for (unsigned i = NumElements; i <= NumOffsetMap; ++i)
+      total += words[i];
+    if (total != words.size())
+      return;
+
+    Words rest = words.drop_front(HeaderSize);
+    auto take = [&rest](uint64_t n) {
+      Words ret = rest.take_front(n);
+      rest = rest.drop_front(n);
+      return ret;
+    };
+    elementOffsets = take(words[NumElements]);
+    fieldSize = take(words[NumFieldSize]);
+    fieldOffset = take(words[NumFieldOffset]);
+    realSize = take(words[NumRealSize]);
+    offsetMap = take(words[NumOffsetMap]);
+    flags = take(numFlagWords);
+    nested = rest;
+    valid = true;
+  }
+
+  uint8_t getFlag(unsigned field) const { return (flags[field / 4] >> (8 * (field % 4))) & 0xff; }
+};
+}
+
+unsigned StructAnalyzer::internStruct(const StructType* st, const Module* M)
+{
+  auto key = std::make_pair(st, M);
+  auto itr = structIds.find(key);
+  if (itr != structIds.end())
+    return itr->second;
+
+  unsigned id = structTable.size();
+  if (!st->isLiteral())
+    id = structNames.insert(std::make_pair(getScopeName(st, M), id)).first->second;
+  if (id == structTable.size())
+    structTable.push_back(nullptr);
+
+  structIds.emplace(key, id);
+  return id;
+}
+
+void StructAnalyzer::closeContainers(StructInfo& stInfo)
 {
-  containee.addContainer(container, offset);
-  // recursively add to all nested structs
-  const StructType* ct = containee.stType;
-  for (auto subType : ct->elements()) {
-    // strip away array
-    while (const ArrayType* arrayType = dyn_cast<ArrayType>(subType))
+  // nesting is acyclic, so marking first is safe
+  if (stInfo.containersClosed)
+    return;
+  stInfo.containersClosed = true;
+
+  SmallVector<StructInfo::ContainerEntry, 8> direct(stInfo.containers().begin(), stInfo.containers().end());
+  stInfo.containerHead = StructInfo::NoContainer;
+
+  DenseSet<std::pair<const StructType*, unsigned> > seen;
+  auto add = [&](const StructType* container, unsigned offset, unsigned field, bool inUnion) {
+    if (seen.insert(std::make_pair(container, offset)).second) {
+      stInfo.addContainer(container, offset, field, inUnion);
+      containerIndex[std::make_pair(stInfo.stType, offset)].push_back(std::make_pair(container, field));
+    }
+  };
+
+  for (auto &item : direct) {
+    bool inUnion = isUnionType(item.container);
+    add(item.container, item.offset, inUnion ? 0 : item.field, inUnion);
+
+    // then everything that (transitively) contains the container
+    auto itr = structInfoMap.find(item.container);
+    assert(itr != structInfoMap.end());
+    StructInfo& outer = itr->second;
+    closeContainers(outer);
+    for (auto outerItem : outer.containers()) {
+      // a union collapses everything nested inside into a single field,
+      // at whatever level it is on the way to the outer container
+      bool collapsed = outerItem.inUnion || inUnion;
+      unsigned field = outerItem.inUnion ? outerItem.field : outerItem.field + (inUnion ? 0 : item.field);
+      add(outerItem.container, outerItem.offset + item.offset, field, collapsed);
+    }
+  }
+}
+
+void StructAnalyzer::finalize()
+{
+  for (auto &mapping : structInfoMap)
+    closeContainers(mapping.second);
+}
+
+void StructAnalyzer::getStructSignature(const StructType* st, const Module* M, const DataLayout* layout,
+                                        const StructLayoutDB::Record* rec, SmallVectorImpl<uint64_t>& sig)
+{
+  // literal structs are unified by layout only
+  sig.push_back(st->isLiteral() ? 0 : (uint64_t)internStruct(st, M) + 1);
+
+  // avoid computing the struct layout if it is known
+  const StructLayout* stLayout = nullptr;
+  LayoutView view(rec ? rec->words : LayoutView::Words());
+  if (rec != nullptr) {
+    sig.push_back(rec->allocSize);
+  } else {
+    sig.push_back(layout->getTypeAllocSize(const_cast<StructType*>(st)));
+    stLayout = layout->getStructLayout(const_cast<StructType*>(st));
+  }
+
+  for (unsigned i = 0, e = st->getNumElements(); i != e; ++i) {
+    Type* subType = st->getElementType(i);
+    sig.push_back(stLayout ? stLayout->getElementOffset(i) : (uint64_t)view.elementOffsets[i]);
+
+    uint64_t arrayElements = 1;
+    while (ArrayType* arrayType = dyn_cast<ArrayType>(subType)) {
+      arrayElements *= arrayType->getNumElements();
       subType = arrayType->getElementType();
-    if (const StructType* structType = dyn_cast<StructType>(subType)) {
-      if (!structType->isLiteral()) {
-        auto real = structMap.find(getScopeName(structType, M));
-        if (real != structMap.end())
-          structType = real->second;
-      }
-      auto itr = structInfoMap.find(structType);
-      assert(itr != structInfoMap.end());
-      StructInfo& subInfo = itr->second;
-      for (auto item : subInfo.containers) {
-        if (item.first == ct)
-          addContainer(container, subInfo, item.second + offset, M);
-      }
     }
+    sig.push_back(arrayElements);
+
+    // nested structs have been unified already
+    if (const StructType* structType = dyn_cast<StructType>(subType))
+      sig.push_back((uint64_t)(uintptr_t)&computeStructInfo(structType, M, layout));
+    else
+      sig.push_back(((uint64_t)subType->getTypeID() << 32) | layout->getTypeSizeInBits(subType));
   }
 }
 
 StructInfo& StructAnalyzer::computeStructInfo(const StructType* st, const Module* M, const DataLayout* layout)
 {
-  if (!st->isLiteral()) {
-    auto real = structMap.find(getScopeName(st, M));
-    if (real != structMap.end())
-      st = real->second;
+  auto cached = typeCache.find(st);
+  if (cached != typeCache.end())
+    return *cached->second;
+
+  const StructLayoutDB::Record* rec = findLayoutRecord(st, M, layout);
+  SmallVector<uint64_t, 16> sig;
+  getStructSignature(st, M, layout, rec, sig);
+  size_t hash = hash_combine_range(sig.begin(), sig.end());
+
+  StructInfo* stInfo = nullptr;
+  auto itr = structHashes.find(hash);
+  if (itr != structHashes.end()) {
+    // double check in case of collision
+    StructInfo* other = itr->second;
+    SmallVector<uint64_t, 16> otherSig;
+    const StructLayoutDB::Record* otherRec =
+      findLayoutRecord(other->getRealType(), other->getModule(), other->getDataLayout());
+    getStructSignature(other->getRealType(), other->getModule(), other->getDataLayout(), otherRec, otherSig);
+    if (sig == otherSig)
+      stInfo = other;
+    else
+      WARNING("struct hash collision: " << *st << " vs " << *other->getRealType() << "\n");
   }
 
-  auto itr = structInfoMap.find(st);
-  if (itr != structInfoMap.end())
-    return itr->second;
-  else
-    return addStructInfo(st, M, layout);
+  if (stInfo == nullptr) {
+    stInfo = &addStructInfo(st, M, layout, rec);
+    structHashes.emplace(hash, stInfo);
+  }
+
+  typeCache[st] = stInfo;
+  return *stInfo;
 }
 
-StructInfo& StructAnalyzer::addStructInfo(const StructType* st, const Module* M, const DataLayout* layout)
+StructInfo& StructAnalyzer::addStructInfo(const StructType* st, const Module* M, const DataLayout* layout,
+                                          const StructLayoutDB::Record* rec)
 {
   unsigned numField = 0;
   unsigned fieldIndex = 0;
@@ -75,14 +264,33 @@ StructInfo& StructAnalyzer::addStructInfo(const StructType* st, const Module* M,
   if (stInfo.isFinalized())
     return stInfo;
 
+  StructInfo::Builder builder;
+
+  // the first definition is used for lookups by name
+  unsigned id = internStruct(st, M);
+  if (structTable[id] == nullptr)
+    structTable[id] = &stInfo;
+  if (!st->isLiteral())
+    ++numDefinedStructs;
+
+  builder.addElementType(0, const_cast<StructType*>(st));
+
+  // known layout, no need to expand
+  if (rec != nullptr) {
+    numField = loadLayout(builder, st, M, layout, *rec);
+    stInfo.finalize(builder, st, M, layout, rec->allocSize);
+    loadedLayouts.insert(&stInfo);
+    StructInfo::updateMaxStruct(st, numField);
+    return stInfo;
+  }
+
   const StructLayout* stLayout = layout->getStructLayout(const_cast<StructType*>(st));
-  stInfo.addElementType(0, const_cast<StructType*>(st));
 
-  if (!st->isLiteral() && st->getName().startswith("union")) {
+  if (isUnionType(st)) {
     // handle union
-    stInfo.addFieldOffset(currentOffset);
-    stInfo.addField(1, false, false, true);
-    stInfo.addOffsetMap(numField);
+    builder.addFieldOffset(currentOffset);
+    builder.addField(1, false, false, true);
+    builder.addOffsetMap(numField);
     //deal with the struct inside this union independently:
     for (auto subType : st->elements()) {
       // deal with fixed size array of struct
@@ -98,21 +306,21 @@ StructInfo& StructAnalyzer::addStructInfo(const StructType* st, const Module* M,
         assert(subInfo.isFinalized());
         // to allow weird container_of()
         for (uint64_t i = 0; i < arraySize; ++i)
-          addContainer(st, subInfo, currentOffset + i * layout->getTypeAllocSize(subType), M);
+          subInfo.addContainer(st, currentOffset + i * layout->getTypeAllocSize(subType), 0);
       }
     }
   } else {
     for (auto subType : st->elements()) {
       currentOffset = stLayout->getElementOffset(fieldIndex++); // byte offset
-      stInfo.addFieldOffset(currentOffset);
+      builder.addFieldOffset(currentOffset);
 
       // deal with array
       bool isArray = false;
       if (const ArrayType* arrayType = dyn_cast<ArrayType>(subType)) {
-        stInfo.addRealSize(layout->getTypeAllocSize(arrayType->getElementType()) * arrayType->getNumElements());
+        builder.addRealSize(layout->getTypeAllocSize(arrayType->getElementType()) * arrayType->getNumElements());
         isArray = true;
       } else {
-        stInfo.addRealSize(layout->getTypeAllocSize(subType)); // record real size
+        builder.addRealSize(layout->getTypeAllocSize(subType)); // record real size
       }
 
       // Treat an array field as a single element of its type
@@ -124,10 +332,10 @@ StructInfo& StructAnalyzer::addStructInfo(const StructType* st, const Module* M,
       if (arrayElements == 0) arrayElements = 1;
 
       // record type after stripping array
-      stInfo.addElementType(numField, subType);
+      builder.addElementType(numField, subType);
 
       // The offset is where this element will be placed in the expanded struct
-      stInfo.addOffsetMap(numField);
+      builder.addOffsetMap(numField);
 
       // Nested struct
       if (const StructType* structType = dyn_cast<StructType>(subType)) {
@@ -137,94 +345,294 @@ StructInfo& StructAnalyzer::addStructInfo(const StructType* st, const Module* M,
 
         // for rare container_of
         for (uint64_t i = 0; i < arrayElements; ++i)
-          addContainer(st, subInfo, currentOffset + i * layout->getTypeAllocSize(subType), M);
+          subInfo.addContainer(st, currentOffset + i * layout->getTypeAllocSize(subType), numField);
 
         // Copy information from this substruct
-        stInfo.appendFields(subInfo);
-        stInfo.appendFieldOffset(subInfo);
-        stInfo.appendElementType(subInfo);
+        builder.appendFields(subInfo);
+        builder.appendFieldOffset(subInfo);
+        builder.appendElementType(numField, subInfo);
 
         numField += subInfo.getExpandedSize();
       } else {
-        stInfo.addField(1, isArray, subType->isPointerTy(), false);
+        builder.addField(1, isArray, subType->isPointerTy(), false);
         ++numField;
       }
     }
   }
 
-  stInfo.setRealType(st);
-  stInfo.setDataLayout(layout);
-  stInfo.setModule(M);
-  stInfo.finalize();
+  stInfo.finalize(builder, st, M, layout,
+                  st->isSized() ? layout->getTypeAllocSize(const_cast<StructType*>(st)) : 0);
   StructInfo::updateMaxStruct(st, numField);
 
   return stInfo;
 }
 
+uint64_t StructAnalyzer::getLayoutHash(const StructType* st, const Module* M, const DataLayout* layout)
+{
+  auto itr = layoutHashes.find(st);
+  if (itr != layoutHashes.end())
+    return itr->second;
+
+  // everything that affects the expanded struct, nested structs by name and their own hash
+  std::string buf;
+  raw_string_ostream OS(buf);
+  OS << layout->getStringRepresentation() << ";" << st->isPacked() << ";" << isUnionType(st);
+  for (Type* subType : st->elements()) {
+    OS << ";";
+    while (ArrayType* arrayType = dyn_cast<ArrayType>(subType)) {
+      OS << "[" << arrayType->getNumElements();
+      subType = arrayType->getElementType();
+    }
+    if (const StructType* structType = dyn_cast<StructType>(subType)) {
+      if (!structType->isLiteral())
+        OS << getScopeName(structType, M);
+      OS << "{" << getLayoutHash(structType, M, layout) << "}";
+    } else {
+      OS << subType->getTypeID() << ":" << (subType->isSized() ? (uint64_t)layout->getTypeSizeInBits(subType) : 0);
+    }
+  }
+
+  uint64_t hash = xxHash64(OS.str());
+  layoutHashes[st] = hash;
+  return hash;
+}
+
+const StructLayoutDB::Record* StructAnalyzer::findLayoutRecord(const StructType* st, const Module* M,
+                                                               const DataLayout* layout)
+{
+  if (!layoutDB || st->isLiteral() || st->isOpaque())
+    return nullptr;
+
+  auto itr = layoutRecords.find(st);
+  if (itr != layoutRecords.end())
+    return itr->second;
+
+  const StructLayoutDB::Record* rec = layoutDB->lookup(getScopeName(st, M));
+  if (rec != nullptr) {
+    // invalidate outdated (or corrupted) record, a new one will be written on save
+    LayoutView view(rec->words);
+    if (rec->layoutHash != getLayoutHash(st, M, layout) || !view.valid ||
+        view.elementOffsets.size() != st->getNumElements()) {
+      SA_DEBUG("Outdated layout of " << getScopeName(st, M) << "\n");
+      rec = nullptr;
+    }
+  }
+
+  layoutRecords[st] = rec;
+  return rec;
+}
+
+unsigned StructAnalyzer::loadLayout(StructInfo::Builder& builder, const StructType* st, const Module* M,
+                                    const DataLayout* layout, const StructLayoutDB::Record& rec)
+{
+  LayoutView view(rec.words);
+  assert(view.valid && "Invalid layout record");
+
+  builder.fieldSize.assign(view.fieldSize.begin(), view.fieldSize.end());
+  builder.fieldOffset.assign(view.fieldOffset.begin(), view.fieldOffset.end());
+  builder.fieldRealSize.assign(view.realSize.begin(), view.realSize.end());
+  builder.offsetMap.assign(view.offsetMap.begin(), view.offsetMap.end());
+  for (unsigned i = 0; i < view.numFields; ++i)
+    builder.fieldFlags.push_back(view.getFlag(i));
+
+  // element types are not persisted, but they can be collected without the layout
+  bool isUnion = isUnionType(st);
+  for (unsigned i = 0, e = st->getNumElements(); i != e; ++i) {
+    Type* subType = st->getElementType(i);
+    while (ArrayType* arrayType = dyn_cast<ArrayType>(subType))
+      subType = arrayType->getElementType();
+    StructInfo* subInfo = nullptr;
+    if (const StructType* structType = dyn_cast<StructType>(subType))
+      subInfo = &computeStructInfo(structType, M, layout);
+    if (isUnion)
+      continue;
+    unsigned field = builder.offsetMap[i];
+    builder.addElementType(field, subType);
+    if (subInfo != nullptr)
+      builder.appendElementType(field, *subInfo);
+  }
+
+  // direct containers
+  for (unsigned i = 0; i < view.nested.size(); i += LayoutView::NestedSize) {
+    Type* subType = st->getElementType(view.nested[i]);
+    while (ArrayType* arrayType = dyn_cast<ArrayType>(subType))
+      subType = arrayType->getElementType();
+    StructInfo& subInfo = computeStructInfo(cast<StructType>(subType), M, layout);
+    uint64_t offset = view.nested[i + 1], stride = view.nested[i + 2], count = view.nested[i + 3];
+    for (uint64_t k = 0; k < count; ++k)
+      subInfo.addContainer(st, offset + k * stride, view.nested[i + 4]);
+  }
+
+  return view.numFields;
+}
+
+bool StructAnalyzer::encodeLayout(const StructInfo& stInfo, std::vector<StructLayoutDB::Word>& words)
+{
+  const StructType* st = stInfo.stType;
+  const DataLayout* layout = stInfo.dataLayout;
+  const StructLayout* stLayout = layout->getStructLayout(const_cast<StructType*>(st));
+  bool isUnion = isUnionType(st);
+
+  // see addStructInfo() for how containers are recorded
+  std::vector<uint64_t> nested;
+  for (unsigned i = 0, e = st->getNumElements(); i != e; ++i) {
+    Type* subType = st->getElementType(i);
+    uint64_t count = 1;
+    while (ArrayType* arrayType = dyn_cast<ArrayType>(subType)) {
+      count *= arrayType->getNumElements();
+      subType = arrayType->getElementType();
+    }
+    if (!isa<StructType>(subType))
+      continue;
+    nested.push_back(i);
+    nested.push_back(isUnion ? 0 : stLayout->getElementOffset(i));
+    nested.push_back(layout->getTypeAllocSize(subType));
+    nested.push_back(count ? count : 1);
+    nested.push_back(isUnion ? 0 : stInfo.getOffset(i));
+  }
+
+  std::vector<uint64_t> values = {
+    st->getNumElements(), stInfo.numFieldSize, stInfo.numFieldOffset, stInfo.numRealSize,
+    stInfo.numOffsetMap, stInfo.numFields, nested.size() / LayoutView::NestedSize
+  };
+  for (unsigned i = 0, e = st->getNumElements(); i != e; ++i)
+    values.push_back(stLayout->getElementOffset(i));
+  for (auto v : stInfo.getFieldSizes())
+    values.push_back(v);
+  for (auto v : stInfo.getFieldOffsets())
+    values.push_back(v);
+  for (auto v : stInfo.getFieldRealSizes())
+    values.push_back(v);
+  for (auto v : stInfo.getOffsetMap())
+    values.push_back(v);
+  llvm::ArrayRef<uint8_t> flags = stInfo.getFieldFlags();
+  for (unsigned i = 0; i < flags.size(); i += 4) {
+    uint64_t word = 0;
+    for (unsigned j = 0; j < 4 && i + j < flags.size(); ++j)
+      word |= (uint64_t)flags[i + j] << (8 * j);
+    values.push_back(word);
+  }
+  values.insert(values.end(), nested.begin(), nested.end());
+
+  words.clear();
+  words.reserve(values.size());
+  for (auto v : values) {
+    // should not happen in practice
+    if (v > UINT32_MAX)
+      return false;
+    words.push_back(StructLayoutDB::Word((uint32_t)v));
+  }
+  return true;
+}
+
+void StructAnalyzer::loadLayoutDB(StringRef path)
+{
+  layoutDB.reset(new StructLayoutDB());
+  if (layoutDB->load(path)) {
+    SA_LOG("Loaded " << layoutDB->size() << " struct layouts from " << path << "\n");
+  } else {
+    WARNING("Cannot load struct layouts from " << path << ", creating a new database\n");
+  }
+}
+
+bool StructAnalyzer::saveLayoutDB(StringRef path)
+{
+  if (!layoutDB)
+    return false;
+
+  for (auto& mapping : structInfoMap) {
+    const StructInfo& stInfo = mapping.second;
+    const StructType* st = stInfo.stType;
+    if (st->isLiteral() || loadedLayouts.count(&stInfo))
+      continue;
+
+    // only the first definition of a name is persisted
+    auto id = structIds.find(std::make_pair(st, stInfo.module));
+    if (id == structIds.end() || structTable[id->second] != &stInfo)
+      continue;
+
+    std::vector<StructLayoutDB::Word> words;
+    if (!encodeLayout(stInfo, words))
+      continue;
+    layoutDB->update(getScopeName(st, stInfo.module),
+                     getLayoutHash(st, stInfo.module, stInfo.dataLayout),
+                     stInfo.allocSize, std::move(words));
+  }
+
+  if (!layoutDB->isDirty())
+    return true;
+
+  if (!layoutDB->save(path)) {
+    WARNING("Failed to save struct layouts to " << path << "\n");
+    return false;
+  }
+  return true;
+}
+
 // We adopt the approach proposed by Pearce et al. in the paper "efficient field-sensitive pointer analysis of C"
 void StructAnalyzer::run(Module* M, const DataLayout* layout)
 {
   TypeFinder usedStructTypes;
   usedStructTypes.run(*M, false);
   for (const auto &st : usedStructTypes) {
+    // intern all types, including opaque ones, so later lookups with M
+    // never need to rebuild the scope name
+    internStruct(st, M);
+
     // handle non-literal first
     if (st->isLiteral()) {
       // SA_DEBUG("Process literal struct " << *st << "\n");
-      addStructInfo(st, M, layout);
+      computeStructInfo(st, M, layout);
       continue;
     }
 
     // only add non-opaque type
     if (!st->isOpaque()) {
       SA_DEBUG("Process struct " << getScopeName(st, M) << "\n");
-      // process new struct only
-      if (structMap.insert(std::make_pair(getScopeName(st, M), st)).second) {
-        auto &stInfo = addStructInfo(st, M, layout);
+      auto &stInfo = computeStructInfo(st, M, layout);
+      if (stInfo.getRealType() == st)
         SA_LOG("Map struct " << getScopeName(st, M) << " to " << &stInfo << "\n");
-      }
     }
   }
 }
 
 const StructInfo* StructAnalyzer::getStructInfo(const StructType* st, Module* M) const
 {
-  // try struct pointer first, then name
-  auto itr = structInfoMap.find(st);
-  if (itr != structInfoMap.end())
-    return &(itr->second);
+  // all defined types seen by run() are cached
+  auto cached = typeCache.find(st);
+  if (cached != typeCache.end())
+    return cached->second;
+
+  // then interned id, e.g., for opaque types
+  auto id = structIds.find(std::make_pair(st, M));
+  if (id != structIds.end() && structTable[id->second] != nullptr)
+    return structTable[id->second];
 
+  // finally, name
   if (!st->isLiteral()) {
-    auto real = structMap.find(getScopeName(st, M));
-    //assert(real != structMap.end() && "Cannot resolve opaque struct");
-    if (real != structMap.end()) {
-      st = real->second;
-    } else {
-      WARNING("cannot find struct, scopeName: " << getScopeName(st, M) << "\n");
-      st->print(errs());
-      errs() << "\n";
-    }
+    auto real = structNames.find(getScopeName(st, M));
+    //assert(real != structNames.end() && "Cannot resolve opaque struct");
+    if (real != structNames.end() && structTable[real->second] != nullptr)
+      return structTable[real->second];
+    WARNING("cannot find struct, scopeName: " << getScopeName(st, M) << "\n");
+    st->print(errs());
+    errs() << "\n";
   }
 
-  itr = structInfoMap.find(st);
-  if (itr == structInfoMap.end())
-    return nullptr;
-  else
-    return &(itr->second);
+  return nullptr;
 }
 
 bool StructAnalyzer::getContainer(std::string stid, const Module* M, std::set<std::string> &out) const
 {
   bool ret = false;
 
-  auto real = structMap.find(stid);
-  if (real == structMap.end())
+  auto real = structNames.find(stid);
+  if (real == structNames.end() || structTable[real->second] == nullptr)
     return ret;
 
-  const StructType* st = real->second;
-  auto itr = structInfoMap.find(st);
-  assert(itr != structInfoMap.end() && "Cannot find target struct info");
-  for (auto container_pair : itr->second.containers) {
-    const StructType* container = container_pair.first;
+  const StructInfo* stInfo = structTable[real->second];
+  for (auto& item : stInfo->containers()) {
+    const StructType* container = item.container;
     if (container->isLiteral())
       continue;
     std::string id = container->getStructName().str();
@@ -241,26 +649,39 @@ bool StructAnalyzer::getContainer(std::string stid, const Module* M, std::set<st
   return ret;
 }
 
+const StructAnalyzer::ContainerList* StructAnalyzer::getContainersAt(const StructType* st, unsigned offset, Module* M) const
+{
+  // index is keyed by the canonical type
+  const StructInfo* stInfo = getStructInfo(st, M);
+  if (stInfo == nullptr)
+    return nullptr;
+
+  auto itr = containerIndex.find(std::make_pair(stInfo->getRealType(), offset));
+  if (itr == containerIndex.end())
+    return nullptr;
+  return &(itr->second);
+}
+
 void StructAnalyzer::printStructInfo() const
 {
   errs() << "----------Print StructInfo------------\n";
   for (auto const& mapping: structInfoMap) {
     errs() << "Struct " << mapping.first << ": sz < ";
     const StructInfo& info = mapping.second;
-    for (auto sz: info.fieldSize)
+    for (auto sz: info.getFieldSizes())
       errs() << sz << " ";
     errs() << ">, offset < ";
-    for (auto off: info.offsetMap)
+    for (auto off: info.getOffsetMap())
       errs() << off << " ";
     errs() << ">, fieldOffset <";
-    for (auto off: info.fieldOffset)
+    for (auto off: info.getFieldOffsets())
       errs() << off << " ";
     errs() << ">, arrayFlag <";
-    for (auto af: info.arrayFlags)
-      errs() << af << " ";
+    for (auto flag: info.getFieldFlags())
+      errs() << bool(flag & StructInfo::ArrayField) << " ";
     errs() <<">, unionFlag <";
-    for (auto uf: info.unionFlags)
-      errs() << uf << " ";
+    for (auto flag: info.getFieldFlags())
+      errs() << bool(flag & StructInfo::UnionField) << " ";
     errs() << ">\n";
   }
   errs() << "----------End of print------------\n";
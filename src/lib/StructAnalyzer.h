@@ -3,108 +3,182 @@
 
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/iterator_range.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <iterator>
+#include <memory>
 #include <vector>
 #include <set>
+#include <map>
 #include <unordered_map>
 
+#include <boost/unordered/unordered_flat_map.hpp>
+
+#include "StructDB.h"
+
 // Every struct type T is mapped to the vectors fieldSize and offsetMap.
 // If field [i] in the expanded struct T begins an embedded struct, fieldSize[i] is the # of fields in the largest such struct, else S[i] = 1.
 // Also, if a field has index (j) in the original struct, it has index offsetMap[j] in the expanded struct.
+// Once finalized, all per-field data of a struct is packed into a single record,
+// while element types and containers of all structs are kept in shared pools.
 class StructInfo
 {
-private:
-	std::vector<bool> arrayFlags;  // true if field is an array
-	std::vector<bool> pointerFlags; // true if field is a pointer
-	std::vector<bool> unionFlags; // true if field is a union
-	std::vector<unsigned> fieldSize;
-	std::vector<unsigned> offsetMap; // field index to expanded field index
-	std::vector<unsigned> fieldOffset; // field index => offset in bytes
-	std::vector<unsigned> fieldRealSize; // field index => allocation size in bytes
-
-	// field => type(s) map, stripping off arrays
-	std::unordered_map<unsigned, std::set<const llvm::Type*> > elementType;
-	
-	// the corresponding data layout for this struct
-	const llvm::DataLayout* dataLayout;
-	void setDataLayout(const llvm::DataLayout* layout) { dataLayout = layout; }
+public:
+	// per expanded field flags
+	enum FieldFlags : uint8_t {
+		ArrayField = 1 << 0,
+		PointerField = 1 << 1,
+		UnionField = 1 << 2,
+	};
 
-	// real type definition
-	const llvm::StructType* stType;
-	void setRealType(const llvm::StructType* st) { stType = st; }
+	// a struct that contains this struct at the specified offset
+	struct ContainerEntry {
+		const llvm::StructType* container;
+		unsigned offset; // byte offset of this struct inside the container
+		unsigned field; // expanded field index of this struct inside the container
+		unsigned next; // next container of the same struct in the pool
+		bool inUnion; // a union on the way to the container collapsed the field
+	};
 
-	// defining module
-	const llvm::Module* module;
-	void setModule(const llvm::Module* M) { module = M; }
+	class container_iterator {
+		unsigned idx;
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef ContainerEntry value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const ContainerEntry* pointer;
+		typedef const ContainerEntry& reference;
 
-	// container type(s), i.e., the struct(s) that contain this struct at the specified offset
-	std::set<std::pair<const llvm::StructType*, unsigned> > containers;
-	void addContainer(const llvm::StructType* st, unsigned offset)
-	{
-		containers.insert(std::make_pair(st, offset));
-	}
+		explicit container_iterator(unsigned i) : idx(i) {}
+		const ContainerEntry& operator*() const { return containerPool[idx]; }
+		const ContainerEntry* operator->() const { return &containerPool[idx]; }
+		container_iterator& operator++() { idx = containerPool[idx].next; return *this; }
+		bool operator==(const container_iterator& other) const { return idx == other.idx; }
+		bool operator!=(const container_iterator& other) const { return idx != other.idx; }
+	};
 
-	static const llvm::StructType* maxStruct;
-	static unsigned maxStructSize;
-	uint64_t allocSize;
+private:
+	static const unsigned NoContainer = ~0U;
 
-	bool finalized;
+	// Fields are collected here while the struct is being expanded
+	struct Builder {
+		std::vector<uint8_t> fieldFlags;
+		std::vector<unsigned> fieldSize;
+		std::vector<unsigned> offsetMap; // field index to expanded field index
+		std::vector<unsigned> fieldOffset; // field index => offset in bytes
+		std::vector<unsigned> fieldRealSize; // field index => allocation size in bytes
+		// field => type(s) map, stripping off arrays
+		std::map<unsigned, std::set<const llvm::Type*> > elementType;
 
-	void addOffsetMap(unsigned newOffsetMap) { offsetMap.push_back(newOffsetMap); }
-	void addField(unsigned newFieldSize, bool isArray, bool isPointer, bool isUnion)
-	{
-		fieldSize.push_back(newFieldSize);
-		arrayFlags.push_back(isArray);
-		pointerFlags.push_back(isPointer);
-		unionFlags.push_back(isUnion);
-	}
-	void addFieldOffset(unsigned newOffset) { fieldOffset.push_back(newOffset); }
-	void addRealSize(unsigned size) { fieldRealSize.push_back(size); }
-	void appendFields(const StructInfo& other)
-	{
-		if (!other.isEmpty()) {
-			fieldSize.insert(fieldSize.end(), (other.fieldSize).begin(), (other.fieldSize).end());
+		void addOffsetMap(unsigned newOffsetMap) { offsetMap.push_back(newOffsetMap); }
+		void addField(unsigned newFieldSize, bool isArray, bool isPointer, bool isUnion)
+		{
+			fieldSize.push_back(newFieldSize);
+			fieldFlags.push_back((isArray ? ArrayField : 0) | (isPointer ? PointerField : 0) | (isUnion ? UnionField : 0));
 		}
-		arrayFlags.insert(arrayFlags.end(), (other.arrayFlags).begin(), (other.arrayFlags).end());
-		pointerFlags.insert(pointerFlags.end(), (other.pointerFlags).begin(), (other.pointerFlags).end());
-		unionFlags.insert(unionFlags.end(), (other.unionFlags).begin(), (other.unionFlags).end());
-		fieldRealSize.insert(fieldRealSize.end(), (other.fieldRealSize).begin(), (other.fieldRealSize).end());
-	}
-	void appendFieldOffset(const StructInfo& other)
-	{
-		unsigned base = fieldOffset.back();
-		for (auto i : other.fieldOffset) {
-			if (i == 0) continue;
-			fieldOffset.push_back(i + base);
+		void addFieldOffset(unsigned newOffset) { fieldOffset.push_back(newOffset); }
+		void addRealSize(unsigned size) { fieldRealSize.push_back(size); }
+		void appendFields(const StructInfo& other)
+		{
+			if (!other.isEmpty()) {
+				llvm::ArrayRef<unsigned> sizes = other.getFieldSizes();
+				fieldSize.insert(fieldSize.end(), sizes.begin(), sizes.end());
+			}
+			llvm::ArrayRef<uint8_t> flags = other.getFieldFlags();
+			fieldFlags.insert(fieldFlags.end(), flags.begin(), flags.end());
+			llvm::ArrayRef<unsigned> realSizes = other.getFieldRealSizes();
+			fieldRealSize.insert(fieldRealSize.end(), realSizes.begin(), realSizes.end());
+		}
+		void appendFieldOffset(const StructInfo& other)
+		{
+			unsigned base = fieldOffset.back();
+			for (auto i : other.getFieldOffsets()) {
+				if (i == 0) continue;
+				fieldOffset.push_back(i + base);
+			}
 		}
+		void addElementType(unsigned field, const llvm::Type* type) { elementType[field].insert(type); }
+		// other is expanded starting at field base
+		void appendElementType(unsigned base, const StructInfo& other)
+		{
+			for (unsigned i = 0, e = other.numTypeRanges; i != e; ++i) {
+				llvm::ArrayRef<const llvm::Type*> types = other.getElementType(i);
+				elementType[i + base].insert(types.begin(), types.end());
+			}
+		}
+	};
+
+	// The packed record, in order:
+	// fieldSize | fieldOffset | fieldRealSize | offsetMap | elementType ranges | field flags (one byte each)
+	std::vector<unsigned> record;
+	unsigned numFieldSize = 0;
+	unsigned numFieldOffset = 0;
+	unsigned numRealSize = 0;
+	unsigned numOffsetMap = 0;
+	unsigned numTypeRanges = 0; // elementType ranges are [begin, end) indices into elementTypePool
+	unsigned numFields = 0; // # of expanded fields, i.e., # of flags
+
+	unsigned offsetBase() const { return numFieldSize; }
+	unsigned realSizeBase() const { return offsetBase() + numFieldOffset; }
+	unsigned offsetMapBase() const { return realSizeBase() + numRealSize; }
+	unsigned typeRangeBase() const { return offsetMapBase() + numOffsetMap; }
+	unsigned flagBase() const { return typeRangeBase() + numTypeRanges + 1; }
+
+	llvm::ArrayRef<unsigned> getFieldSizes() const { return llvm::ArrayRef<unsigned>(record).slice(0, numFieldSize); }
+	llvm::ArrayRef<unsigned> getFieldOffsets() const { return llvm::ArrayRef<unsigned>(record).slice(offsetBase(), numFieldOffset); }
+	llvm::ArrayRef<unsigned> getFieldRealSizes() const { return llvm::ArrayRef<unsigned>(record).slice(realSizeBase(), numRealSize); }
+	llvm::ArrayRef<unsigned> getOffsetMap() const { return llvm::ArrayRef<unsigned>(record).slice(offsetMapBase(), numOffsetMap); }
+	llvm::ArrayRef<uint8_t> getFieldFlags() const
+	{
+		if (numFields == 0)
+			return llvm::ArrayRef<uint8_t>();
+		return llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&record[flagBase()]), numFields);
 	}
-	void addElementType(unsigned field, const llvm::Type* type) { elementType[field].insert(type); }
-	void appendElementType(const StructInfo& other)
+	uint8_t getFieldFlag(unsigned field) const
 	{
-		unsigned base = fieldSize.size();
-		for (auto item : other.elementType)
-			elementType[item.first + base].insert(item.second.begin(), item.second.end());
+		assert(field < numFields);
+		return reinterpret_cast<const uint8_t*>(&record[flagBase()])[field];
 	}
 
-	// Must be called after all fields have been analyzed
-	void finalize()
+	// shared pools
+	static std::vector<const llvm::Type*> elementTypePool;
+	static std::vector<ContainerEntry> containerPool;
+
+	// head of the container list in containerPool, only direct containers
+	// are recorded until StructAnalyzer::finalize() computes the closure
+	unsigned containerHead = NoContainer;
+	bool containersClosed = false;
+	void addContainer(const llvm::StructType* st, unsigned offset, unsigned field, bool inUnion = false)
 	{
-		assert(fieldSize.size() == arrayFlags.size());
-		assert(pointerFlags.size() == arrayFlags.size());
-		assert(unionFlags.size() == arrayFlags.size());
-		unsigned numField = fieldSize.size();
-		if (numField == 0)
-			fieldSize.resize(1);
-		fieldSize[0] = numField;
-		if (stType->isSized()) 
-			allocSize = dataLayout->getTypeAllocSize(const_cast<llvm::StructType*>(stType));
-		else
-			allocSize = 0;
-		finalized = true;
+		containerPool.push_back(ContainerEntry{st, offset, field, containerHead, inUnion});
+		containerHead = containerPool.size() - 1;
 	}
 
+	// the corresponding data layout for this struct
+	const llvm::DataLayout* dataLayout = nullptr;
+
+	// real type definition
+	const llvm::StructType* stType = nullptr;
+
+	// defining module
+	const llvm::Module* module = nullptr;
+
+	static const llvm::StructType* maxStruct;
+	static unsigned maxStructSize;
+	uint64_t allocSize = 0;
+
+	bool finalized = false;
+
+	// Must be called after all fields have been analyzed, pack the builder into the record
+	void finalize(Builder& builder, const llvm::StructType* st, const llvm::Module* M, const llvm::DataLayout* layout,
+		uint64_t size);
+
 	static void updateMaxStruct(const llvm::StructType* st, unsigned structSize)
 	{
 		if (structSize > maxStructSize) {
@@ -113,7 +187,7 @@ private:
 		}
 	}
 public:
-	bool isFinalized() {
+	bool isFinalized() const {
 		return finalized;
 	}
 
@@ -121,36 +195,40 @@ public:
 	// size => # of fields????
 	// getExpandedSize => # of unrolled fields???
 
-	typedef std::vector<unsigned>::const_iterator const_iterator;
-	unsigned getSize() const { return offsetMap.size(); }
-	unsigned getExpandedSize() const { return arrayFlags.size(); }
+	unsigned getSize() const { return numOffsetMap; }
+	unsigned getExpandedSize() const { return numFields; }
 
-	bool isEmpty() const { return (fieldSize[0] == 0);}
-	bool isFieldArray(unsigned field) const { return arrayFlags.at(field); }
-	bool isFieldPointer(unsigned field) const { return pointerFlags.at(field); }
-	bool isFieldUnion(unsigned field) const { return unionFlags.at(field); }
-	unsigned getOffset(unsigned off) const { return offsetMap.at(off); }
+	bool isEmpty() const { return (record[0] == 0);}
+	bool isFieldArray(unsigned field) const { return getFieldFlag(field) & ArrayField; }
+	bool isFieldPointer(unsigned field) const { return getFieldFlag(field) & PointerField; }
+	bool isFieldUnion(unsigned field) const { return getFieldFlag(field) & UnionField; }
+	unsigned getOffset(unsigned off) const { return getOffsetMap()[off]; }
 	const llvm::Module* getModule() const { return module; }
 	const llvm::DataLayout* getDataLayout() const { return dataLayout; }
 	const llvm::StructType* getRealType() const { return stType; }
 	const uint64_t getAllocSize() const { return allocSize; }
-	unsigned getFieldRealSize(unsigned field) const { return fieldRealSize.at(field); }
-	unsigned getFieldOffset(unsigned field) const { return fieldOffset.at(field); }
-	std::set<const llvm::Type*> getElementType(unsigned field) const
+	unsigned getFieldRealSize(unsigned field) const { return getFieldRealSizes()[field]; }
+	unsigned getFieldOffset(unsigned field) const { return getFieldOffsets()[field]; }
+	llvm::ArrayRef<const llvm::Type*> getElementType(unsigned field) const
 	{
-		auto itr = elementType.find(field);
-		if (itr != elementType.end())
-			return itr->second;
-		else
-			return std::set<const llvm::Type*>();
+		if (field >= numTypeRanges)
+			return llvm::ArrayRef<const llvm::Type*>();
+		unsigned begin = record[typeRangeBase() + field];
+		unsigned end = record[typeRangeBase() + field + 1];
+		return llvm::ArrayRef<const llvm::Type*>(elementTypePool).slice(begin, end - begin);
+	}
+	llvm::iterator_range<container_iterator> containers() const
+	{
+		return llvm::make_range(container_iterator(containerHead), container_iterator(NoContainer));
 	}
 	const llvm::StructType* getContainer(const llvm::StructType* st, unsigned offset) const
 	{
 		assert(!st->isOpaque());
-		if (containers.count(std::make_pair(st, offset)) == 1)
-			return st;
-		else
-			return nullptr;
+		for (auto& entry : containers()) {
+			if (entry.container == st && entry.offset == offset)
+				return st;
+		}
+		return nullptr;
 	}
 
 	static unsigned getMaxStructSize() { return maxStructSize; }
@@ -162,32 +240,103 @@ public:
 // This pass will make GEP instruction handling easier
 class StructAnalyzer
 {
+public:
+	// (container, expanded field index of the member inside the container)
+	typedef std::vector<std::pair<const llvm::StructType*, unsigned> > ContainerList;
+
 private:
 	// Map llvm type to corresponding StructInfo
 	typedef std::unordered_map<const llvm::StructType*, StructInfo> StructInfoMap;
 	StructInfoMap structInfoMap;
 
-	// Map struct name to llvm type
-	typedef std::unordered_map<std::string, const llvm::StructType*> StructMap;
-	StructMap structMap;
+	// Struct scope names are interned into dense ids once per (type, module),
+	// so lookups do not have to rebuild and hash the scope name every time.
+	// All types with the same scope name share one id, literal structs get their own.
+	typedef std::pair<const llvm::StructType*, const llvm::Module*> StructKey;
+	struct StructKeyHash {
+		size_t operator()(const StructKey& key) const { return llvm::hash_value(key); }
+	};
+	typedef boost::unordered_flat_map<StructKey, unsigned, StructKeyHash> StructIdMap;
+	StructIdMap structIds;
+
+	// Map struct scope name to id
+	typedef std::unordered_map<std::string, unsigned> StructNameMap;
+	StructNameMap structNames;
+
+	// id => StructInfo of the first defining type, NULL if not yet defined
+	std::vector<StructInfo*> structTable;
+	size_t numDefinedStructs = 0;
+
+	// Types from different contexts are unified by their structural hash
+	// (scope name + layout), every StructType* seen is then cached to its
+	// canonical StructInfo, so resolving a type is a single pointer probe
+	typedef boost::unordered_flat_map<size_t, StructInfo*> StructHashMap;
+	StructHashMap structHashes;
+	typedef boost::unordered_flat_map<const llvm::StructType*, StructInfo*> TypeCache;
+	TypeCache typeCache;
+
+	// Persisted layouts of named structs, NULL if not used
+	std::unique_ptr<StructLayoutDB> layoutDB;
+	// stable (across runs) layout hash of each type
+	llvm::DenseMap<const llvm::StructType*, uint64_t> layoutHashes;
+	// valid database record of each type, NULL if missing or outdated
+	llvm::DenseMap<const llvm::StructType*, const StructLayoutDB::Record*> layoutRecords;
+	// structs restored from the database, no need to write them back
+	llvm::DenseSet<const StructInfo*> loadedLayouts;
+
+	// Map (member struct, byte offset) to all structs that embed the member at that offset,
+	// flattened over all nesting levels, so container_of can be resolved with a single probe.
+	// Built by finalize().
+	typedef std::pair<const llvm::StructType*, unsigned> ContainerKey;
+	struct ContainerKeyHash {
+		size_t operator()(const ContainerKey& key) const { return llvm::hash_value(key); }
+	};
+	typedef boost::unordered_flat_map<ContainerKey, ContainerList, ContainerKeyHash> ContainerIndex;
+	ContainerIndex containerIndex;
 
 	// Expand (or flatten) the specified StructType and produce StructInfo
-	StructInfo& addStructInfo(const llvm::StructType* st, const llvm::Module* M, const llvm::DataLayout* layout);
+	StructInfo& addStructInfo(const llvm::StructType* st, const llvm::Module* M, const llvm::DataLayout* layout,
+		const StructLayoutDB::Record* rec = nullptr);
 	// If st has been calculated before, return its StructInfo; otherwise, calculate StructInfo for st
 	StructInfo& computeStructInfo(const llvm::StructType* st, const llvm::Module *M, const llvm::DataLayout* layout);
-	// update container information
-	void addContainer(const llvm::StructType* container, StructInfo& containee, unsigned offset, const llvm::Module* M);
+	// Compute the structural signature of st (scope name, size, and offset and kind of each element)
+	// If rec is not NULL, offsets and size are taken from the database instead of the data layout
+	void getStructSignature(const llvm::StructType* st, const llvm::Module* M, const llvm::DataLayout* layout,
+		const StructLayoutDB::Record* rec, llvm::SmallVectorImpl<uint64_t>& sig);
+	// Hash of the layout of st that is stable across runs, used to invalidate database records
+	uint64_t getLayoutHash(const llvm::StructType* st, const llvm::Module* M, const llvm::DataLayout* layout);
+	const StructLayoutDB::Record* findLayoutRecord(const llvm::StructType* st, const llvm::Module* M,
+		const llvm::DataLayout* layout);
+	// Fill builder from a database record, return # of expanded fields
+	unsigned loadLayout(StructInfo::Builder& builder, const llvm::StructType* st, const llvm::Module* M,
+		const llvm::DataLayout* layout, const StructLayoutDB::Record& rec);
+	// Return false if the layout cannot be persisted
+	bool encodeLayout(const StructInfo& stInfo, std::vector<StructLayoutDB::Word>& words);
+	// Return the interned id of st in M, assigning a new one if necessary
+	unsigned internStruct(const llvm::StructType* st, const llvm::Module* M);
+	// compute (and memoize) the transitive containers of stInfo
+	void closeContainers(StructInfo& stInfo);
 public:
 	StructAnalyzer() = default;
 
 	// Return NULL if info not found
 	const StructInfo* getStructInfo(const llvm::StructType* st, llvm::Module* M) const;
-	size_t getSize() const { return structMap.size(); }
+	size_t getSize() const { return numDefinedStructs; }
 	bool getContainer(std::string stid, const llvm::Module* M, std::set<std::string> &out) const;
+	// Return the structs that embed st at the given byte offset, NULL if none
+	const ContainerList* getContainersAt(const llvm::StructType* st, unsigned offset, llvm::Module* M) const;
 	//bool getContainer(const llvm::StructType* st, std::set<std::string> &out) const;
 
 	void run(llvm::Module* M, const llvm::DataLayout* layout);
 
+	// Must be called before run(), a missing or invalid database is (re)created on save
+	void loadLayoutDB(llvm::StringRef path);
+	// Write new or changed layouts back, must be called after finalize()
+	bool saveLayoutDB(llvm::StringRef path);
+	size_t getNumLoadedLayouts() const { return loadedLayouts.size(); }
+	// Must be called after all modules have been analyzed
+	void finalize();
+
 	void printStructInfo() const;
 };
 
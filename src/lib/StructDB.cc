@@ -0,0 +1,116 @@
+/*
+ * Persisted struct layout database
+ *
+ * Copyright (C) 2024 Chengyu Song
+ *
+ * For licensing details see LICENSE
+ */
+
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "DBFile.h"
+#include "StructDB.h"
+
+using namespace llvm;
+
+const char StructLayoutDB::Magic[8] = {'K', 'A', 'S', 'T', 'D', 'B', '0', '1'};
+
+bool StructLayoutDB::load(StringRef path)
+{
+  std::unique_ptr<MemoryBuffer> buf = loadWithMagic(path, Magic, sizeof(FileHeader));
+  if (!buf)
+    return false;
+
+  const char* start = buf->getBufferStart();
+  uint64_t size = buf->getBufferSize();
+  const FileHeader* header = reinterpret_cast<const FileHeader*>(start);
+
+  uint64_t numRecords = header->numRecords;
+  uint64_t stringSize = header->stringSize;
+  uint64_t numWords = header->numWords;
+  uint64_t entryEnd = sizeof(FileHeader) + numRecords * sizeof(FileEntry);
+  uint64_t stringEnd = entryEnd + stringSize;
+  if (stringEnd + numWords * sizeof(Word) != size)
+    return false;
+
+  const FileEntry* entries = reinterpret_cast<const FileEntry*>(start + sizeof(FileHeader));
+  const char* strings = start + entryEnd;
+  const Word* words = reinterpret_cast<const Word*>(start + stringEnd);
+
+  records.clear();
+  for (uint64_t i = 0; i < numRecords; ++i) {
+    const FileEntry& entry = entries[i];
+    if ((uint64_t)entry.nameOffset + entry.nameSize > stringSize ||
+        entry.wordOffset + entry.numWords > numWords) {
+      records.clear();
+      return false;
+    }
+    StringRef name(strings + entry.nameOffset, entry.nameSize);
+    records[name] = Record{entry.layoutHash, entry.allocSize,
+                           ArrayRef<Word>(words + entry.wordOffset, entry.numWords)};
+  }
+
+  buffer = std::move(buf);
+  dirty = false;
+  return true;
+}
+
+bool StructLayoutDB::save(StringRef path) const
+{
+  // sort by name so the output does not depend on hashing
+  std::vector<StringRef> names;
+  names.reserve(records.size());
+  for (auto& entry : records)
+    names.push_back(entry.getKey());
+  std::sort(names.begin(), names.end());
+
+  FileHeader header;
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.numRecords = names.size();
+  header.reserved = 0;
+
+  std::vector<FileEntry> entries(names.size());
+  uint64_t stringSize = 0, numWords = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    const Record& rec = records.find(names[i])->second;
+    entries[i].nameOffset = stringSize;
+    entries[i].nameSize = names[i].size();
+    entries[i].layoutHash = rec.layoutHash;
+    entries[i].allocSize = rec.allocSize;
+    entries[i].wordOffset = numWords;
+    entries[i].numWords = rec.words.size();
+    stringSize += names[i].size();
+    numWords += rec.words.size();
+  }
+  header.stringSize = stringSize;
+  header.numWords = numWords;
+
+  return writeFileAtomically(path, [&](raw_ostream& OS) {
+    OS.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    OS.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(FileEntry));
+    for (auto name : names)
+      OS << name;
+    for (auto name : names) {
+      const Record& rec = records.find(name)->second;
+      OS.write(reinterpret_cast<const char*>(rec.words.data()), rec.words.size() * sizeof(Word));
+    }
+  });
+}
+
+const StructLayoutDB::Record* StructLayoutDB::lookup(StringRef name) const
+{
+  auto itr = records.find(name);
+  if (itr == records.end())
+    return nullptr;
+  return &itr->second;
+}
+
+void StructLayoutDB::update(StringRef name, uint64_t layoutHash, uint64_t allocSize, std::vector<Word>&& words)
+{
+  ownedWords.push_back(std::move(words));
+  records[name] = Record{layoutHash, allocSize, ownedWords.back()};
+  dirty = true;
+}
@@ -0,0 +1,69 @@
+#ifndef STRUCT_DB_H
+#define STRUCT_DB_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Persisted struct layouts, keyed by the canonical (scope) name of the struct.
+// The file is mapped into memory and records are used in place, its format is
+//   header | entries (sorted by name) | string table | record words
+// What the record words mean is up to the user (see StructAnalyzer).
+class StructLayoutDB
+{
+public:
+	typedef llvm::support::ulittle32_t Word;
+
+	struct Record {
+		uint64_t layoutHash;
+		uint64_t allocSize;
+		llvm::ArrayRef<Word> words;
+	};
+
+private:
+	struct FileHeader {
+		char magic[8];
+		llvm::support::ulittle32_t numRecords;
+		llvm::support::ulittle32_t reserved;
+		llvm::support::ulittle64_t stringSize;
+		llvm::support::ulittle64_t numWords;
+	};
+
+	struct FileEntry {
+		llvm::support::ulittle32_t nameOffset;
+		llvm::support::ulittle32_t nameSize;
+		llvm::support::ulittle64_t layoutHash;
+		llvm::support::ulittle64_t allocSize;
+		llvm::support::ulittle64_t wordOffset;
+		llvm::support::ulittle64_t numWords;
+	};
+
+	static const char Magic[8];
+
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+	llvm::StringMap<Record> records;
+	// words of records added or replaced in this run
+	std::deque<std::vector<Word> > ownedWords;
+	bool dirty = false;
+
+public:
+	// Return false if the file does not exist or is not a valid database
+	bool load(llvm::StringRef path);
+	bool save(llvm::StringRef path) const;
+
+	// Return NULL if name is not in the database
+	const Record* lookup(llvm::StringRef name) const;
+	// Add or replace the record of name
+	void update(llvm::StringRef name, uint64_t layoutHash, uint64_t allocSize, std::vector<Word>&& words);
+
+	bool isDirty() const { return dirty; }
+	size_t size() const { return records.size(); }
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Micro benchmark of the CRange fast path against llvm::ConstantRange
+ *
+ * Copyright (C) 2024 Chengyu Song
+ *
+ * For licensing details see LICENSE
+ */
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "lib/CRange.h"
+
+using namespace llvm;
+
+// results of the timed calls, so they are not optimized away
+static volatile uint64_t Sink;
+
+// Time fn over pairs of ranges, mostly of the same width, in ns per call
+template <typename R, typename Fn>
+static double measure(const std::vector<R> &Rs, unsigned long N, Fn fn) {
+  uint64_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < N; ++i)
+    sink += fn(Rs[i & 4095], Rs[(((i * 7 + 3) & ~3UL) | (i & 3)) & 4095]);
+  auto end = std::chrono::steady_clock::now();
+  Sink = sink;
+  return std::chrono::duration<double, std::nano>(end - start).count() / N;
+}
+
+int main(int argc, char **argv) {
+  unsigned long N = argc > 1 ? strtoul(argv[1], NULL, 0) : 4000000;
+
+  // the widths RangePass mostly sees, every 4th pair has the same width
+  std::mt19937_64 rng(1);
+  const unsigned Widths[] = {8, 32, 64, 64};
+  std::vector<ConstantRange> CRs;
+  std::vector<CRange> Rs;
+  for (unsigned i = 0; i < 4096; ++i) {
+    unsigned W = Widths[i % 4];
+    uint64_t a = rng() % 1000, b = a + 1 + rng() % 1000;
+    CRs.push_back(ConstantRange(APInt(W, a), APInt(W, b)));
+    Rs.push_back(CRange(CRs.back()));
+  }
+
+  auto row = [&](const char *name, double base, double fast) {
+    outs() << format("%-14s %14.1f %8.1f\n", name, base, fast);
+  };
+  outs() << left_justify("ns/op", 14) << right_justify("ConstantRange", 15)
+         << right_justify("CRange", 9) << "\n";
+
+  row("union",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.unionWith(B).isFullSet() : 0;
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.unionWith(B).isFullSet() : 0;
+      }));
+  row("safeUnion",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &B) {
+        // what safeUnion did when CRange was a ConstantRange
+        ConstantRange X = A.unionWith(B.zextOrTrunc(A.getBitWidth()));
+        return (uint64_t)(X != A);
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &B) {
+        CRange X = A;
+        return (uint64_t)X.safeUnion(B);
+      }));
+  row("intersectWith",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.intersectWith(B).isEmptySet() : 0;
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.intersectWith(B).isEmptySet() : 0;
+      }));
+  row("add",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.add(B).isFullSet() : 0;
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.add(B).isFullSet() : 0;
+      }));
+  row("sub",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.sub(B).isFullSet() : 0;
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &B) {
+        return A.getBitWidth() == B.getBitWidth() ? (uint64_t)A.sub(B).isFullSet() : 0;
+      }));
+  row("zextOrTrunc",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &) {
+        return (uint64_t)A.zextOrTrunc(A.getBitWidth() == 64 ? 32 : 64).isFullSet();
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &) {
+        return (uint64_t)A.zextOrTrunc(A.getBitWidth() == 64 ? 32 : 64).isFullSet();
+      }));
+  row("copy+compare",
+      measure(CRs, N, [](const ConstantRange &A, const ConstantRange &B) {
+        ConstantRange X = A;
+        return (uint64_t)(X != B);
+      }),
+      measure(Rs, N, [](const CRange &A, const CRange &B) {
+        CRange X = A;
+        return (uint64_t)(X != B);
+      }));
+  return 0;
+}
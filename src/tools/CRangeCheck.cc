@@ -0,0 +1,116 @@
+/*
+ * Differential check of the CRange fast path against llvm::ConstantRange
+ *
+ * Copyright (C) 2024 Chengyu Song
+ *
+ * For licensing details see LICENSE
+ */
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "lib/CRange.h"
+
+using namespace llvm;
+
+static std::mt19937_64 rng(42);
+static unsigned fails = 0;
+
+// Random range of width W, biased towards the corner cases: full and empty
+// sets, single elements, bounds near 0, the max value and the sign bit
+static ConstantRange randomRange(unsigned W) {
+  uint64_t M = SmallRange::mask(W);
+  switch (rng() % 10) {
+  case 0: return ConstantRange(W, true);
+  case 1: return ConstantRange(W, false);
+  default: break;
+  }
+  auto value = [&]() -> uint64_t {
+    switch (rng() % 6) {
+    case 0: return rng() & M;
+    case 1: return rng() % 8;
+    case 2: return (M - rng() % 8) & M;
+    case 3: return (SmallRange::signBit(W) + rng() % 5 - 2) & M;
+    default: return rng() % 300 & M;
+    }
+  };
+  uint64_t a = value(), b = value();
+  if (a == b)
+    return ConstantRange(APInt(W, a));
+  return ConstantRange(APInt(W, a), APInt(W, b));
+}
+
+static void report(const char *op, const ConstantRange &A, const ConstantRange &B,
+                   const Twine &expected, const Twine &got) {
+  if (fails++ < 20)
+    errs() << op << " " << A << " " << B << ": expected " << expected
+           << ", got " << got << "\n";
+}
+
+static void check(const char *op, const ConstantRange &A, const ConstantRange &B,
+                  const ConstantRange &expected, const CRange &got) {
+  if (CRange(expected) == got)
+    return;
+  std::string E, G;
+  raw_string_ostream(E) << expected;
+  raw_string_ostream(G) << got;
+  report(op, A, B, E, G);
+}
+
+static void check(const char *op, const ConstantRange &A, const ConstantRange &B,
+                  const APInt &expected, const APInt &got) {
+  if (expected != got)
+    report(op, A, B, toString(expected, 10, false), toString(got, 10, false));
+}
+
+int main(int argc, char **argv) {
+  unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+  const unsigned Widths[] = {1, 2, 3, 8, 16, 32, 63, 64};
+
+  for (unsigned long i = 0; i < iterations; ++i) {
+    unsigned W = Widths[rng() % 8];
+    ConstantRange A = randomRange(W), B = randomRange(W);
+    CRange a(A), b(B);
+
+    check("union", A, B, A.unionWith(B), a.unionWith(b));
+    check("intersect", A, B, A.intersectWith(B), a.intersectWith(b));
+    check("add", A, B, A.add(B), a.add(b));
+    check("sub", A, B, A.sub(B), a.sub(b));
+    check("inverse", A, B, A.inverse(), a.inverse());
+    if (A.contains(B) != a.contains(b))
+      report("contains", A, B, Twine(A.contains(B)), Twine(a.contains(b)));
+    if (A.isWrappedSet() != a.isWrappedSet())
+      report("isWrappedSet", A, B, Twine(A.isWrappedSet()), Twine(a.isWrappedSet()));
+    if (A.isSignWrappedSet() != a.isSignWrappedSet())
+      report("isSignWrappedSet", A, B, Twine(A.isSignWrappedSet()), Twine(a.isSignWrappedSet()));
+    check("umin", A, B, A.getUnsignedMin(), a.getUnsignedMin());
+    check("umax", A, B, A.getUnsignedMax(), a.getUnsignedMax());
+    check("smin", A, B, A.getSignedMin(), a.getSignedMin());
+    check("smax", A, B, A.getSignedMax(), a.getSignedMax());
+
+    for (unsigned D : Widths) {
+      if (D > W) {
+        check("zext", A, A, A.zeroExtend(D), a.zeroExtend(D));
+        check("sext", A, A, A.signExtend(D), a.signExtend(D));
+      } else if (D < W) {
+        check("trunc", A, A, A.truncate(D), a.truncate(D));
+      }
+    }
+    // results wider than 64 bits leave the fast path
+    if (W == 64)
+      check("zext128", A, A, A.zeroExtend(128), a.zeroExtend(128));
+
+    std::string S1, S2;
+    raw_string_ostream(S1) << A;
+    raw_string_ostream(S2) << a;
+    if (S1 != S2)
+      report("print", A, B, S1, S2);
+  }
+
+  outs() << iterations << " iterations, " << fails << " mismatches\n";
+  return fails != 0;
+}